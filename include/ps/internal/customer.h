@@ -69,18 +69,49 @@ class Customer {
    * \param timestamp the timestamp of the request
    */
   void WaitRequest(int timestamp);
+  /**
+   * \brief wait until the request is finished or a timeout. threadsafe
+   * \param timestamp the timestamp of the request
+   * \param timeout_ms the timeout in milliseconds
+   * \return true if the request is finished
+   */
+  bool WaitRequest(int timestamp, int timeout_ms);
+  /**
+   * \brief finish a request without waiting for the remaining responses,
+   * which are counted but ignored if they arrive later. threadsafe
+   * \param timestamp the timestamp of the request
+   */
+  void CancelRequest(int timestamp);
 
   /**
    * \brief return the number of responses received for the request. threadsafe
    * \param timestamp the timestamp of the request
    */
   int NumResponse(int timestamp);
+  /**
+   * \brief return the number of responses expected for the request. threadsafe
+   * \param timestamp the timestamp of the request
+   */
+  int NumExpected(int timestamp);
+  /**
+   * \brief expect a number of more responses for the request, such as when it
+   * is sent in chunks. It must be called before these responses can arrive.
+   * threadsafe
+   */
+  void AddExpected(int timestamp, int num);
 
   /**
    * \brief add a number of responses to timestamp
    */
   void AddResponse(int timestamp, int num = 1);
 
+  /**
+   * \brief whether the caller is the receiving thread, which runs the
+   * callbacks of requests
+   */
+  inline bool InReceivingThread() const {
+    return std::this_thread::get_id() == recv_thread_->get_id();
+  }
   /**
    * \brief accept a received message from \ref Van. threadsafe
    * \param recved the received the message
@@ -0,0 +1,99 @@
+/**
+ *  Copyright (c) 2015 by Contributors
+ */
+#ifndef PS_INTERNAL_HASH_RING_H_
+#define PS_INTERNAL_HASH_RING_H_
+#include <stdint.h>
+#include <algorithm>
+#include <utility>
+#include <vector>
+#include "ps/base.h"
+namespace ps {
+
+/**
+ * \brief the finalizer of splitmix64, a fast 64-bit mixer which spreads
+ * clustered keys evenly
+ */
+inline uint64_t SplitMix64(uint64_t x) {
+  x += 0x9e3779b97f4a7c15ULL;
+  x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+  return x ^ (x >> 31);
+}
+
+/**
+ * \brief hash a key list. It mixes four keys at a time in independent lanes,
+ * so the multiplications overlap
+ */
+inline uint64_t HashKeys(const Key* keys, size_t n) {
+  uint64_t h[4] = {n, 1, 2, 3};
+  size_t j = 0;
+  for (; j + 4 <= n; j += 4) {
+    for (int l = 0; l < 4; ++l) {
+      h[l] = (h[l] ^ keys[j + l]) * 0x9e3779b97f4a7c15ULL;
+      h[l] ^= h[l] >> 29;
+    }
+  }
+  for (; j < n; ++j) h[0] = SplitMix64(h[0] ^ keys[j]);
+  return SplitMix64(SplitMix64(SplitMix64(h[0] ^ h[1]) ^ h[2]) ^ h[3]);
+}
+
+/**
+ * \brief a consistent hashing ring of servers
+ *
+ * Every server is placed on the ring at \a num_virtual_nodes points, and a key
+ * belongs to the server of the first point at or after the hash of the key.
+ * Adding or removing a server then only moves the keys of its own points.
+ */
+class HashRing {
+ public:
+  HashRing() { }
+  /**
+   * \brief constructor
+   * \param num_servers the number of servers
+   * \param num_virtual_nodes the number of points of every server
+   */
+  HashRing(int num_servers, int num_virtual_nodes) {
+    CHECK_GT(num_servers, 0);
+    CHECK_GT(num_virtual_nodes, 0);
+    points_.reserve(num_servers * num_virtual_nodes);
+    for (int i = 0; i < num_servers; ++i) {
+      for (int v = 0; v < num_virtual_nodes; ++v) {
+        uint64_t h = SplitMix64((static_cast<uint64_t>(i) << 32) | v);
+        points_.push_back(std::make_pair(h, i));
+      }
+    }
+    std::sort(points_.begin(), points_.end());
+
+    // index the points by the top bits of hash, so a lookup only scans a few
+    // points rather than binary searching all of them
+    int bits = 1;
+    while ((1ULL << bits) < points_.size() * 4 && bits < 24) ++bits;
+    shift_ = 64 - bits;
+    first_.resize((1ULL << bits) + 1);
+    size_t j = 0;
+    for (size_t b = 0; b < first_.size(); ++b) {
+      while (j < points_.size() && (points_[j].first >> shift_) < b) ++j;
+      first_[b] = static_cast<uint32_t>(j);
+    }
+  }
+
+  /** \brief return the server owning the key */
+  int Owner(Key key) const {
+    uint64_t h = SplitMix64(key);
+    size_t j = first_[h >> shift_];
+    while (j < points_.size() && points_[j].first < h) ++j;
+    if (j == points_.size()) j = 0;
+    return points_[j].second;
+  }
+
+ private:
+  /** \brief the sorted points on the ring and their servers */
+  std::vector<std::pair<uint64_t, int>> points_;
+  /** \brief first_[b] is the first point whose hash >> shift_ is at least b */
+  std::vector<uint32_t> first_;
+  int shift_ = 0;
+};
+
+}  // namespace ps
+#endif  // PS_INTERNAL_HASH_RING_H_
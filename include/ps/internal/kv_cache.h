@@ -0,0 +1,209 @@
+/**
+ *  Copyright (c) 2015 by Contributors
+ */
+#ifndef PS_INTERNAL_KV_CACHE_H_
+#define PS_INTERNAL_KV_CACHE_H_
+#include <stdint.h>
+#include <string.h>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+#include "ps/base.h"
+#include "ps/sarray.h"
+namespace ps {
+
+/** \brief the counters of a \ref KVCache */
+struct KVCacheStats {
+  /** \brief the number of keys served by the cache */
+  uint64_t hits = 0;
+  /** \brief the number of keys not in the cache */
+  uint64_t misses = 0;
+  /** \brief the number of keys in the cache but too stale to be served */
+  uint64_t stale = 0;
+  /** \brief the number of keys evicted to make room */
+  uint64_t evictions = 0;
+  /** \brief the number of keys pulled again to learn the version of their
+   * server */
+  uint64_t refreshes = 0;
+};
+
+/**
+ * \brief a cache of pulled values, each tagged with the server it came from
+ * and the version of that server when it was sent.
+ *
+ * The version of a server is the number of pushes it has applied. The cache
+ * also tracks the latest version seen from every server, and a cached value is
+ * served only if its server has applied at most \a staleness pushes since.
+ * The latest versions come from the responses of the servers, so once the
+ * keys of a server were served by \a refresh lookups without a response from
+ * it in between, they are missed to ask it again. Otherwise a worker which
+ * only pulls would never see the pushes of others.
+ * All values have the same length. It holds at most \a capacity keys and
+ * evicts by the clock algorithm.
+ */
+template <typename Val>
+class KVCache {
+ public:
+  /**
+   * \brief constructor
+   * \param capacity the maximal number of keys
+   * \param staleness the maximal number of versions a served value can lag
+   * behind its server
+   * \param num_servers the number of servers
+   * \param refresh the maximal number of lookups served for a server without
+   * a response from it
+   */
+  KVCache(size_t capacity, int staleness, int num_servers, int refresh)
+      : capacity_(capacity), staleness_(staleness), refresh_(refresh),
+        latest_(num_servers, 0), served_(num_servers, 0), hit_(num_servers, 0) {
+    CHECK_GT(capacity, 0);
+    CHECK_GE(staleness, 0);
+    CHECK_GT(refresh, 0);
+  }
+
+  /** \brief the value length, 0 if nothing is cached yet */
+  size_t val_len() {
+    std::lock_guard<std::mutex> lk(mu_);
+    return k_;
+  }
+
+  /** \brief record the version of a server seen in a response. threadsafe */
+  void Observe(int server, int version) {
+    std::lock_guard<std::mutex> lk(mu_);
+    if (version > latest_[server]) latest_[server] = version;
+    served_[server] = 0;
+  }
+
+  /**
+   * \brief insert the values pulled from a server. Ignored if the value length
+   * differs from the cached ones. threadsafe
+   */
+  void Insert(int server, int version, const SArray<Key>& keys,
+              const SArray<Val>& vals) {
+    size_t n = keys.size();
+    if (n == 0) return;
+    size_t k = vals.size() / n;
+    if (k == 0 || k * n != vals.size()) return;
+    std::lock_guard<std::mutex> lk(mu_);
+    if (version > latest_[server]) latest_[server] = version;
+    served_[server] = 0;
+    if (k_ == 0) {
+      k_ = k;
+      vals_.resize(capacity_ * k);
+      slot_keys_.resize(capacity_);
+      referenced_.resize(capacity_, 0);
+    } else if (k != k_) {
+      return;
+    }
+    for (size_t j = 0; j < n; ++j) {
+      auto it = entries_.find(keys[j]);
+      if (it == entries_.end()) {
+        it = entries_.insert(std::make_pair(keys[j], Entry())).first;
+        it->second.slot = NewSlot(keys[j]);
+      }
+      Entry& e = it->second;
+      e.server = server;
+      e.version = version;
+      memcpy(vals_.data() + e.slot * k_, vals.data() + j * k_, k_ * sizeof(Val));
+    }
+  }
+
+  /**
+   * \brief look up keys. threadsafe
+   * \param keys the keys
+   * \param vals the values of the hits are copied into vals[j*k, (j+1)*k) for
+   * the j-th key, where k is \ref val_len. It must hold the values of all keys
+   * \param misses the positions of the keys which are not served
+   */
+  void Lookup(const SArray<Key>& keys, Val* vals, std::vector<size_t>* misses) {
+    std::lock_guard<std::mutex> lk(mu_);
+    for (size_t j = 0; j < keys.size(); ++j) {
+      auto it = entries_.find(keys[j]);
+      if (it == entries_.end()) {
+        ++stats_.misses;
+        misses->push_back(j);
+        continue;
+      }
+      const Entry& e = it->second;
+      if (latest_[e.server] - e.version > staleness_) {
+        ++stats_.stale;
+        misses->push_back(j);
+        continue;
+      }
+      if (served_[e.server] >= refresh_) {
+        ++stats_.refreshes;
+        misses->push_back(j);
+        continue;
+      }
+      ++stats_.hits;
+      hit_[e.server] = 1;
+      referenced_[e.slot] = 1;
+      memcpy(vals + j * k_, vals_.data() + e.slot * k_, k_ * sizeof(Val));
+    }
+    for (size_t i = 0; i < hit_.size(); ++i) {
+      served_[i] += hit_[i];
+      hit_[i] = 0;
+    }
+  }
+
+  /** \brief return the counters. threadsafe */
+  KVCacheStats stats() {
+    std::lock_guard<std::mutex> lk(mu_);
+    return stats_;
+  }
+
+ private:
+  struct Entry {
+    int server = 0;
+    int version = 0;
+    size_t slot = 0;
+  };
+
+  /** \brief take a slot for a key, evicting another key if full */
+  size_t NewSlot(Key key) {
+    size_t slot;
+    if (num_used_ < capacity_) {
+      slot = num_used_++;
+    } else {
+      // the clock algorithm, skip the recently hit keys once
+      while (referenced_[hand_]) {
+        referenced_[hand_] = 0;
+        hand_ = (hand_ + 1) % capacity_;
+      }
+      slot = hand_;
+      hand_ = (hand_ + 1) % capacity_;
+      entries_.erase(slot_keys_[slot]);
+      ++stats_.evictions;
+    }
+    slot_keys_[slot] = key;
+    referenced_[slot] = 0;
+    return slot;
+  }
+
+  std::mutex mu_;
+  size_t capacity_;
+  int staleness_;
+  int refresh_;
+  /** \brief the value length */
+  size_t k_ = 0;
+  /** \brief the latest version seen from every server */
+  std::vector<int> latest_;
+  /** \brief the number of lookups served for every server since its last
+   * response */
+  std::vector<int> served_;
+  /** \brief whether a server is hit in the current lookup */
+  std::vector<uint8_t> hit_;
+  std::unordered_map<Key, Entry> entries_;
+  /** \brief the values, slot i is at [i*k_, (i+1)*k_) */
+  std::vector<Val> vals_;
+  /** \brief the key in every slot */
+  std::vector<Key> slot_keys_;
+  /** \brief whether a slot is hit since the clock hand passed it */
+  std::vector<uint8_t> referenced_;
+  size_t num_used_ = 0;
+  size_t hand_ = 0;
+  KVCacheStats stats_;
+};
+
+}  // namespace ps
+#endif  // PS_INTERNAL_KV_CACHE_H_
@@ -0,0 +1,183 @@
+/**
+ *  Copyright (c) 2015 by Contributors
+ */
+#ifndef PS_INTERNAL_LOCAL_AGGREGATOR_H_
+#define PS_INTERNAL_LOCAL_AGGREGATOR_H_
+#include <stdint.h>
+#include <string.h>
+#include <algorithm>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <tuple>
+#include <unordered_map>
+#include <vector>
+#include "ps/sarray.h"
+#include "ps/internal/hash_ring.h"
+namespace ps {
+
+/**
+ * \brief sums the pushes of the workers of an app within a process, so that
+ * only one push is sent to the servers
+ *
+ * The k-th push of a key list with a command by every worker joins the group
+ * (command, key list, k), which is complete once a given number of workers
+ * joined. The values of a group are kept
+ * without copying, and the last worker joining sums them in one pass and
+ * pushes the sum. The pushes of the other workers are finished by their \a
+ * done functions once the sum is acknowledged.
+ */
+template <typename Val>
+class LocalAggregator {
+ public:
+  /** \brief the function finishing the push of a worker */
+  using Done = std::function<void()>;
+
+  /** \brief return the aggregator of an app. threadsafe */
+  static std::shared_ptr<LocalAggregator> Get(int app_id) {
+    static std::mutex mu;
+    static std::unordered_map<int, std::weak_ptr<LocalAggregator>> aggregators;
+    std::lock_guard<std::mutex> lk(mu);
+    auto& weak = aggregators[app_id];
+    std::shared_ptr<LocalAggregator> p = weak.lock();
+    if (!p) {
+      p.reset(new LocalAggregator());
+      weak = p;
+    }
+    return p;
+  }
+
+  /** \brief forget the pushes of a worker which leaves. threadsafe */
+  void Leave(int customer_id) {
+    std::lock_guard<std::mutex> lk(mu_);
+    for (auto it = iters_.begin(); it != iters_.end(); ) {
+      if (std::get<0>(it->first) == customer_id) {
+        it = iters_.erase(it);
+      } else {
+        ++it;
+      }
+    }
+  }
+
+  /**
+   * \brief join a push. threadsafe
+   * \param customer_id the customer id of the worker
+   * \param num_workers the number of workers in a group
+   * \param cmd the command of the push
+   * \param keys the pushed keys
+   * \param vals the pushed values, which must not be changed until the push
+   * is finished
+   * \param lens the pushed value lengths, could be empty. They must be the
+   * same for all workers, as the keys
+   * \param done finishes the push if the worker is not the last to join
+   * \param sum set to the summed values if the worker is the last
+   * \param dones set to the done functions of the other workers if the worker
+   * is the last
+   * \return true if the worker is the last to join, it should then push \a
+   * sum and call \a dones once acknowledged
+   */
+  bool Join(int customer_id, int num_workers, int cmd, const SArray<Key>& keys,
+            const SArray<Val>& vals, const SArray<int>& lens,
+            const Done& done, SArray<Val>* sum, std::vector<Done>* dones) {
+    if (num_workers <= 1) {
+      *sum = vals;
+      return true;
+    }
+    uint64_t hash = HashKeys(keys.data(), keys.size());
+    std::shared_ptr<Group> group;
+    GroupKey gkey;
+    {
+      std::lock_guard<std::mutex> lk(mu_);
+      int iter = iters_[std::make_tuple(customer_id, cmd, hash)]++;
+      gkey = std::make_tuple(cmd, hash, iter);
+      auto& g = groups_[gkey];
+      if (!g) {
+        g = std::make_shared<Group>();
+        g->expected = num_workers;
+      }
+      group = g;
+    }
+
+    {
+      std::lock_guard<std::mutex> lk(group->mu);
+      if (group->inputs.empty()) {
+        group->keys = keys;
+        group->lens = lens;
+      } else {
+        CHECK_EQ(keys.size(), group->keys.size());
+        CHECK(keys.data() == group->keys.data() ||
+              !memcmp(keys.data(), group->keys.data(), keys.size() * sizeof(Key)))
+            << "different key lists are aggregated";
+        CHECK_EQ(lens.size(), group->lens.size()) << "unmatched value lengths";
+        CHECK(lens.data() == group->lens.data() ||
+              !memcmp(lens.data(), group->lens.data(), lens.size() * sizeof(int)))
+            << "unmatched value lengths";
+        CHECK_EQ(vals.size(), group->inputs[0].size()) << "unmatched value length";
+      }
+      group->inputs.push_back(vals);
+      if (static_cast<int>(group->inputs.size()) < group->expected) {
+        group->dones.push_back(done);
+        return false;
+      }
+    }
+
+    // the last one, no one else touches the group from now on
+    {
+      std::lock_guard<std::mutex> lk(mu_);
+      groups_.erase(gkey);
+    }
+    Sum(group->inputs, sum);
+    dones->swap(group->dones);
+    return true;
+  }
+
+ private:
+  LocalAggregator() { }
+  /** \brief (command, hash of keys, k) of the k-th push of a key list */
+  using GroupKey = std::tuple<int, uint64_t, int>;
+  struct Group {
+    std::mutex mu;
+    /** \brief the number of workers expected to join */
+    int expected = 0;
+    SArray<Key> keys;
+    SArray<int> lens;
+    /** \brief the values pushed by the workers joined */
+    std::vector<SArray<Val>> inputs;
+    /** \brief the done functions of all but the last worker */
+    std::vector<Done> dones;
+  };
+
+  /**
+   * \brief sum the inputs into a new array. It goes block by block, so that a
+   * block of the sum stays in cache while all inputs are added to it, and the
+   * inner loops are vectorized by the compiler
+   */
+  static void Sum(const std::vector<SArray<Val>>& inputs, SArray<Val>* sum) {
+    size_t n = inputs[0].size();
+    SArray<Val> out;
+    out.reset(new Val[n], n, [](Val* p) { delete [] p; });
+    Val* dst = out.data();
+    const size_t kBlock = 4096;
+    for (size_t begin = 0; begin < n; begin += kBlock) {
+      size_t len = std::min(kBlock, n - begin);
+      Val* d = dst + begin;
+      const Val* a = inputs[0].data() + begin;
+      const Val* b = inputs[1].data() + begin;
+      for (size_t i = 0; i < len; ++i) d[i] = a[i] + b[i];
+      for (size_t j = 2; j < inputs.size(); ++j) {
+        const Val* c = inputs[j].data() + begin;
+        for (size_t i = 0; i < len; ++i) d[i] += c[i];
+      }
+    }
+    *sum = out;
+  }
+
+  std::mutex mu_;
+  /** \brief the number of pushes of (customer id, command, hash of keys) */
+  std::map<std::tuple<int, int, uint64_t>, int> iters_;
+  std::map<GroupKey, std::shared_ptr<Group>> groups_;
+};
+
+}  // namespace ps
+#endif  // PS_INTERNAL_LOCAL_AGGREGATOR_H_
@@ -139,7 +139,8 @@ struct Meta {
   /** \brief default constructor */
   Meta() : head(kEmpty), app_id(kEmpty), customer_id(kEmpty),
            timestamp(kEmpty), sender(kEmpty), recver(kEmpty),
-           request(false), push(false), simple_app(false) {}
+           request(false), push(false), pull(false), simple_app(false),
+           version(0), priority(0), chunk_begin(0), clock(0) {}
   std::string DebugString() const {
     std::stringstream ss;
     if (sender == Node::kEmpty) {
@@ -157,6 +158,11 @@ struct Meta {
          << ", customer_id=" << customer_id
          << ", simple_app=" << simple_app
          << ", push=" << push;
+      if (pull) ss << ", pull=" << pull;
+      if (version) ss << ", version=" << version;
+      if (priority) ss << ", priority=" << priority;
+      if (chunk_begin) ss << ", chunk_begin=" << chunk_begin;
+      if (clock) ss << ", clock=" << clock;
     }
     if (head != kEmpty) ss << ", head=" << head;
     if (body.size()) ss << ", body=" << body;
@@ -183,8 +189,20 @@ struct Meta {
   bool request;
   /** \brief whether or not a push message */
   bool push;
+  /** \brief whether or not a push message also pulls the updated values */
+  bool pull;
   /** \brief whether or not it's for SimpleApp */
   bool simple_app;
+  /** \brief the version of the sender's data, such as the number of pushes
+   * a server has applied */
+  int version;
+  /** \brief the priority of sending, larger is sent first */
+  int priority;
+  /** \brief for a request sent in chunks, the position of the first key of
+   * this chunk in the whole request to the receiver. 0 otherwise */
+  int chunk_begin;
+  /** \brief the clock of the sending worker, see \ref KVWorker::set_clock */
+  int clock;
   /** \brief an string body */
   std::string body;
   /** \brief data type of message.data[i] */
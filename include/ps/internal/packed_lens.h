@@ -0,0 +1,127 @@
+/**
+ *  Copyright (c) 2015 by Contributors
+ */
+#ifndef PS_INTERNAL_PACKED_LENS_H_
+#define PS_INTERNAL_PACKED_LENS_H_
+#include <stdint.h>
+#include <string.h>
+#include <algorithm>
+#include "ps/sarray.h"
+#include "ps/internal/message.h"
+namespace ps {
+
+/**
+ * \brief the prefix sum of value lengths, namely offsets[0] = 0 and
+ * offsets[j+1] = offsets[j] + lens[j], so offsets must hold n + 1 numbers.
+ *
+ * It goes 4 lengths at a time, summing them among themselves first, so that
+ * only one add per 4 lengths depends on the running sum.
+ */
+inline void LensToOffsets(const int* lens, size_t n, size_t* offsets) {
+  size_t sum = 0;
+  offsets[0] = 0;
+  size_t j = 0;
+  for (; j + 4 <= n; j += 4) {
+    size_t a = lens[j];
+    size_t b = a + lens[j+1];
+    size_t c = b + lens[j+2];
+    size_t d = c + lens[j+3];
+    offsets[j+1] = sum + a;
+    offsets[j+2] = sum + b;
+    offsets[j+3] = sum + c;
+    offsets[j+4] = sum + d;
+    sum += d;
+  }
+  for (; j < n; ++j) {
+    sum += lens[j];
+    offsets[j+1] = sum;
+  }
+}
+
+/** \brief the bytes before the bits of bitpacked lens */
+static const size_t kPackedLensHeader = sizeof(int32_t) + 1;
+
+/**
+ * \brief add value lengths into a message, bitpacked if it is smaller.
+ *
+ * The packed form is the minimal length as an int32, then the number of bits w
+ * per length as a byte, and then every length minus the minimum in w bits,
+ * lowest bits first. Lengths in a small range, the common case, take a few
+ * bits each, and equal lengths take none. It is marked by data type UINT8
+ * rather than INT32, see \ref GetLens.
+ */
+inline void AddLens(const SArray<int>& lens, Message* msg) {
+  size_t n = lens.size();
+  if (n == 0) {
+    msg->AddData(lens);
+    return;
+  }
+  int lo = lens[0], hi = lens[0];
+  for (size_t j = 1; j < n; ++j) {
+    lo = std::min(lo, lens[j]);
+    hi = std::max(hi, lens[j]);
+  }
+  uint32_t range = static_cast<uint32_t>(hi) - static_cast<uint32_t>(lo);
+  int width = 0;
+  while (width < 32 && (range >> width)) ++width;
+  size_t bytes = kPackedLensHeader + (n * width + 7) / 8;
+  if (bytes >= n * sizeof(int)) {
+    msg->AddData(lens);
+    return;
+  }
+  SArray<uint8_t> packed(bytes);
+  uint8_t* p = packed.data();
+  int32_t base = lo;
+  memcpy(p, &base, sizeof(base));
+  p[sizeof(base)] = static_cast<uint8_t>(width);
+  p += kPackedLensHeader;
+  uint64_t bits = 0;
+  int num_bits = 0;
+  for (size_t j = 0; width && j < n; ++j) {
+    bits |= static_cast<uint64_t>(static_cast<uint32_t>(lens[j] - lo)) << num_bits;
+    num_bits += width;
+    while (num_bits >= 8) {
+      *p++ = static_cast<uint8_t>(bits);
+      bits >>= 8;
+      num_bits -= 8;
+    }
+  }
+  if (num_bits) *p = static_cast<uint8_t>(bits);
+  msg->AddData(packed);
+}
+
+/**
+ * \brief get the lengths of \a n values from msg.data[i], which is added by
+ * \ref AddLens
+ */
+inline SArray<int> GetLens(const Message& msg, size_t i, size_t n) {
+  if (i >= msg.meta.data_type.size() || msg.meta.data_type[i] != UINT8) {
+    return SArray<int>(msg.data[i]);
+  }
+  const auto& data = msg.data[i];
+  CHECK_GE(data.size(), kPackedLensHeader);
+  int32_t base;
+  memcpy(&base, data.data(), sizeof(base));
+  int width = static_cast<uint8_t>(data[sizeof(base)]);
+  CHECK_LE(width, 32);
+  CHECK_EQ(data.size(), kPackedLensHeader + (n * width + 7) / 8);
+  SArray<int> lens(n, base);
+  if (width == 0) return lens;
+  const uint8_t* p = reinterpret_cast<const uint8_t*>(data.data()) + kPackedLensHeader;
+  uint64_t mask = (static_cast<uint64_t>(1) << width) - 1;
+  uint64_t bits = 0;
+  int num_bits = 0;
+  for (size_t j = 0; j < n; ++j) {
+    while (num_bits < width) {
+      bits |= static_cast<uint64_t>(*p++) << num_bits;
+      num_bits += 8;
+    }
+    lens[j] = static_cast<int>(base + static_cast<uint32_t>(bits & mask));
+    bits >>= width;
+    num_bits -= width;
+  }
+  return lens;
+}
+
+}  // namespace ps
+#endif  // PS_INTERNAL_PACKED_LENS_H_
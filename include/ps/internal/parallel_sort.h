@@ -5,9 +5,12 @@
  */
 #ifndef PS_INTERNAL_PARALLEL_SORT_H_
 #define PS_INTERNAL_PARALLEL_SORT_H_
+#include <string.h>
 #include <functional>
 #include <thread>
 #include <algorithm>
+#include <type_traits>
+#include <vector>
 #include "ps/sarray.h"
 namespace ps {
 
@@ -32,6 +35,16 @@ void ParallelSort(T* data, size_t len, size_t grainsize, const Fn& cmp) {
     std::inplace_merge(data, data + len/2, data + len, cmp);
   }
 }
+
+/**
+ * \brief run fn(0), ..., fn(num_chunks-1), each on its own thread
+ */
+inline void ParallelFor(size_t num_chunks, const std::function<void(size_t)>& fn) {
+  std::vector<std::thread> threads;
+  for (size_t c = 1; c < num_chunks; ++c) threads.emplace_back(fn, c);
+  if (num_chunks) fn(0);
+  for (auto& t : threads) t.join();
+}
 }  // namespace
 
 /**
@@ -54,5 +67,86 @@ void ParallelSort(SArray<T>* arr,
   ParallelSort(arr->data(), arr->size(), grainsize, cmp);
 }
 
+/**
+ * \brief Parallel LSD radix sort of unsigned integer keys with their values
+ *
+ * It sorts a byte of the keys per pass, and skips the bytes which are equal in
+ * all keys, so keys in a small range take only a few passes. Every pass is
+ * split into \a num_threads chunks, each counting and then scattering its own
+ * part. The sort is stable.
+ *
+ * \param keys the keys
+ * \param vals the values, vals[i] moves together with keys[i]
+ * \param len the number of keys
+ * \param num_threads number of threads
+ */
+template<typename K, typename V>
+void ParallelRadixSort(K* keys, V* vals, size_t len, int num_threads = 2) {
+  static_assert(std::is_unsigned<K>::value, "radix sort needs unsigned keys");
+  if (len < 2) return;
+  const size_t kGrainSize = 1 << 16;
+  size_t num_chunks = std::max(
+      std::min((size_t)std::max(num_threads, 1), len / kGrainSize), (size_t)1);
+  size_t chunk = (len + num_chunks - 1) / num_chunks;
+  auto begin = [chunk](size_t c) { return c * chunk; };
+  auto end = [chunk, len](size_t c) { return std::min((c + 1) * chunk, len); };
+
+  // the bits which differ among the keys
+  std::vector<K> diff(num_chunks, 0);
+  ParallelFor(num_chunks, [&](size_t c) {
+      K d = 0;
+      for (size_t i = begin(c); i < end(c); ++i) d |= keys[i] ^ keys[0];
+      diff[c] = d;
+    });
+  K varying = 0;
+  for (K d : diff) varying |= d;
+
+  std::vector<K> tmp_keys;
+  std::vector<V> tmp_vals;
+  K* src_k = keys; V* src_v = vals;
+  K* dst_k = nullptr; V* dst_v = nullptr;
+  std::vector<size_t> count(num_chunks * 256);
+  for (size_t shift = 0; shift < sizeof(K) * 8; shift += 8) {
+    if (((varying >> shift) & 0xff) == 0) continue;
+    if (tmp_keys.empty()) {
+      tmp_keys.resize(len);
+      tmp_vals.resize(len);
+      dst_k = tmp_keys.data();
+      dst_v = tmp_vals.data();
+    }
+    std::fill(count.begin(), count.end(), 0);
+    ParallelFor(num_chunks, [&](size_t c) {
+        size_t* cnt = &count[c * 256];
+        for (size_t i = begin(c); i < end(c); ++i) ++cnt[(src_k[i] >> shift) & 0xff];
+      });
+    // the first position of every (digit, chunk), ordered by digit and then
+    // by chunk to keep the sort stable
+    size_t sum = 0;
+    for (size_t d = 0; d < 256; ++d) {
+      for (size_t c = 0; c < num_chunks; ++c) {
+        size_t n = count[c * 256 + d];
+        count[c * 256 + d] = sum;
+        sum += n;
+      }
+    }
+    ParallelFor(num_chunks, [&](size_t c) {
+        size_t* pos = &count[c * 256];
+        for (size_t i = begin(c); i < end(c); ++i) {
+          size_t p = pos[(src_k[i] >> shift) & 0xff]++;
+          dst_k[p] = src_k[i];
+          dst_v[p] = src_v[i];
+        }
+      });
+    std::swap(src_k, dst_k);
+    std::swap(src_v, dst_v);
+  }
+  if (src_k != keys) {
+    ParallelFor(num_chunks, [&](size_t c) {
+        memcpy(keys + begin(c), src_k + begin(c), (end(c) - begin(c)) * sizeof(K));
+        memcpy(vals + begin(c), src_v + begin(c), (end(c) - begin(c)) * sizeof(V));
+      });
+  }
+}
+
 }  // namespace ps
 #endif  // PS_INTERNAL_PARALLEL_SORT_H_
@@ -5,6 +5,8 @@
 #define PS_INTERNAL_POSTOFFICE_H_
 #include <mutex>
 #include <algorithm>
+#include <thread>
+#include <unordered_set>
 #include <vector>
 #include "ps/range.h"
 #include "ps/internal/env.h"
@@ -55,6 +57,18 @@ class Postoffice {
    * \return return nullptr if doesn't exist and timeout
    */
   Customer* GetCustomer(int app_id, int customer_id, int timeout = 0) const;
+  /**
+   * \brief pass a data message to its customer. threadsafe
+   *
+   * If the customer has not been created yet, the message is held and passed
+   * to the customer once it is added, so the caller never blocks. It fails if
+   * the customer is not added within 5 sec. A message for a customer already
+   * removed, such as a late response, is dropped.
+   * \param app_id the application id
+   * \param customer_id the customer id
+   * \param msg the message
+   */
+  void Deliver(int app_id, int customer_id, const Message& msg);
   /**
    * \brief get the id of a node (group), threadsafe
    *
@@ -163,13 +177,31 @@ class Postoffice {
 
  private:
   Postoffice();
-  ~Postoffice() { delete van_; }
+  ~Postoffice() {
+    StopPendingWatch();
+    delete van_;
+  }
 
   void InitEnvironment();
+  /** \brief fail if a message is held too long, run by pending_watch_ */
+  void WatchPending();
+  void StopPendingWatch();
   Van* van_;
   mutable std::mutex mu_;
+  /** \brief notified when a customer is added */
+  mutable std::condition_variable customers_cond_;
   // app_id -> (customer_id -> customer pointer)
   std::unordered_map<int, std::unordered_map<int, Customer*>> customers_;
+  // app_id -> (customer_id -> messages arrived before the customer)
+  std::unordered_map<int, std::unordered_map<int, std::vector<Message>>> pending_msgs_;
+  // app_id -> (customer_id -> when the first message was held)
+  std::unordered_map<int, std::unordered_map<int, time_t>> pending_since_;
+  // app_id -> customer ids removed, whose messages are dropped
+  std::unordered_map<int, std::unordered_set<int>> removed_customers_;
+  /** \brief the thread failing on held messages, started by the first one */
+  std::thread pending_watch_;
+  std::condition_variable pending_cond_;
+  bool stop_pending_watch_ = false;
   std::unordered_map<int, std::vector<int>> node_ids_;
   std::mutex server_key_ranges_mu_;
   std::vector<Range> server_key_ranges_;
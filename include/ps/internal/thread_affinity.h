@@ -0,0 +1,115 @@
+/**
+ *  Copyright (c) 2015 by Contributors
+ * @file   thread_affinity.h
+ * @brief  pin ps-lite threads to cpu sets
+ */
+#ifndef PS_INTERNAL_THREAD_AFFINITY_H_
+#define PS_INTERNAL_THREAD_AFFINITY_H_
+#ifdef __linux__
+#include <sched.h>
+#include <pthread.h>
+#include <unistd.h>
+#endif
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include <sstream>
+#include "ps/internal/postoffice.h"
+namespace ps {
+
+/**
+ * \brief parse a cpu list such as "0-3,8,10-11"
+ * \return the cpu ids, empty if \a str is empty or malformed
+ */
+inline std::vector<int> ParseCPUList(const std::string& str) {
+  std::vector<int> cpus;
+  std::stringstream ss(str);
+  std::string item;
+  while (std::getline(ss, item, ',')) {
+    if (item.empty()) continue;
+    size_t dash = item.find('-');
+    char* end = nullptr;
+    int lo = strtol(item.c_str(), &end, 10);
+    int hi = lo;
+    // the first number must end at the dash, or at the end of the item
+    bool ok = dash == std::string::npos ? *end == '\0' :
+        end == item.c_str() + dash && dash > 0;
+    if (ok && dash != std::string::npos) {
+      hi = strtol(item.c_str() + dash + 1, &end, 10);
+      ok = *end == '\0' && end != item.c_str() + dash + 1;
+    }
+    if (!ok || lo < 0 || hi < lo) {
+      LOG(WARNING) << "invalid cpu list: " << str;
+      return std::vector<int>();
+    }
+    for (int c = lo; c <= hi; ++c) cpus.push_back(c);
+  }
+  return cpus;
+}
+
+/**
+ * \brief return the cpu list configured for a thread class
+ *
+ * \a env_key is checked first, then PS_THREAD_CPUS which applies to all thread
+ * classes
+ */
+inline std::vector<int> GetThreadCPUs(const char* env_key) {
+  const char* val = Environment::Get()->find(env_key);
+  if (!val) val = Environment::Get()->find("PS_THREAD_CPUS");
+  return val ? ParseCPUList(val) : std::vector<int>();
+}
+
+/**
+ * \brief return the numa node of a cpu, -1 if unknown
+ */
+inline int GetNUMANode(int cpu) {
+#ifdef __linux__
+  for (int node = 0; node < 256; ++node) {
+    std::string path = "/sys/devices/system/cpu/cpu" + std::to_string(cpu)
+                       + "/node" + std::to_string(node);
+    if (access(path.c_str(), F_OK) == 0) return node;
+  }
+#endif
+  return -1;
+}
+
+/**
+ * \brief pin the calling thread to the cpus configured by \a env_key and
+ * report where it ended up
+ *
+ * Memory first touched by a pinned thread is allocated on its local numa
+ * node, so a request handle running in a pinned customer thread builds its
+ * store next to the cores serving it.
+ *
+ * \param env_key the environment variable holding the cpu list, such as
+ * PS_CUSTOMER_THREAD_CPUS
+ * \param name the thread class name, used for logging
+ */
+inline void PinCurrentThread(const char* env_key, const char* name) {
+  std::vector<int> cpus = GetThreadCPUs(env_key);
+  if (cpus.empty()) return;
+#ifdef __linux__
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  for (int c : cpus) CPU_SET(c, &set);
+  int rc = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+  if (rc != 0) {
+    LOG(WARNING) << "failed to pin " << name << " thread: " << strerror(rc);
+    return;
+  }
+  // the scheduler moves us onto the new set before the call returns
+  int cpu = sched_getcpu();
+  std::stringstream ss;
+  for (size_t i = 0; i < cpus.size(); ++i) ss << (i ? "," : "") << cpus[i];
+  PS_VLOG(1) << name << " thread is pinned to cpus {" << ss.str()
+             << "}, running on cpu " << cpu << " (numa node "
+             << GetNUMANode(cpu) << ")";
+#else
+  LOG(WARNING) << "thread pinning is not supported on this platform, ignore "
+               << env_key;
+#endif
+}
+
+}  // namespace ps
+#endif  // PS_INTERNAL_THREAD_AFFINITY_H_
@@ -4,7 +4,11 @@
 #ifndef PS_INTERNAL_VAN_H_
 #define PS_INTERNAL_VAN_H_
 #include <unordered_map>
+#include <deque>
+#include <map>
 #include <mutex>
+#include <queue>
+#include <condition_variable>
 #include <string>
 #include <vector>
 #include <thread>
@@ -12,6 +16,7 @@
 #include <atomic>
 #include <ctime>
 #include <unordered_set>
+#include <tuple>
 #include "ps/base.h"
 #include "ps/internal/message.h"
 namespace ps {
@@ -22,6 +27,14 @@ class Resender;
  *
  * If environment variable PS_RESEND is set to be 1, then van will resend a
  * message if it no ACK messsage is received within PS_RESEND_TIMEOUT millisecond
+ *
+ * If environment variable PS_SEND_CREDIT is set to a positive number of bytes,
+ * data messages are queued and sent by a sending thread in the order of their
+ * priorities, and the requests waiting for responses hold at most this many
+ * bytes. So a request with a high priority only waits for a few in flight
+ * rather than all requests issued before it. A control message, such as a
+ * barrier, is still sent after all data messages queued before it, and the
+ * ones queued after it wait for it.
  */
 class Van {
  public:
@@ -51,6 +64,10 @@ class Van {
 
     /**
      * \brief send a message, It is thread-safe
+     *
+     * A data message is only queued if PS_SEND_CREDIT is set, the number of
+     * bytes of its data is returned then. A control message is queued as well
+     * if any data message is queued or being sent, 0 is returned then.
      * \return the number of bytes sent. -1 if failed
      */
     int Send(const Message &msg);
@@ -105,6 +122,14 @@ class Van {
      */
     virtual int SendMsg(const Message &msg) = 0;
 
+    /**
+     * \brief send a message whose meta is already packed by \ref PackMeta
+     * \param meta_buf the packed meta, the van takes its ownership
+     * \param meta_size the size of meta_buf
+     * \return the number of bytes sent
+     */
+    virtual int SendPackedMsg(const Message &msg, char *meta_buf, int meta_size) = 0;
+
     /**
      * \brief pack meta into a string
      */
@@ -127,6 +152,35 @@ class Van {
     /** thread function for heartbeat */
     void Heartbeat();
 
+    /** thread function for sending the queued messages */
+    void Sending();
+
+    /** \brief send a message now */
+    int SendNow(const Message &msg);
+
+    /** \brief whether a message holds send credit until it is responded */
+    static bool HoldsCredit(const Message &msg) {
+      return msg.meta.request && !msg.meta.simple_app;
+    }
+
+    /** \brief release the credit of the request of a response */
+    void ReleaseCredit(const Message &msg);
+
+    /** \brief a message in the send queue */
+    struct QueuedMessage {
+      Message msg;
+      size_t bytes;
+      /** \brief the order of sending, to keep messages with the same priority
+       * in order */
+      uint64_t seq;
+      bool operator<(const QueuedMessage &other) const {
+        if (msg.meta.priority != other.msg.meta.priority) {
+          return msg.meta.priority < other.msg.meta.priority;
+        }
+        return seq > other.seq;
+      }
+    };
+
     // node's address string (i.e. ip:port) -> node id
     // this map is updated when ip:port is received for the first time
     std::unordered_map<std::string, int> connected_nodes_;
@@ -136,6 +190,8 @@ class Van {
 
     /** whether it is ready for sending */
     std::atomic<bool> ready_{false};
+    std::mutex ready_mu_;
+    std::condition_variable ready_cond_;
     std::atomic<size_t> send_bytes_{0};
     size_t recv_bytes_ = 0;
     int num_servers_ = 0;
@@ -144,6 +200,32 @@ class Van {
     std::unique_ptr<std::thread> receiver_thread_;
     /** the thread for sending heartbeat */
     std::unique_ptr<std::thread> heartbeat_thread_;
+    /** the bytes of requests allowed in flight, 0 means sending directly */
+    size_t send_credit_ = 0;
+    /** the thread for sending the queued messages */
+    std::unique_ptr<std::thread> sender_thread_;
+    std::mutex send_mu_;
+    std::condition_variable send_cond_;
+    /** \brief the queued data messages, split by the queued control messages.
+     * send_queue_[i] is sent before control_queue_[i], which is sent before
+     * send_queue_[i+1] */
+    std::deque<std::priority_queue<QueuedMessage>> send_queue_;
+    std::deque<Message> control_queue_;
+    /** \brief the number of messages taken from the queues but not sent yet */
+    int num_sending_ = 0;
+    uint64_t send_seq_ = 0;
+    bool stop_sending_ = false;
+    /** \brief identifies a request in flight and its response, by the
+     * server, app id, customer id, timestamp and chunk. Timestamps are only
+     * unique within a customer */
+    using CreditKey = std::tuple<int, int, int, int, int>;
+    static CreditKey CreditKeyOf(int node, const Meta &meta) {
+      return std::make_tuple(node, meta.app_id, meta.customer_id,
+                             meta.timestamp, meta.chunk_begin);
+    }
+    /** the bytes of the requests in flight */
+    std::map<CreditKey, size_t> inflight_;
+    size_t inflight_bytes_ = 0;
     std::vector<int> barrier_count_;
     /** msg resender */
     Resender *resender_ = nullptr;
@@ -151,6 +233,19 @@ class Van {
     std::atomic<int> timestamp_{0};
     int init_stage = 0;
 
+    /**
+     * \brief mark the van as ready and wake up \ref Start
+     */
+    void SetReady();
+
+    /**
+     * \brief send the same message to a list of nodes
+     *
+     * The meta is packed only once, so all copies share \a msg's timestamp.
+     * This is fine for the resender because the receiver is part of its key.
+     */
+    void Broadcast(const Message& msg, const std::vector<int>& recvers);
+
     /**
      * \brief processing logic of AddNode message for scheduler
      */
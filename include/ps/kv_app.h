@@ -4,11 +4,25 @@
 #ifndef PS_KV_APP_H_
 #define PS_KV_APP_H_
 #include <algorithm>
+#include <map>
+#include <tuple>
 #include <utility>
 #include <vector>
+#include <memory>
+#include <atomic>
+#include <condition_variable>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
 #include "ps/base.h"
 #include "ps/simple_app.h"
 #include "ps/internal/postoffice.h"
+#include "ps/internal/threadsafe_queue.h"
+#include "ps/internal/thread_affinity.h"
+#include "ps/internal/hash_ring.h"
+#include "ps/internal/local_aggregator.h"
+#include "ps/internal/kv_cache.h"
+#include "ps/internal/packed_lens.h"
 #include <time.h>
 namespace ps {
 
@@ -41,8 +55,68 @@ struct KVPairs {
   SArray<Val> vals;
   /** \brief the according value lengths (could be empty) */
   SArray<int> lens;
+  /** \brief the priority of sending, see \ref KVWorker::ZPush */
+  int priority = 0;
 };
 
+/**
+ * \brief the sliced kv lists, the i-th one is for server i and is sent only if
+ * its flag is true
+ */
+template <typename Val>
+using SlicedKVPairs = std::vector<std::pair<bool, KVPairs<Val>>>;
+
+/**
+ * \brief slice a kv list by key ranges, ranges[i] is the key range of server
+ * i. The slices are zero-copy segments of \a send
+ */
+template <typename Val>
+void SliceByRange(const KVPairs<Val>& send, const std::vector<Range>& ranges,
+                  SlicedKVPairs<Val>* sliced);
+
+/**
+ * \brief slice a kv list by the index of keys, the i-th key goes to server
+ * i % num_servers.
+ *
+ * The slices are counted first and then filled in a single scatter pass, which
+ * is split into \a num_threads threads for long lists
+ */
+template <typename Val>
+void SliceByMod(const KVPairs<Val>& send, size_t num_servers,
+                SlicedKVPairs<Val>* sliced, int num_threads = 1);
+
+/**
+ * \brief slice a kv list by the owner of every key, the key goes to server
+ * owner(key)
+ */
+template <typename Val, typename Owner>
+void SliceByOwner(const KVPairs<Val>& send, size_t num_servers,
+                  const Owner& owner, SlicedKVPairs<Val>* sliced);
+
+/**
+ * \brief slice a kv list by the hash of keys, the key goes to server
+ * SplitMix64(key) % num_servers
+ */
+template <typename Val>
+void SliceByHash(const KVPairs<Val>& send, size_t num_servers,
+                 SlicedKVPairs<Val>* sliced) {
+  SliceByOwner(send, num_servers, [num_servers](Key key) {
+      return static_cast<int>(SplitMix64(key) % num_servers);
+    }, sliced);
+}
+
+/**
+ * \brief slice a kv list by a consistent hashing ring, the key goes to server
+ * ring.Owner(key)
+ */
+template <typename Val>
+void SliceByHashRing(const KVPairs<Val>& send, size_t num_servers,
+                     const HashRing& ring, SlicedKVPairs<Val>* sliced) {
+  SliceByOwner(send, num_servers, [&ring](Key key) {
+      return ring.Owner(key);
+    }, sliced);
+}
+
 /**
  * \brief A worker node that can \ref Push (\ref Pull) key-value pairs to (from) server
  * nodes
@@ -72,19 +146,47 @@ class KVWorker : public SimpleApp {
    */
   explicit KVWorker(int app_id, int customer_id) : SimpleApp() {
     using namespace std::placeholders;
-    int slicer_kind =atoi(Environment::Get()->find("PS_SLICER"));
-    if (slicer_kind==0){
-      slicer_ = std::bind(&KVWorker<Val>::DefaultSlicer, this, _1, _2, _3);
-      PS_VLOG(1)<<"Slicer: Default range slicer";
-    }else{
-      slicer_ = std::bind(&KVWorker<Val>::ModSlicer, this, _1, _2, _3);
-      PS_VLOG(1)<<"Slicer: Mod slicer";
+    switch (GetEnv("PS_SLICER", 0)) {
+      case 0: set_slicer(kRangeSlicer); break;
+      case 2: set_slicer(kHashSlicer); break;
+      case 3: set_slicer(kConsistentHashSlicer); break;
+      default: set_slicer(kModSlicer);
     }
+    keys_sent_.resize(Postoffice::Get()->num_servers(), 0);
+    stripe_bytes_ = GetEnv("PS_STRIPE_BYTES", 0);
+    chunk_bytes_ = GetEnv("PS_CHUNK_BYTES", 0);
+    max_slice_plans_ = GetEnv("PS_SLICE_PLANS", 64);
+    int num_slots = GetEnv("PS_MAX_PULL_INFLIGHT", 4096);
+    CHECK_GT(num_slots, 0);
+    std::vector<PullSlot> slots(num_slots);
+    pull_slots_.swap(slots);
     obj_ = new Customer(app_id, customer_id, std::bind(&KVWorker<Val>::Process, this, _1));
+    set_local_aggregate(GetEnv("PS_LOCAL_AGGREGATE", 0));
+    size_t cache_capacity = GetEnv("PS_CACHE_CAPACITY", 0);
+    if (cache_capacity) {
+      set_cache(cache_capacity, GetEnv("PS_CACHE_STALENESS", 0),
+                GetEnv("PS_CACHE_REFRESH", 100));
+    }
   }
 
   /** \brief deconstructor */
-  virtual ~KVWorker() { delete obj_; obj_ = nullptr; }
+  virtual ~KVWorker() {
+    set_local_aggregate(0);
+    if (Postoffice::Get()->verbose() >= 1 && !keys_sent_.empty()) {
+      uint64_t total = 0, max = 0;
+      for (uint64_t n : keys_sent_) { total += n; max = std::max(max, n); }
+      PS_VLOG(1) << "keys sent to " << keys_sent_.size() << " servers: total "
+                 << total << ", max/mean "
+                 << (total ? (double)max * keys_sent_.size() / total : 0);
+    }
+    if (cache_) {
+      KVCacheStats st = cache_->stats();
+      PS_VLOG(1) << "pull cache: " << st.hits << " hits, " << st.misses
+                 << " misses, " << st.stale << " stale, " << st.refreshes
+                 << " refreshes, " << st.evictions << " evictions";
+    }
+    delete obj_; obj_ = nullptr;
+  }
 
   /**
    * \brief Pushes a list of key-value pairs to all server nodes.
@@ -148,6 +250,7 @@ class KVWorker : public SimpleApp {
    * @param keys a list of keys, must be unique and sorted in increasing order
    * @param vals the buffer for the pulled values. It can be 0 size.
    * @param lens optional buffer for the value length. If set, it can be 0 size.
+   * It is required if the values have various lengths.
    * @param cmd an optional command sent to the servers
    * @param cb the callback which is called when the pull is finished.
    * @return the timestamp of this request
@@ -157,7 +260,47 @@ class KVWorker : public SimpleApp {
            std::vector<int>* lens = nullptr,
            int cmd = 0,
            const Callback& cb = nullptr) {
-    return Pull_(SArray<Key>(keys), vals, lens, cmd, cb);
+    if (UseCache(lens, cmd)) return CachedPull_(SArray<Key>(keys), vals, cb);
+    KVPairs<Val> kvs; kvs.keys = SArray<Key>(keys);
+    return Pull_(kvs, false, vals, lens, cmd, cb);
+  }
+
+  /**
+   * \brief Pushes a list of key-value pairs and pulls back the updated values
+   * in a single round trip
+   *
+   * Every server gets one request holding the pushed values, and replies with
+   * the values of the same keys after the push is applied. It is equal to a
+   * \ref Push followed by a \ref Pull of \a keys, but slices and sends the
+   * keys only once. The server's request handle sees a push request with
+   * \ref KVMeta::pull set, and should respond with the updated values.
+   *
+   * Sample usage:
+   * \code
+   *   kv.Wait(kv.PushPull(keys, grads, &weights));
+   *   // now weights holds the values after grads are applied
+   * \endcode
+   *
+   * @param keys a list of keys, must be unique and sorted in increasing order
+   * @param vals the pushed values
+   * @param outs the buffer for the pulled values. It can be 0 size.
+   * @param lens optional, the value lengths of the pushed values if not
+   * empty. The lengths of the pulled values are written into it.
+   * @param cmd an optional command sent to the servers
+   * @param cb the callback which is called when the pulled values are ready.
+   * @return the timestamp of this request
+   */
+  int PushPull(const std::vector<Key>& keys,
+               const std::vector<Val>& vals,
+               std::vector<Val>* outs,
+               std::vector<int>* lens = nullptr,
+               int cmd = 0,
+               const Callback& cb = nullptr) {
+    KVPairs<Val> kvs;
+    kvs.keys = SArray<Key>(keys);
+    kvs.vals = SArray<Val>(vals);
+    if (lens) kvs.lens = SArray<int>(*lens);
+    return Pull_(kvs, true, outs, lens, cmd, cb);
   }
 
   /**
@@ -174,6 +317,62 @@ class KVWorker : public SimpleApp {
    */
   void Wait(int timestamp) { obj_->WaitRequest(timestamp); }
 
+  /**
+   * \brief Waits until a push or pull has been finished, or the timeout
+   *
+   * A request not finished in time is still in flight, and may be waited for
+   * again, or given up by \ref Cancel. For example, to serve with the values
+   * at hand if a server is too slow:
+   * \code
+   *   int ts = w.ZPull(keys, &vals);
+   *   if (!w.Wait(ts, 50)) w.Cancel(ts);
+   * \endcode
+   *
+   * \param timestamp the timestamp returned by the push or pull
+   * \param timeout_ms the timeout in milliseconds
+   * \return true if the request is finished
+   */
+  bool Wait(int timestamp, int timeout_ms) {
+    return obj_->WaitRequest(timestamp, timeout_ms);
+  }
+
+  /**
+   * \brief Gives up a push or pull which is not finished yet
+   *
+   * Its callback is dropped without being called, and \ref Wait on it returns
+   * at once. Responses arriving later are ignored, so the pull buffers can be
+   * freed once it returns. If the callback is already running, such as while
+   * the replies of a pull are merged into its buffers, it waits for the
+   * callback to return, unless called by the callback itself. The servers still
+   * apply the push if it reached them. It does nothing on a finished request.
+   * This function is thread-safe.
+   *
+   * \param timestamp the timestamp returned by the push or pull
+   */
+  void Cancel(int timestamp) {
+    std::unique_lock<std::mutex> lk(mu_);
+    bool pending = callbacks_.erase(timestamp);
+    if (!pending) {
+      auto self = std::this_thread::get_id();
+      running_cond_.wait(lk, [this, timestamp, self] {
+          auto it = running_.find(timestamp);
+          return it == running_.end() || it->second == self;
+        });
+    }
+    lk.unlock();
+    // the slot of a pull is released by its callback, so it is ours only if
+    // the callback is not taken yet
+    if (pending) {
+      std::shared_ptr<PullSlot> hold;
+      PullSlot* slot = PullSlotOf(timestamp, &hold);
+      std::lock_guard<std::mutex> lk(slot->mu);
+      if (slot->ts.load(std::memory_order_acquire) == timestamp) {
+        ReleasePullSlot(slot);
+      }
+    }
+    obj_->CancelRequest(timestamp);
+  }
+
   /**
    * \brief zero-copy Push
    *
@@ -181,12 +380,19 @@ class KVWorker : public SimpleApp {
    * will not be copied into system for better performance. It is the caller's
    * responsibility to keep the content to be not changed before actually
    * finished.
+   *
+   * If environment variable PS_SEND_CREDIT is set, requests with a larger \a
+   * priority are sent before the queued ones with smaller priorities, such as
+   * the front layers of a network that the next iteration needs first. The
+   * priority is given to the server's request handle in \ref KVMeta and its
+   * response is sent with the same priority.
    */
   int ZPush(const SArray<Key>& keys,
             const SArray<Val>& vals,
             const SArray<int>& lens = {},
             int cmd = 0,
-            const Callback& cb = nullptr) {
+            const Callback& cb = nullptr,
+            int priority = 0) {
 //    double time_st = (double)clock();
 //    if (Postoffice::Get()->verbose() >= 2) {
 //      PS_VLOG(2)<<"Enter ZPush: "<<time_st/CLOCKS_PER_SEC<<" "<<keys.size();
@@ -197,6 +403,8 @@ class KVWorker : public SimpleApp {
     kvs.keys = keys;
     kvs.vals = vals;
     kvs.lens = lens;
+    kvs.priority = priority;
+    if (aggregator_ && !AggregatePush(ts, cmd, &kvs)) return ts;
     Send(ts, true, cmd, kvs);
 //    if (Postoffice::Get()->verbose() >= 2) {
 //      double time_end = (double)clock();
@@ -211,16 +419,43 @@ class KVWorker : public SimpleApp {
    * This function is similar to \ref Pull except that all data
    * will not be copied into system for better performance. It is the caller's
    * responsibility to keep the content to be not changed before actually
-   * finished.
+   * finished. See \ref ZPush for \a priority.
    */
   int ZPull(const SArray<Key>& keys,
             SArray<Val>* vals,
             SArray<int>* lens = nullptr,
             int cmd = 0,
-            const Callback& cb = nullptr) {
-    return Pull_(keys, vals, lens, cmd, cb);
+            const Callback& cb = nullptr,
+            int priority = 0) {
+    if (UseCache(lens, cmd)) return CachedPull_(keys, vals, cb, priority);
+    KVPairs<Val> kvs; kvs.keys = keys;
+    kvs.priority = priority;
+    return Pull_(kvs, false, vals, lens, cmd, cb);
   }
-  using SlicedKVs = std::vector<std::pair<bool, KVPairs<Val>>>;
+
+  /**
+   * \brief zero-copy PushPull
+   *
+   * This function is similar to \ref PushPull except that all data
+   * will not be copied into system for better performance. It is the caller's
+   * responsibility to keep the content to be not changed before actually
+   * finished. See \ref ZPush for \a priority.
+   */
+  int ZPushPull(const SArray<Key>& keys,
+                const SArray<Val>& vals,
+                SArray<Val>* outs,
+                SArray<int>* lens = nullptr,
+                int cmd = 0,
+                const Callback& cb = nullptr,
+                int priority = 0) {
+    KVPairs<Val> kvs;
+    kvs.keys = keys;
+    kvs.vals = vals;
+    kvs.priority = priority;
+    if (lens) kvs.lens = *lens;
+    return Pull_(kvs, true, outs, lens, cmd, cb);
+  }
+  using SlicedKVs = SlicedKVPairs<Val>;
   /**
    * \brief a slicer partitions a key-value list according to the key ranges
    * \param send the kv list for partitioning
@@ -237,15 +472,211 @@ class KVWorker : public SimpleApp {
    */
   void set_slicer(const Slicer& slicer) {
     CHECK(slicer); slicer_ = slicer;
+    slicer_kind_ = kUserSlicer;
+    ClearSlicePlans();
+  }
+
+  /** \brief the builtin slicers */
+  enum SlicerKind {
+    /** \brief by the key ranges of servers, the default */
+    kRangeSlicer,
+    /** \brief by the index of a key modulo the number of servers */
+    kModSlicer,
+    /** \brief by the hash of a key modulo the number of servers */
+    kHashSlicer,
+    /** \brief by a consistent hashing ring with virtual nodes */
+    kConsistentHashSlicer,
+    /** \brief a user-defined slicer */
+    kUserSlicer
+  };
+
+  /**
+   * \brief use a builtin slicer. Push and pull of the same key should use the
+   * same slicer.
+   * \param kind the slicer
+   * \param num_virtual_nodes the number of virtual nodes per server for \ref
+   * kConsistentHashSlicer. 0 means using the environment variable
+   * PS_SLICER_VNODES, which is 128 by default
+   */
+  void set_slicer(SlicerKind kind, int num_virtual_nodes = 0) {
+    using namespace std::placeholders;
+    CHECK_NE(kind, kUserSlicer) << "use set_slicer(slicer) instead";
+    slicer_kind_ = kind;
+    ClearSlicePlans();
+    int num_servers = Postoffice::Get()->num_servers();
+    switch (kind) {
+      case kRangeSlicer:
+        slicer_ = std::bind(&KVWorker<Val>::DefaultSlicer, this, _1, _2, _3);
+        PS_VLOG(1) << "Slicer: Default range slicer";
+        break;
+      case kModSlicer:
+        slicer_ = std::bind(&KVWorker<Val>::ModSlicer, this, _1, _2, _3);
+        slicer_threads_ = GetEnv("PS_SLICER_THREADS", 1);
+        PS_VLOG(1) << "Slicer: Mod slicer";
+        break;
+      case kHashSlicer:
+        slicer_ = [](const KVPairs<Val>& send, const std::vector<Range>& ranges,
+                     SlicedKVs* sliced) {
+          SliceByHash(send, ranges.size(), sliced);
+        };
+        PS_VLOG(1) << "Slicer: Hash slicer";
+        break;
+      default:
+        if (num_virtual_nodes <= 0) {
+          num_virtual_nodes = GetEnv("PS_SLICER_VNODES", 128);
+        }
+        ring_ = HashRing(num_servers, num_virtual_nodes);
+        slicer_ = [this](const KVPairs<Val>& send, const std::vector<Range>& ranges,
+                         SlicedKVs* sliced) {
+          SliceByHashRing(send, ranges.size(), ring_, sliced);
+        };
+        PS_VLOG(1) << "Slicer: Consistent hash slicer with "
+                   << num_virtual_nodes << " virtual nodes";
+    }
+  }
+
+  /**
+   * \brief the number of keys sent to every server so far, by both push and
+   * pull. It shows how balanced the slicer distributes the keys. threadsafe
+   */
+  std::vector<uint64_t> GetKeysSent() {
+    std::lock_guard<std::mutex> lk(mu_);
+    return keys_sent_;
+  }
+
+  /**
+   * \brief stripe large values over all servers.
+   *
+   * A pushed value with at least \a bytes bytes is split into one chunk per
+   * server, and chunk i is pushed to server i under the same key. The key is
+   * then remembered, so that pushes and pulls of it later on are striped too,
+   * and a pull puts the chunks back together. A worker pulling a striped key
+   * it never pushed should call \ref set_striped first. Servers see the
+   * chunks as variable length values, with lens given.
+   *
+   * \param bytes the threshold, 0 means no striping. The default is given by
+   * the environment variable PS_STRIPE_BYTES, which is 0
+   */
+  void set_stripe_bytes(size_t bytes) { stripe_bytes_ = bytes; }
+
+  /**
+   * \brief send large requests in chunks.
+   *
+   * The keys a request sends to a server are split into chunks of at most \a
+   * bytes value bytes, each sent as a request on its own, so a server applies
+   * a chunk while the next ones are still arriving, and responds to it at
+   * once. It is still a single request for \ref Wait and the callback. A pull
+   * is split as if every value has length 1. Pulls with \a lens or of striped
+   * keys are not split. Keys are never split, see \ref set_stripe_bytes for
+   * large values.
+   *
+   * \param bytes the chunk size, 0 means no chunking. The default is given by
+   * the environment variable PS_CHUNK_BYTES, which is 0
+   */
+  void set_chunk_bytes(size_t bytes) { chunk_bytes_ = bytes; }
+
+  /**
+   * \brief set the clock of this worker, such as its iteration, which is sent
+   * with every later request. Servers bounding the staleness by \ref
+   * KVSSPHandle delay the pulls of a worker whose clock is too far ahead of
+   * the slowest one. The clock starts at 0
+   */
+  void set_clock(int clock) { clock_ = clock; }
+
+  /** \brief the clock of this worker, see \ref set_clock */
+  int clock() const { return clock_; }
+
+  /** \brief declare that keys are striped, see \ref set_stripe_bytes */
+  void set_striped(const std::vector<Key>& keys) {
+    std::lock_guard<std::mutex> lk(mu_);
+    striped_keys_.insert(keys.begin(), keys.end());
+  }
+
+  /**
+   * \brief sum the pushes of the workers of this app within the process.
+   *
+   * The k-th \ref Push (\ref ZPush) of a key list by \a num_workers workers
+   * is summed locally, and only the sum is sent to the servers. The pushes
+   * finish together once the sum is acknowledged, and the callbacks of the
+   * other workers are then called by the receiving thread of the worker
+   * sending the sum. All participating workers must set the same \a
+   * num_workers and push the same key lists in the same order, otherwise a
+   * push waits forever for the others. A pushed value is read only when the
+   * sum is computed, so it must not be changed until the push is finished,
+   * even with \ref Push.
+   *
+   * \param num_workers the number of workers summed, 0 or 1 disables it. The
+   * default is given by the environment variable PS_LOCAL_AGGREGATE, which is 0
+   */
+  void set_local_aggregate(int num_workers) {
+    if (num_workers > 1 && !aggregator_) {
+      aggregator_ = LocalAggregator<Val>::Get(obj_->app_id());
+    } else if (num_workers <= 1 && aggregator_) {
+      aggregator_->Leave(obj_->customer_id());
+      aggregator_.reset();
+    }
+    aggregate_workers_ = num_workers;
+  }
+  /**
+   * \brief serve pulls from the values pulled before, if they are recent
+   * enough.
+   *
+   * Every response of a server carries its version, the number of pushes it
+   * has applied. The values of \ref Pull (\ref ZPull) and \ref PushPull
+   * replies are cached with the version of their server, and a later pull of
+   * a key is served locally if the latest version seen from its server is at
+   * most \a staleness ahead. Only the other keys are pulled from the servers.
+   * The latest versions are learnt from the responses to this worker's own
+   * requests, such as the pushes of every iteration. A worker which mostly
+   * pulls from the cache would thus not see the pushes of others, so once
+   * \a refresh pulls were served for a server without a response from it,
+   * its keys are pulled again. Only pulls of fixed
+   * length values with the default command and without lens are cached.
+   * With \ref kModSlicer or a user-defined slicer, a pull missing any key
+   * pulls all of its keys.
+   *
+   * It is not threadsafe, call it before any pull.
+   *
+   * \param capacity the maximal number of cached keys, 0 disables the
+   * cache. The default is given by the environment variable PS_CACHE_CAPACITY,
+   * which is 0
+   * \param staleness the maximal number of pushes a served value can lag
+   * behind its server. The default is given by PS_CACHE_STALENESS, which is 0
+   * \param refresh the maximal number of pulls served for a server without a
+   * response from it. The default is given by PS_CACHE_REFRESH, which is 100
+   */
+  void set_cache(size_t capacity, int staleness, int refresh = 100) {
+    if (capacity) {
+      cache_.reset(new KVCache<Val>(
+          capacity, staleness, Postoffice::Get()->num_servers(), refresh));
+    } else {
+      cache_.reset();
+    }
+  }
+
+  /** \brief the counters of the cache, see \ref set_cache. threadsafe */
+  KVCacheStats GetCacheStats() {
+    return cache_ ? cache_->stats() : KVCacheStats();
   }
 
+
+
  private:
   /**
    * \brief internal pull, C/D can be either SArray or std::vector
+   * \param kvs the keys to pull, with the pushed values if \a push
+   * \param push whether to push kvs before pulling, namely a push-pull
    */
   template <typename C, typename D>
-  int Pull_(const SArray<Key>& keys, C* vals, D* lens,
+  int Pull_(const KVPairs<Val>& kvs, bool push, C* vals, D* lens,
             int cmd, const Callback& cb);
+  /** \brief whether a pull is served by the cache */
+  template <typename D>
+  bool UseCache(D* lens, int cmd) const { return cache_ && !lens && !cmd; }
+  /** \brief pull with the cache, only the keys it misses are pulled */
+  template <typename C>
+  int CachedPull_(const SArray<Key>& keys, C* vals, const Callback& cb,
+                  int priority = 0);
   /**
    * \brief add a callback for a request. threadsafe.
    * @param cb callback
@@ -269,6 +700,25 @@ class KVWorker : public SimpleApp {
    * @param cmd command
    */
   void Send(int timestamp, bool push, int cmd, const KVPairs<Val>& kvs);
+  /**
+   * \brief send the sliced kv list to servers
+   * @param pull whether a push also pulls back the updated values
+   * @param priority the priority of the messages
+   * @param chunk whether a slice can be sent in chunks
+   */
+  void SendSliced(int timestamp, bool push, bool pull, int cmd,
+                  const SlicedKVs& sliced, int priority, bool chunk);
+  /**
+   * \brief split a slice into chunks of \ref chunk_bytes_
+   * @param ends set to the end positions of the chunks, empty if not split
+   */
+  void SplitChunks(const KVPairs<Val>& kvs, bool push, std::vector<size_t>* ends);
+  /**
+   * \brief join a push into the local aggregator
+   * \return true if the push is the last of its group, \a kvs then holds the
+   * sum to send. Otherwise it is finished when the sum is acknowledged
+   */
+  bool AggregatePush(int timestamp, int cmd, KVPairs<Val>* kvs);
   /** \brief internal receive handle */
   void Process(const Message& msg);
   /** \brief default kv slicer */
@@ -280,14 +730,280 @@ class KVWorker : public SimpleApp {
                      SlicedKVs* sliced);
     
 
-  /** \brief data buffer for received kvs for each timestamp */
-  std::unordered_map<int, std::vector<KVPairs<Val>>> recv_kvs_;
+  /** \brief the positions of a server's keys in a request */
+  struct ScatterPlan {
+    /** \brief the number of keys sent to the server */
+    size_t num_keys = 0;
+    /** \brief the t-th key is at begin + t * stride if index is empty */
+    size_t begin = 0, stride = 1;
+    /** \brief otherwise it is at index[t] */
+    std::vector<size_t> index;
+    /** \brief the position of the t-th key */
+    size_t Pos(size_t t) const {
+      return index.empty() ? begin + t * stride : index[t];
+    }
+    /**
+     * \brief copy the values of the keys, each with length k, from the reply
+     * \a src into the positions of \a dst
+     */
+    template <typename V>
+    static void Scatter(const ScatterPlan& plan, const V* src, size_t k, V* dst) {
+      Scatter(plan, 0, plan.num_keys, src, k, dst);
+    }
+    /** \brief \ref Scatter the keys [first, first + num) from a chunk */
+    template <typename V>
+    static void Scatter(const ScatterPlan& plan, size_t first, size_t num,
+                        const V* src, size_t k, V* dst) {
+      if (!plan.index.empty()) {
+        const size_t* index = plan.index.data() + first;
+        for (size_t t = 0; t < num; ++t) {
+          memcpy(dst + index[t] * k, src + t * k, k * sizeof(V));
+        }
+      } else if (plan.stride == 1) {
+        memcpy(dst + (plan.begin + first) * k, src, num * k * sizeof(V));
+      } else if (k == 1) {
+        V* p = dst + plan.begin + first * plan.stride;
+        for (size_t t = 0; t < num; ++t) p[t * plan.stride] = src[t];
+      } else {
+        V* p = dst + (plan.begin + first * plan.stride) * k;
+        size_t step = plan.stride * k;
+        for (size_t t = 0; t < num; ++t) {
+          memcpy(p + t * step, src + t * k, k * sizeof(V));
+        }
+      }
+    }
+    /**
+     * \brief the reverse of \ref Scatter, copy the values of the keys from
+     * their positions in \a src into \a dst
+     */
+    template <typename V>
+    static void Gather(const ScatterPlan& plan, const V* src, size_t k, V* dst) {
+      if (!plan.index.empty()) {
+        for (size_t t = 0; t < plan.num_keys; ++t) {
+          memcpy(dst + t * k, src + plan.index[t] * k, k * sizeof(V));
+        }
+      } else if (plan.stride == 1) {
+        memcpy(dst, src + plan.begin * k, plan.num_keys * k * sizeof(V));
+      } else if (k == 1) {
+        const V* p = src + plan.begin;
+        for (size_t t = 0; t < plan.num_keys; ++t) dst[t] = p[t * plan.stride];
+      } else {
+        const V* p = src + plan.begin * k;
+        size_t step = plan.stride * k;
+        for (size_t t = 0; t < plan.num_keys; ++t) {
+          memcpy(dst + t * k, p + t * step, k * sizeof(V));
+        }
+      }
+    }
+  };
+  /** \brief plans[i] tells where server i's keys are in a request */
+  using ScatterPlans = std::vector<ScatterPlan>;
+
+  /**
+   * \brief slice a kv list, with large values striped over all servers
+   * \param kvs the kv list
+   * \param push whether it is a push, otherwise the values are empty
+   * \param sliced the sliced lists
+   * \param plans if not null, set to where the keys of every server are in kvs
+   * \return whether any key is striped
+   */
+  bool Slice(const KVPairs<Val>& kvs, bool push, SlicedKVs* sliced,
+             std::shared_ptr<const ScatterPlans>* plans);
+  /** \brief find the plans of a kv list sliced by slicer_ */
+  std::shared_ptr<const ScatterPlans> BuildPlans(
+      const SArray<Key>& keys, const SlicedKVs& sliced);
+
+  /**
+   * \brief the memoized slicing of a key list, so that slicing the same keys
+   * again only copies the values
+   */
+  struct SlicePlan {
+    /** \brief the size and the hash of the key list */
+    size_t size;
+    uint64_t hash;
+    /** \brief a copy of the key list, compared before the plan is reused */
+    SArray<Key> all_keys;
+    /** \brief the keys sent to every server, empty if none */
+    std::vector<SArray<Key>> keys;
+    std::shared_ptr<const ScatterPlans> plans;
+  };
+  /** \brief forget the memoized slicing, e.g. when the slicer changes */
+  void ClearSlicePlans() {
+    std::lock_guard<std::mutex> lk(slice_plans_mu_);
+    slice_plans_.clear();
+    slice_plan_used_.clear();
+    slice_plan_index_.clear();
+    slice_plan_hand_ = 0;
+  }
+  /** \brief slice a kv list by a memoized plan */
+  void SliceByPlan(const SlicePlan& plan, const KVPairs<Val>& kvs, bool push,
+                   SlicedKVs* sliced);
+
+  /**
+   * \brief the buffer of an inflight pull.
+   *
+   * A pull with timestamp ts uses the slot ts % pull_slots_.size(). The reply
+   * from server i is either copied into the caller's buffer by place, or kept
+   * in parts[i] for the callback. A reply is stored under mu, which \ref
+   * Cancel also holds to release the slot, and the callback consumes the
+   * replies once all have arrived.
+   */
+  struct PullSlot {
+    PullSlot() : ts(-1) { }
+    /**
+     * \brief the timestamp of the pull owning this slot, -1 if free, -2 if
+     * the pull is being prepared
+     */
+    std::atomic<int> ts;
+    /** \brief held while a reply is stored, and while \ref Cancel releases
+     * the slot */
+    std::mutex mu;
+    /** \brief the replies waiting to be gathered by the callback */
+    std::vector<KVPairs<Val>> parts;
+    /**
+     * \brief copy the reply of server i, which starts at its first-th key,
+     * directly into the caller's buffer. empty if the replies are gathered by
+     * the callback
+     */
+    std::function<void(int i, size_t first, const KVPairs<Val>& kvs)> place;
+    /** \brief plans[i] tells where server i's keys are in the request */
+    std::shared_ptr<const ScatterPlans> plans;
+    /** \brief the number of keys placed by \a place */
+    size_t num_placed = 0;
+    /** \brief whether some values are striped over servers */
+    bool striped = false;
+    /** \brief whether the slot is in extra_slots_ rather than pull_slots_ */
+    bool extra = false;
+  };
+  /**
+   * \brief claim the slot of a pull, block until it is released if the slot
+   * is still in use. The slot accepts replies only after \ref PublishPullSlot
+   *
+   * Slots are released by the callbacks on the receiving thread, so a pull
+   * issued there, such as by a callback, never waits, but takes an extra
+   * slot, which is then held by \a hold.
+   */
+  PullSlot* ClaimPullSlot(int ts, std::shared_ptr<PullSlot>* hold) {
+    auto& slot = pull_slots_[ts % pull_slots_.size()];
+    auto claim = [&slot]() {
+      int free_ts = -1;
+      return slot.ts.compare_exchange_strong(free_ts, -2);
+    };
+    if (!claim()) {
+      // more than pull_slots_.size() pulls are inflight
+      if (obj_->InReceivingThread()) {
+        hold->reset(new PullSlot());
+        PullSlot* extra = hold->get();
+        extra->ts = -2;
+        extra->extra = true;
+        extra->parts.resize(Postoffice::Get()->num_servers());
+        std::lock_guard<std::mutex> lk(mu_);
+        extra_slots_[ts] = *hold;
+        ++num_extra_slots_;
+        return extra;
+      }
+      std::unique_lock<std::mutex> lk(pull_wait_mu_);
+      ++num_pull_waiters_;
+      pull_wait_cond_.wait(lk, claim);
+      --num_pull_waiters_;
+    }
+    // allocated on the first use, and then reused
+    if (slot.parts.empty()) slot.parts.resize(Postoffice::Get()->num_servers());
+    return &slot;
+  }
+  /**
+   * \brief the slot of pull ts, which is a slot of another pull or free if
+   * ts is finished. An extra slot is held by \a hold
+   */
+  PullSlot* PullSlotOf(int ts, std::shared_ptr<PullSlot>* hold) {
+    if (num_extra_slots_.load(std::memory_order_acquire)) {
+      std::lock_guard<std::mutex> lk(mu_);
+      auto it = extra_slots_.find(ts);
+      if (it != extra_slots_.end()) {
+        *hold = it->second;
+        return hold->get();
+      }
+    }
+    return &pull_slots_[ts % pull_slots_.size()];
+  }
+  /** \brief let the slot accept replies once the pull is prepared */
+  void PublishPullSlot(PullSlot* slot, int ts) {
+    slot->ts.store(ts, std::memory_order_release);
+  }
+  /** \brief release the slot of a pull after its callback */
+  void ReleasePullSlot(PullSlot* slot) {
+    if (slot->extra) {
+      // freed once the holders are done
+      std::lock_guard<std::mutex> lk(mu_);
+      extra_slots_.erase(slot->ts.load());
+      --num_extra_slots_;
+    }
+    for (auto& part : slot->parts) part = KVPairs<Val>();
+    slot->place = nullptr;
+    slot->plans.reset();
+    slot->num_placed = 0;
+    // the waiter counts itself before it tries the slot, so either it finds
+    // the slot free or it is counted here
+    slot->ts.store(-1);
+    if (num_pull_waiters_.load()) {
+      { std::lock_guard<std::mutex> lk(pull_wait_mu_); }
+      pull_wait_cond_.notify_all();
+    }
+  }
+  /** \brief data buffer for received kvs of the inflight pulls */
+  std::vector<PullSlot> pull_slots_;
+  /** \brief the extra slots of pulls issued on the receiving thread, by
+   * timestamps, protected by mu_ */
+  std::unordered_map<int, std::shared_ptr<PullSlot>> extra_slots_;
+  std::atomic<int> num_extra_slots_{0};
+  /** \brief the pulls waiting for their slots, woken by \ref ReleasePullSlot */
+  std::mutex pull_wait_mu_;
+  std::condition_variable pull_wait_cond_;
+  std::atomic<int> num_pull_waiters_{0};
   /** \brief callbacks for each timestamp */
   std::unordered_map<int, Callback> callbacks_;
+  /** \brief the threads running the callbacks taken from callbacks_, by
+   * timestamps, protected by mu_ */
+  std::unordered_map<int, std::thread::id> running_;
+  std::condition_variable running_cond_;
   /** \brief lock */
   std::mutex mu_;
   /** \brief kv list slicer */
   Slicer slicer_;
+  /** \brief the kind of slicer_ */
+  SlicerKind slicer_kind_;
+  /** \brief the ring of \ref kConsistentHashSlicer */
+  HashRing ring_;
+  /** \brief the number of keys sent to every server, protected by mu_ */
+  std::vector<uint64_t> keys_sent_;
+  /** \brief values with at least this many bytes are striped, 0 for none */
+  size_t stripe_bytes_ = 0;
+  /** \brief requests are sent in chunks of this many bytes, 0 for none */
+  size_t chunk_bytes_ = 0;
+  /** \brief the keys whose values are striped, protected by mu_ */
+  std::unordered_set<Key> striped_keys_;
+  /** \brief the clock sent with every request */
+  std::atomic<int> clock_{0};
+  /** \brief the number of threads slicing a long kv list by mod */
+  int slicer_threads_ = 1;
+  /** \brief the aggregator of local pushes, empty if disabled */
+  std::shared_ptr<LocalAggregator<Val>> aggregator_;
+  /** \brief the number of workers whose pushes are summed */
+  int aggregate_workers_ = 0;
+  /** \brief the cache of pulled values, empty if disabled */
+  std::unique_ptr<KVCache<Val>> cache_;
+  /**
+   * \brief the memoized slicing of recent key lists, evicted by the clock
+   * algorithm. slice_plan_index_ finds a plan by the hash of its keys
+   */
+  std::vector<std::shared_ptr<const SlicePlan>> slice_plans_;
+  /** \brief whether a plan is reused since the clock hand passed it */
+  std::vector<uint8_t> slice_plan_used_;
+  std::unordered_map<uint64_t, size_t> slice_plan_index_;
+  size_t slice_plan_hand_ = 0;
+  /** \brief the maximal size of slice_plans_, 0 disables memoizing */
+  size_t max_slice_plans_ = 0;
+  std::mutex slice_plans_mu_;
 };
 
 /** \brief meta information about a kv request */
@@ -296,16 +1012,39 @@ struct KVMeta {
   int cmd;
   /** \brief whether or not this is a push request */
   bool push;
+  /**
+   * \brief whether or not a push request also pulls, see \ref
+   * KVWorker::PushPull. The response should then hold the updated values of
+   * the pushed keys
+   */
+  bool pull;
   /** \brief sender's node id */
   int sender;
   /** \brief the associated timestamp */
   int timestamp;
   /** \brief the customer id of worker */
   int customer_id;
+  /** \brief the priority of the request, the response is sent with it */
+  int priority;
+  /**
+   * \brief the position of the first key for a chunk of a request, see \ref
+   * KVWorker::set_chunk_bytes. Every chunk is responded on its own
+   */
+  int chunk_begin;
+  /** \brief the clock of the worker, see \ref KVWorker::set_clock */
+  int clock;
 };
 
 /**
  * \brief A server node for maintaining key-value pairs
+ *
+ * By default all requests are handled one by one in the receiving thread of
+ * the server. With more than one handling thread, the key range of this server
+ * is evenly split into shards, each of which is owned by one thread with its
+ * own copy of the request handle. A request is split by shards, every part is
+ * handled by the owning thread, and the responses of all parts are gathered
+ * into a single response. Requests on the same key are still handled in the
+ * order they arrive.
  */
 template <typename Val>
 class KVServer : public SimpleApp {
@@ -313,14 +1052,37 @@ class KVServer : public SimpleApp {
   /**
    * \brief constructor
    * \param app_id the app id, should match with \ref KVWorker's id
+   * \param num_threads the number of request handling threads. 0 means using
+   * the environment variable PS_SERVER_THREADS, which is 1 by default
    */
-  explicit KVServer(int app_id) : SimpleApp() {
+  explicit KVServer(int app_id, int num_threads = 0) : SimpleApp() {
     using namespace std::placeholders;
+    if (num_threads <= 0) num_threads = GetEnv("PS_SERVER_THREADS", 1);
+    if (num_threads > 1) {
+      const Range& range =
+          Postoffice::Get()->GetServerKeyRanges()[Postoffice::Get()->my_rank()];
+      shard_begin_ = range.begin();
+      shard_end_ = range.end();
+      shard_size_ = std::max(range.size() / num_threads, (uint64_t)1);
+      for (int i = 0; i < num_threads; ++i) {
+        shards_.emplace_back(new Shard());
+        shards_.back()->thread = std::unique_ptr<std::thread>(
+            new std::thread(&KVServer<Val>::Handling, this, i));
+      }
+    }
     obj_ = new Customer(app_id, app_id, std::bind(&KVServer<Val>::Process, this, _1));
   }
 
   /** \brief deconstructor */
-  virtual ~KVServer() { delete obj_; obj_ = nullptr; }
+  virtual ~KVServer() {
+    for (auto& s : shards_) {
+      ShardRequest stop{};
+      stop.stop = true;
+      s->queue.Push(stop);
+    }
+    for (auto& s : shards_) s->thread->join();
+    delete obj_; obj_ = nullptr;
+  }
 
   /**
    * \brief the handle to process a push/pull request from a worker
@@ -331,9 +1093,17 @@ class KVServer : public SimpleApp {
   using ReqHandle = std::function<void(const KVMeta& req_meta,
                                        const KVPairs<Val>& req_data,
                                        KVServer* server)>;
+  /**
+   * \brief set the request handle
+   *
+   * With multiple handling threads, every thread gets its own copy of \a
+   * request_handle, so a handle holding its store by value, such as \ref
+   * KVServerDefaultHandle, ends up with one store per shard.
+   */
   void set_request_handle(const ReqHandle& request_handle) {
     CHECK(request_handle) << "invalid request handle";
     request_handle_ = request_handle;
+    for (auto& s : shards_) s->handle = request_handle;
   }
 
   /**
@@ -346,8 +1116,64 @@ class KVServer : public SimpleApp {
  private:
   /** \brief internal receive handle */
   void Process(const Message& msg);
+  /** \brief a request, or part of a request, for a handling thread */
+  struct ShardRequest {
+    KVMeta meta;
+    KVPairs<Val> data;
+    bool stop = false;
+  };
+  /** \brief a handling thread with the keys it owns */
+  struct Shard {
+    ThreadsafeQueue<ShardRequest> queue;
+    ReqHandle handle;
+    std::unique_ptr<std::thread> thread;
+  };
+  /** \brief a split request waiting for the responses of its parts */
+  struct Gather {
+    int remaining;
+    std::vector<KVPairs<Val>> parts;
+    /** \brief the shard of every key if the parts are interleaved */
+    std::vector<int> shard_of;
+  };
+  /** \brief the thread function of the shard \a i */
+  void Handling(int i);
+  /** \brief return the shard owning the key */
+  int ShardOf(Key key) const {
+    int n = static_cast<int>(shards_.size());
+    if (key >= shard_begin_ && key < shard_end_) {
+      return static_cast<int>(
+          std::min((key - shard_begin_) / shard_size_, (uint64_t)n - 1));
+    }
+    // keys out of my range only come with non-range slicers
+    return static_cast<int>(key % n);
+  }
+  /** \brief split a request by shards and pass the parts to the threads */
+  void Dispatch(const KVMeta& meta, const KVPairs<Val>& data);
+  /**
+   * \brief collect the response of a part.
+   * \return true if \a res completes the request, \a out is then the
+   * response of the whole request
+   */
+  bool GatherResponse(const KVMeta& req, const KVPairs<Val>& res, KVPairs<Val>* out);
+  /** \brief (sender, customer id, timestamp, chunk) of a request */
+  using GatherKey = std::tuple<int, int, int, int>;
+  static GatherKey GetGatherKey(const KVMeta& req) {
+    return std::make_tuple(req.sender, req.customer_id, req.timestamp,
+                           req.chunk_begin);
+  }
   /** \brief request handle */
   ReqHandle request_handle_;
+  /** \brief the handling threads, empty if requests are handled by the
+   * receiving thread */
+  std::vector<std::unique_ptr<Shard>> shards_;
+  /** \brief shard i owns keys [shard_begin_ + i * shard_size_, ...) */
+  Key shard_begin_ = 0;
+  Key shard_end_ = 0;
+  uint64_t shard_size_ = 1;
+  std::mutex gather_mu_;
+  std::map<GatherKey, Gather> gathers_;
+  /** \brief the number of pushes responded, sent as the version */
+  std::atomic<int> version_{0};
 };
 
 
@@ -362,13 +1188,15 @@ struct KVServerDefaultHandle {
     KVPairs<Val> res;
     if (req_meta.push) {
       CHECK_EQ(n, req_data.vals.size());
-    } else {
+    }
+    if (!req_meta.push || req_meta.pull) {
       res.keys = req_data.keys; res.vals.resize(n);
     }
     for (size_t i = 0; i < n; ++i) {
       Key key = req_data.keys[i];
       if (req_meta.push) {
         store[key] += req_data.vals[i];
+        if (req_meta.pull) res.vals[i] = store[key];
       } else {
         res.vals[i] = store[key];
       }
@@ -389,9 +1217,13 @@ void KVServer<Val>::Process(const Message& msg) {
   KVMeta meta;
   meta.cmd       = msg.meta.head;
   meta.push      = msg.meta.push;
+  meta.pull      = msg.meta.pull;
   meta.sender    = msg.meta.sender;
   meta.timestamp = msg.meta.timestamp;
   meta.customer_id = msg.meta.customer_id;
+  meta.priority  = msg.meta.priority;
+  meta.chunk_begin = msg.meta.chunk_begin;
+  meta.clock = msg.meta.clock;
   KVPairs<Val> data;
   int n = msg.data.size();
   if (n) {
@@ -400,29 +1232,205 @@ void KVServer<Val>::Process(const Message& msg) {
     data.vals = msg.data[1];
     if (n > 2) {
       CHECK_EQ(n, 3);
-      data.lens = msg.data[2];
+      data.lens = GetLens(msg, 2, data.keys.size());
       CHECK_EQ(data.lens.size(), data.keys.size());
     }
   }
   CHECK(request_handle_);
-  request_handle_(meta, data, this);
+  if (shards_.empty()) {
+    request_handle_(meta, data, this);
+  } else {
+    Dispatch(meta, data);
+  }
+}
+
+template <typename Val>
+void KVServer<Val>::Handling(int i) {
+  PinCurrentThread("PS_SERVER_THREAD_CPUS", "server handling");
+  Shard* shard = shards_[i].get();
+  while (true) {
+    ShardRequest req;
+    shard->queue.WaitAndPop(&req);
+    if (req.stop) break;
+    CHECK(shard->handle);
+    shard->handle(req.meta, req.data, this);
+  }
+}
+
+template <typename Val>
+void KVServer<Val>::Dispatch(const KVMeta& meta, const KVPairs<Val>& data) {
+  int num_shards = static_cast<int>(shards_.size());
+  size_t n = data.keys.size();
+  ShardRequest req;
+  req.meta = meta;
+  if (n == 0) {
+    shards_[0]->queue.Push(req);
+    return;
+  }
+  std::vector<int> shard_of(n);
+  bool ordered = true;
+  for (size_t i = 0; i < n; ++i) {
+    shard_of[i] = ShardOf(data.keys[i]);
+    if (i && shard_of[i] < shard_of[i-1]) ordered = false;
+  }
+  if (shard_of[0] == shard_of[n-1] && ordered) {
+    // the common case, all keys are in a single shard
+    req.data = data;
+    shards_[shard_of[0]]->queue.Push(req);
+    return;
+  }
+
+  size_t k = data.lens.empty() ? data.vals.size() / n : 0;
+  std::vector<KVPairs<Val>> parts(num_shards);
+  if (ordered) {
+    // keys of a shard are contiguous, slice without copying
+    size_t val_begin = 0;
+    for (size_t begin = 0; begin < n; ) {
+      size_t end = begin;
+      size_t val_end = val_begin;
+      while (end < n && shard_of[end] == shard_of[begin]) {
+        val_end += data.lens.empty() ? k : data.lens[end];
+        ++end;
+      }
+      auto& part = parts[shard_of[begin]];
+      part.keys = data.keys.segment(begin, end);
+      if (data.vals.size()) part.vals = data.vals.segment(val_begin, val_end);
+      if (data.lens.size()) part.lens = data.lens.segment(begin, end);
+      begin = end;
+      val_begin = val_end;
+    }
+  } else {
+    // count the keys and values of every shard, then copy into exactly sized
+    // arrays
+    std::vector<size_t> num_keys(num_shards, 0), num_vals(num_shards, 0);
+    for (size_t i = 0; i < n; ++i) {
+      ++num_keys[shard_of[i]];
+      num_vals[shard_of[i]] += data.lens.empty() ? k : data.lens[i];
+    }
+    for (int s = 0; s < num_shards; ++s) {
+      if (!num_keys[s]) continue;
+      parts[s].keys.resize(num_keys[s]);
+      if (data.vals.size()) parts[s].vals.resize(num_vals[s]);
+      if (data.lens.size()) parts[s].lens.resize(num_keys[s]);
+      num_keys[s] = num_vals[s] = 0;
+    }
+    const Val* src = data.vals.data();
+    for (size_t i = 0; i < n; ++i) {
+      int s = shard_of[i];
+      auto& part = parts[s];
+      size_t len = data.lens.empty() ? k : data.lens[i];
+      part.keys[num_keys[s]] = data.keys[i];
+      if (data.lens.size()) part.lens[num_keys[s]] = data.lens[i];
+      ++num_keys[s];
+      if (data.vals.size()) {
+        memcpy(part.vals.data() + num_vals[s], src, len * sizeof(Val));
+        num_vals[s] += len;
+        src += len;
+      }
+    }
+  }
+
+  Gather gather;
+  gather.remaining = 0;
+  for (const auto& part : parts) gather.remaining += !part.keys.empty();
+  gather.parts.resize(num_shards);
+  if (!ordered) gather.shard_of.swap(shard_of);
+  {
+    std::lock_guard<std::mutex> lk(gather_mu_);
+    gathers_[GetGatherKey(meta)] = std::move(gather);
+  }
+  for (int i = 0; i < num_shards; ++i) {
+    if (parts[i].keys.empty()) continue;
+    req.data = parts[i];
+    shards_[i]->queue.Push(req);
+  }
+}
+
+template <typename Val>
+bool KVServer<Val>::GatherResponse(
+    const KVMeta& req, const KVPairs<Val>& res, KVPairs<Val>* out) {
+  Gather gather;
+  {
+    std::lock_guard<std::mutex> lk(gather_mu_);
+    auto it = gathers_.find(GetGatherKey(req));
+    if (it == gathers_.end()) {
+      *out = res;
+      return true;
+    }
+    if (res.keys.size()) it->second.parts[ShardOf(res.keys.front())] = res;
+    if (--it->second.remaining > 0) return false;
+    gather = std::move(it->second);
+    gathers_.erase(it);
+  }
+
+  size_t num_keys = 0;
+  for (const auto& part : gather.parts) num_keys += part.keys.size();
+  if (num_keys == 0) return true;  // e.g. the response of a push
+  if (gather.shard_of.empty()) {
+    // the parts are ordered by shards
+    for (const auto& part : gather.parts) {
+      out->keys.append(part.keys);
+      out->vals.append(part.vals);
+      out->lens.append(part.lens);
+    }
+    return true;
+  }
+  // interleave the parts back into the order of the request
+  size_t n = gather.shard_of.size();
+  CHECK_EQ(num_keys, n) << "unmatched keys size from the shards";
+  size_t num_shards = gather.parts.size();
+  std::vector<size_t> key_pos(num_shards, 0), val_pos(num_shards, 0);
+  bool has_lens = false;
+  size_t total_val = 0;
+  for (const auto& part : gather.parts) {
+    has_lens |= !part.lens.empty();
+    total_val += part.vals.size();
+  }
+  out->keys.resize(n);
+  out->vals.resize(total_val);
+  if (has_lens) out->lens.resize(n);
+  size_t v = 0;
+  for (size_t i = 0; i < n; ++i) {
+    int s = gather.shard_of[i];
+    const auto& part = gather.parts[s];
+    size_t j = key_pos[s]++;
+    CHECK_LT(j, part.keys.size()) << "unmatched keys size from one shard";
+    size_t len = has_lens ? part.lens[j] : part.vals.size() / part.keys.size();
+    out->keys[i] = part.keys[j];
+    if (has_lens) out->lens[i] = len;
+    memcpy(out->vals.data() + v, part.vals.data() + val_pos[s], len * sizeof(Val));
+    val_pos[s] += len;
+    v += len;
+  }
+  return true;
 }
 
 template <typename Val>
 void KVServer<Val>::Response(const KVMeta& req, const KVPairs<Val>& res) {
+  KVPairs<Val> gathered;
+  if (!shards_.empty()) {
+    if (!GatherResponse(req, res, &gathered)) return;
+  } else {
+    gathered = res;
+  }
+  const KVPairs<Val>& out = gathered;
   Message msg;
   msg.meta.app_id = obj_->app_id();
   msg.meta.customer_id = req.customer_id;
   msg.meta.request     = false;
   msg.meta.push        = req.push;
+  msg.meta.pull        = req.pull;
   msg.meta.head        = req.cmd;
   msg.meta.timestamp   = req.timestamp;
+  msg.meta.priority    = req.priority;
+  msg.meta.chunk_begin = req.chunk_begin;
   msg.meta.recver      = req.sender;
-  if (res.keys.size()) {
-    msg.AddData(res.keys);
-    msg.AddData(res.vals);
-    if (res.lens.size()) {
-      msg.AddData(res.lens);
+  msg.meta.version     = req.push ? ++version_ : version_.load();
+  if (out.keys.size()) {
+    msg.AddData(out.keys);
+    msg.AddData(out.vals);
+    if (out.lens.size()) {
+      AddLens(out.lens, &msg);
     }
   }
   Postoffice::Get()->van()->Send(msg);
@@ -432,6 +1440,19 @@ template <typename Val>
 void KVWorker<Val>::DefaultSlicer(
     const KVPairs<Val>& send, const std::vector<Range>& ranges,
     typename KVWorker<Val>::SlicedKVs* sliced) {
+  SliceByRange(send, ranges, sliced);
+}
+
+template <typename Val>
+void KVWorker<Val>::ModSlicer(
+    const KVPairs<Val>& send, const std::vector<Range>& ranges,
+    typename KVWorker<Val>::SlicedKVs* sliced) {
+  SliceByMod(send, ranges.size(), sliced, slicer_threads_);
+}
+
+template <typename Val>
+void SliceByRange(const KVPairs<Val>& send, const std::vector<Range>& ranges,
+                  SlicedKVPairs<Val>* sliced) {
   sliced->resize(ranges.size());
 
   // find the positions in msg.key
@@ -465,13 +1486,16 @@ void KVWorker<Val>::DefaultSlicer(
   CHECK_EQ(pos[n], send.keys.size());
   if (send.keys.empty()) return;
 
-  // the length of value
-  size_t k = 0, val_begin = 0, val_end = 0;
+  // the length of value, or where every value begins
+  size_t k = 0;
+  std::vector<size_t> offset;
   if (send.lens.empty()) {
     k = send.vals.size() / send.keys.size();
     CHECK_EQ(k * send.keys.size(), send.vals.size());
   } else {
     CHECK_EQ(send.keys.size(), send.lens.size());
+    offset.resize(send.keys.size() + 1);
+    LensToOffsets(send.lens.data(), send.lens.size(), offset.data());
   }
 
   // slice
@@ -485,9 +1509,7 @@ void KVWorker<Val>::DefaultSlicer(
     kv.keys = send.keys.segment(pos[i], pos[i+1]);
     if (send.lens.size()) {
       kv.lens = send.lens.segment(pos[i], pos[i+1]);
-      for (int l : kv.lens) val_end += l;
-      kv.vals = send.vals.segment(val_begin, val_end);
-      val_begin = val_end;
+      kv.vals = send.vals.segment(offset[pos[i]], offset[pos[i+1]]);
     } else {
       kv.vals = send.vals.segment(pos[i]*k, pos[i+1]*k);
     }
@@ -495,71 +1517,182 @@ void KVWorker<Val>::DefaultSlicer(
 }
 
 template <typename Val>
-void KVWorker<Val>::ModSlicer(
-    const KVPairs<Val>& send, const std::vector<Range>& ranges,
-    typename KVWorker<Val>::SlicedKVs* sliced) {
-    size_t num_servers = Postoffice::Get()->num_servers();
-    sliced->resize(num_servers);
-    CHECK_EQ(num_servers, ranges.size());
+void SliceByMod(const KVPairs<Val>& send, size_t num_servers,
+                SlicedKVPairs<Val>* sliced, int num_threads) {
+  sliced->resize(num_servers);
+  for (auto& s : *sliced) {
+    s.first = false;
+    s.second = KVPairs<Val>();
+  }
+  size_t n = send.keys.size();
+  if (n == 0) return;
 
-    if (send.keys.empty()) return;
-    
-//    PS_VLOG(1)<<"mod slicer";
-//    PS_VLOG(1)<<"mod slicer: send keys";
-//    for (size_t i=0;i<send.keys.size();++i)
-//        PS_VLOG(1)<<send.keys[i];
-//    PS_VLOG(1)<<"mod slicer: send vals";
-//    for (size_t i=0;i<send.vals.size();++i)
-//        PS_VLOG(1)<<send.vals[i];
-  
-    size_t key_cnt = send.keys.size();
-    size_t val_cnt = send.vals.size();
-    size_t len_cnt = send.lens.size();
-    // the length of value
-    size_t k = 0, val_begin = 0, val_end = 0;
+  // the length of value
+  size_t k = 0;
+  if (send.lens.empty()) {
+    k = send.vals.size() / n;
+    CHECK_EQ(k * n, send.vals.size());
+  } else {
+    CHECK_EQ(n, send.lens.size());
+  }
+
+  // split the keys into chunks, each of which is sliced by one thread. a chunk
+  // starts at a multiple of num_servers, so that the key i of a chunk goes to
+  // the same position of every server's slice
+  const size_t kGrainSize = 1 << 16;
+  size_t rounds = (n + num_servers - 1) / num_servers;
+  size_t num_chunks = std::max(
+      std::min((size_t)std::max(num_threads, 1), n / kGrainSize), (size_t)1);
+  size_t rounds_per_chunk = (rounds + num_chunks - 1) / num_chunks;
+  num_chunks = (rounds + rounds_per_chunk - 1) / rounds_per_chunk;
 
+  // pass 1, count the values for variable lengths. val_pos[c * num_servers +
+  // i] is then the position of chunk c's first value in the slice of server i
+  std::vector<size_t> val_pos(num_chunks * num_servers + num_servers, 0);
+  auto count = [&](size_t c) {
+    size_t* cnt = &val_pos[(c + 1) * num_servers];
+    size_t end = std::min((c + 1) * rounds_per_chunk * num_servers, n);
+    for (size_t j = c * rounds_per_chunk * num_servers; j < end; j += num_servers) {
+      size_t m = std::min(num_servers, end - j);
+      for (size_t i = 0; i < m; ++i) cnt[i] += send.lens[j + i];
+    }
+  };
+  // pass 2, scatter into exactly sized buffers
+  std::vector<Key*> keys(num_servers);
+  std::vector<Val*> vals(num_servers);
+  std::vector<int*> lens(num_servers);
+  auto scatter = [&](size_t c) {
+    size_t begin = c * rounds_per_chunk * num_servers;
+    size_t end = std::min(begin + rounds_per_chunk * num_servers, n);
+    const Key* src_keys = send.keys.data();
+    const Val* src_vals = send.vals.data();
     if (send.lens.empty()) {
-      k = send.vals.size() / send.keys.size();
-      CHECK_EQ(k * key_cnt,  val_cnt);
-    } else {
-      CHECK_EQ(key_cnt, len_cnt);
-    }
-    for (size_t i=0; i<num_servers; ++i){
-        sliced->at(i).first=false;
-        auto& kv = sliced->at(i).second;
-        kv.keys.clear();
-        kv.vals.clear();
-        kv.lens.clear();
-    }
-    // slice
-    for (size_t key_i = 0; key_i<key_cnt; ++key_i){
-        size_t id_sliced = key_i % num_servers;
-        sliced->at(id_sliced).first = true;
-        auto& kv = sliced->at(id_sliced).second;
-        kv.keys.push_back(send.keys[key_i]);
-        if (len_cnt){
-            kv.lens.push_back(send.lens[key_i]);
-            val_end += send.lens[key_i];
-            kv.vals.append(send.vals.segment(val_begin, val_end));
-            val_begin = val_end;
-        }else{
-            kv.vals.append(send.vals.segment(key_i*k, (key_i+1)*k));
+      // the position of key j in its slice is j / num_servers
+      for (size_t j = begin; j < end; j += num_servers) {
+        size_t pos = j / num_servers;
+        size_t m = std::min(num_servers, end - j);
+        for (size_t i = 0; i < m; ++i) keys[i][pos] = src_keys[j + i];
+        if (k == 1) {
+          for (size_t i = 0; i < m; ++i) vals[i][pos] = src_vals[j + i];
+        } else {
+          for (size_t i = 0; i < m; ++i) {
+            memcpy(vals[i] + pos * k, src_vals + (j + i) * k, k * sizeof(Val));
+          }
         }
-//        PS_VLOG(1)<<"mod slicer: slicing "<<key_i;
+      }
+      return;
     }
-    
-//    for (size_t i = 0 ;i<num_servers;++i){
-//        PS_VLOG(1)<<"mod slicer: sliced "<<sliced->at(i).first;
-//        PS_VLOG(1)<<"mod slicer: sliced keys";
-//        for (size_t ii=0;ii<sliced->at(i).second.keys.size();++ii)
-//            PS_VLOG(1)<<sliced->at(i).second.keys[ii];
-//        PS_VLOG(1)<<"mod slicer: sliced vals";
-//        for (size_t ii=0;ii<sliced->at(i).second.vals.size();++ii)
-//            PS_VLOG(1)<<sliced->at(i).second.vals[ii];
-//        PS_VLOG(1)<<"mod slicer: sliced lens";
-//        for (size_t ii=0;ii<sliced->at(i).second.lens.size();++ii)
-//            PS_VLOG(1)<<sliced->at(i).second.lens[ii];
-//    }
+    std::vector<size_t> vpos(val_pos.begin() + c * num_servers,
+                             val_pos.begin() + (c + 1) * num_servers);
+    size_t src_pos = 0;
+    for (size_t i = 0; i < num_servers; ++i) src_pos += vpos[i];
+    const int* src_lens = send.lens.data();
+    for (size_t j = begin; j < end; j += num_servers) {
+      size_t pos = j / num_servers;
+      size_t m = std::min(num_servers, end - j);
+      for (size_t i = 0; i < m; ++i) {
+        size_t len = src_lens[j + i];
+        keys[i][pos] = src_keys[j + i];
+        lens[i][pos] = static_cast<int>(len);
+        memcpy(vals[i] + vpos[i], src_vals + src_pos, len * sizeof(Val));
+        vpos[i] += len;
+        src_pos += len;
+      }
+    }
+  };
+  auto run = [num_chunks](const std::function<void(size_t)>& fn) {
+    std::vector<std::thread> threads;
+    for (size_t c = 1; c < num_chunks; ++c) threads.emplace_back(fn, c);
+    fn(0);
+    for (auto& t : threads) t.join();
+  };
+
+  if (send.lens.size()) {
+    run(count);
+    for (size_t c = 0; c < num_chunks; ++c) {
+      for (size_t i = 0; i < num_servers; ++i) {
+        val_pos[(c + 1) * num_servers + i] += val_pos[c * num_servers + i];
+      }
+    }
+  }
+
+  for (size_t i = 0; i < num_servers && i < n; ++i) {
+    size_t num_keys = (n - i + num_servers - 1) / num_servers;
+    size_t num_vals = send.lens.empty() ?
+        num_keys * k : val_pos[num_chunks * num_servers + i];
+    auto& kv = sliced->at(i).second;
+    sliced->at(i).first = true;
+    kv.keys.reset(new Key[num_keys], num_keys, [](Key* p) { delete [] p; });
+    kv.vals.reset(new Val[num_vals], num_vals, [](Val* p) { delete [] p; });
+    keys[i] = kv.keys.data();
+    vals[i] = kv.vals.data();
+    lens[i] = nullptr;
+    if (send.lens.size()) {
+      kv.lens.reset(new int[num_keys], num_keys, [](int* p) { delete [] p; });
+      lens[i] = kv.lens.data();
+    }
+  }
+  run(scatter);
+}
+
+template <typename Val, typename Owner>
+void SliceByOwner(const KVPairs<Val>& send, size_t num_servers,
+                  const Owner& owner, SlicedKVPairs<Val>* sliced) {
+  sliced->resize(num_servers);
+  for (auto& s : *sliced) {
+    s.first = false;
+    s.second = KVPairs<Val>();
+  }
+  size_t n = send.keys.size();
+  if (n == 0) return;
+  size_t k = 0;
+  if (send.lens.empty()) {
+    k = send.vals.size() / n;
+    CHECK_EQ(k * n, send.vals.size());
+  } else {
+    CHECK_EQ(n, send.lens.size());
+  }
+
+  // pass 1, find and count the owners
+  std::vector<int> dest(n);
+  std::vector<size_t> num_keys(num_servers, 0), num_vals(num_servers, 0);
+  for (size_t j = 0; j < n; ++j) {
+    int i = owner(send.keys[j]);
+    dest[j] = i;
+    ++num_keys[i];
+    num_vals[i] += send.lens.empty() ? k : send.lens[j];
+  }
+  std::vector<Key*> keys(num_servers);
+  std::vector<Val*> vals(num_servers);
+  std::vector<int*> lens(num_servers);
+  for (size_t i = 0; i < num_servers; ++i) {
+    if (!num_keys[i]) continue;
+    auto& kv = sliced->at(i).second;
+    sliced->at(i).first = true;
+    kv.keys.reset(new Key[num_keys[i]], num_keys[i], [](Key* p) { delete [] p; });
+    kv.vals.reset(new Val[num_vals[i]], num_vals[i], [](Val* p) { delete [] p; });
+    keys[i] = kv.keys.data();
+    vals[i] = kv.vals.data();
+    if (send.lens.size()) {
+      kv.lens.reset(new int[num_keys[i]], num_keys[i], [](int* p) { delete [] p; });
+      lens[i] = kv.lens.data();
+    }
+  }
+
+  // pass 2, scatter. the keys of a server keep their order in send
+  const Val* src = send.vals.data();
+  for (size_t j = 0; j < n; ++j) {
+    int i = dest[j];
+    *keys[i]++ = send.keys[j];
+    size_t len = k;
+    if (send.lens.size()) {
+      len = send.lens[j];
+      *lens[i]++ = static_cast<int>(len);
+    }
+    memcpy(vals[i], src, len * sizeof(Val));
+    vals[i] += len;
+    src += len;
+  }
 }
 
 template <typename Val>
@@ -570,7 +1703,330 @@ void KVWorker<Val>::Send(int timestamp, bool push, int cmd, const KVPairs<Val>&
   }
   // slice the message
   SlicedKVs sliced;
-  slicer_(kvs, Postoffice::Get()->GetServerKeyRanges(), &sliced);
+  Slice(kvs, push, &sliced, nullptr);
+  SendSliced(timestamp, push, false, cmd, sliced, kvs.priority, true);
+  if (Postoffice::Get()->verbose() >= 2) {
+    double time_end = (double)clock();
+    PS_VLOG(2)<<"Exit KVWorker Send: "<<time_end/CLOCKS_PER_SEC<<" "<<(time_end-time_st)/CLOCKS_PER_SEC<<" "<<kvs.keys.size();
+  }
+}
+
+template <typename Val>
+bool KVWorker<Val>::AggregatePush(int timestamp, int cmd, KVPairs<Val>* kvs) {
+  auto done = [this, timestamp]() {
+    RunCallback(timestamp);
+    obj_->AddResponse(timestamp, Postoffice::Get()->num_servers());
+  };
+  SArray<Val> sum;
+  std::vector<typename LocalAggregator<Val>::Done> dones;
+  if (!aggregator_->Join(obj_->customer_id(), aggregate_workers_, cmd, kvs->keys,
+                         kvs->vals, kvs->lens, done, &sum, &dones)) {
+    return false;
+  }
+  kvs->vals = sum;
+  if (dones.empty()) return true;
+  // finish the other pushes of the group together with this one
+  Callback cb;
+  mu_.lock();
+  auto it = callbacks_.find(timestamp);
+  if (it != callbacks_.end()) cb = std::move(it->second);
+  callbacks_[timestamp] = [dones, cb]() {
+    for (const auto& d : dones) d();
+    if (cb) cb();
+  };
+  mu_.unlock();
+  return true;
+}
+
+template <typename Val>
+bool KVWorker<Val>::Slice(const KVPairs<Val>& kvs, bool push, SlicedKVs* sliced,
+                          std::shared_ptr<const ScatterPlans>* plans) {
+  const auto& ranges = Postoffice::Get()->GetServerKeyRanges();
+  size_t n = kvs.keys.size();
+  size_t k = push && n && kvs.lens.empty() ? kvs.vals.size() / n : 0;
+  auto length = [&kvs, k](size_t j) -> size_t {
+    return kvs.lens.empty() ? k : kvs.lens[j];
+  };
+
+  // find the keys to stripe
+  std::vector<size_t> striped;
+  mu_.lock();
+  if (n && (stripe_bytes_ || !striped_keys_.empty())) {
+    for (size_t j = 0; j < n; ++j) {
+      if ((push && stripe_bytes_ && length(j) * sizeof(Val) >= stripe_bytes_) ||
+          (!striped_keys_.empty() && striped_keys_.count(kvs.keys[j]))) {
+        striped.push_back(j);
+      }
+    }
+    if (push) {
+      for (size_t j : striped) striped_keys_.insert(kvs.keys[j]);
+    }
+  }
+  mu_.unlock();
+  if (striped.empty()) {
+    // the owner of a key only depends on the key list with the builtin
+    // slicers. the range slicer is cheaper than hashing the keys
+    bool memoize = max_slice_plans_ && n && (slicer_kind_ == kModSlicer ||
+        slicer_kind_ == kHashSlicer || slicer_kind_ == kConsistentHashSlicer);
+    uint64_t hash = 0;
+    if (memoize) {
+      hash = HashKeys(kvs.keys.data(), n);
+      std::shared_ptr<const SlicePlan> plan;
+      slice_plans_mu_.lock();
+      auto it = slice_plan_index_.find(hash);
+      if (it != slice_plan_index_.end()) {
+        plan = slice_plans_[it->second];
+        slice_plan_used_[it->second] = 1;
+      }
+      slice_plans_mu_.unlock();
+      // a different key list may have the same hash
+      if (plan && (plan->size != n || memcmp(plan->all_keys.data(),
+                                             kvs.keys.data(), n * sizeof(Key)))) {
+        plan.reset();
+      }
+      if (plan) {
+        SliceByPlan(*plan, kvs, push, sliced);
+        if (plans) *plans = plan->plans;
+        return false;
+      }
+    }
+    slicer_(kvs, ranges, sliced);
+    if (!plans && !memoize) return false;
+    auto p = BuildPlans(kvs.keys, *sliced);
+    if (plans) *plans = p;
+    if (memoize) {
+      std::shared_ptr<SlicePlan> plan(new SlicePlan());
+      plan->size = n;
+      plan->hash = hash;
+      plan->all_keys.CopyFrom(kvs.keys);
+      plan->plans = p;
+      for (const auto& s : *sliced) {
+        plan->keys.push_back(s.first ? s.second.keys : SArray<Key>());
+      }
+      std::lock_guard<std::mutex> lk(slice_plans_mu_);
+      size_t i;
+      auto it = slice_plan_index_.find(hash);
+      if (it != slice_plan_index_.end()) {
+        i = it->second;
+      } else if (slice_plans_.size() < max_slice_plans_) {
+        i = slice_plans_.size();
+        slice_plans_.emplace_back();
+        slice_plan_used_.push_back(0);
+      } else {
+        // skip the plans reused since the hand passed them once. the hand
+        // stays at the new plan, so a key list sliced only once is the next
+        // to go, and a working set a bit larger than the memo mostly hits
+        while (slice_plan_used_[slice_plan_hand_]) {
+          slice_plan_used_[slice_plan_hand_] = 0;
+          slice_plan_hand_ = (slice_plan_hand_ + 1) % slice_plans_.size();
+        }
+        i = slice_plan_hand_;
+        slice_plan_index_.erase(slice_plans_[i]->hash);
+      }
+      slice_plans_[i] = plan;
+      slice_plan_used_[i] = 0;
+      slice_plan_index_[hash] = i;
+    }
+    return false;
+  }
+
+  // slice the other keys as usual
+  size_t num_servers = ranges.size();
+  KVPairs<Val> rest;
+  std::vector<size_t> val_begin(n + 1, 0);
+  for (size_t j = 0; j < n; ++j) val_begin[j+1] = val_begin[j] + length(j);
+  for (size_t j = 0, t = 0; j < n; ++j) {
+    if (t < striped.size() && striped[t] == j) { ++t; continue; }
+    rest.keys.push_back(kvs.keys[j]);
+    if (push) {
+      rest.vals.append(kvs.vals.segment(val_begin[j], val_begin[j+1]));
+      if (kvs.lens.size()) rest.lens.push_back(kvs.lens[j]);
+    }
+  }
+  SlicedKVs rest_sliced(num_servers);
+  if (rest.keys.size()) slicer_(rest, ranges, &rest_sliced);
+  CHECK_EQ(rest_sliced.size(), num_servers);
+
+  // then merge the chunks of striped values in by keys
+  sliced->clear();
+  sliced->resize(num_servers);
+  std::shared_ptr<ScatterPlans> striped_plans;
+  if (plans) striped_plans.reset(new ScatterPlans(num_servers));
+  for (size_t i = 0; i < num_servers; ++i) {
+    const KVPairs<Val>& r = rest_sliced[i].second;
+    size_t r_n = rest_sliced[i].first ? r.keys.size() : 0;
+    size_t r_k = r_n && r.lens.empty() ? r.vals.size() / r_n : 0;
+    KVPairs<Val>& out = sliced->at(i).second;
+    sliced->at(i).first = true;
+    size_t a = 0, b = 0, r_val = 0;
+    while (a < r_n || b < striped.size()) {
+      size_t pos;
+      if (b == striped.size() || (a < r_n && r.keys[a] < kvs.keys[striped[b]])) {
+        // a key of the rest
+        pos = std::lower_bound(kvs.keys.begin(), kvs.keys.end(), r.keys[a]) -
+              kvs.keys.begin();
+        out.keys.push_back(r.keys[a]);
+        if (push) {
+          size_t len = r.lens.empty() ? r_k : r.lens[a];
+          out.vals.append(r.vals.segment(r_val, r_val + len));
+          out.lens.push_back(static_cast<int>(len));
+          r_val += len;
+        }
+        ++a;
+      } else {
+        // chunk i of a striped value
+        pos = striped[b];
+        size_t len = length(pos);
+        size_t begin = val_begin[pos] + len * i / num_servers;
+        size_t end = val_begin[pos] + len * (i + 1) / num_servers;
+        out.keys.push_back(kvs.keys[pos]);
+        if (push) {
+          if (r_n == 0 && striped.size() == 1) {
+            out.vals = kvs.vals.segment(begin, end);  // zero-copy
+          } else {
+            out.vals.append(kvs.vals.segment(begin, end));
+          }
+          out.lens.push_back(static_cast<int>(end - begin));
+        }
+        ++b;
+      }
+      if (plans) striped_plans->at(i).index.push_back(pos);
+    }
+    if (plans) striped_plans->at(i).num_keys = out.keys.size();
+  }
+  if (plans) *plans = striped_plans;
+  return true;
+}
+
+template <typename Val>
+std::shared_ptr<const typename KVWorker<Val>::ScatterPlans>
+KVWorker<Val>::BuildPlans(const SArray<Key>& keys, const SlicedKVs& sliced) {
+  size_t keys_cnt = keys.size();
+  uintptr_t keys_begin = reinterpret_cast<uintptr_t>(keys.data());
+  std::shared_ptr<ScatterPlans> plans(new ScatterPlans(sliced.size()));
+  for (size_t i = 0; i < sliced.size(); ++i) {
+    plans->at(i).num_keys = sliced[i].first ? sliced[i].second.keys.size() : 0;
+  }
+  if (slicer_kind_ == kHashSlicer || slicer_kind_ == kConsistentHashSlicer) {
+    // the owner of a key only depends on the key, so is computed again
+    size_t num_servers = sliced.size();
+    for (size_t j = 0; j < keys_cnt; ++j) {
+      int i = slicer_kind_ == kHashSlicer ?
+          static_cast<int>(SplitMix64(keys[j]) % num_servers) : ring_.Owner(keys[j]);
+      plans->at(i).index.push_back(j);
+    }
+  }
+  for (size_t i = 0; i < sliced.size(); ++i) {
+    auto& plan = plans->at(i);
+    const SArray<Key>& s = sliced[i].second.keys;
+    if (!plan.num_keys || !plan.index.empty()) continue;
+    uintptr_t pos = reinterpret_cast<uintptr_t>(s.data());
+    if (pos >= keys_begin &&
+        (pos - keys_begin) / sizeof(Key) + s.size() <= keys_cnt) {
+      // a segment of the keys, such as by the range slicer
+      plan.begin = (pos - keys_begin) / sizeof(Key);
+    } else if (slicer_kind_ == kModSlicer) {
+      plan.begin = i;
+      plan.stride = sliced.size();
+    } else {
+      // a user-defined slicer, look up the keys
+      plan.index.resize(s.size());
+      for (size_t t = 0; t < s.size(); ++t) {
+        const Key* p = std::lower_bound(keys.begin(), keys.end(), s[t]);
+        CHECK(p != keys.end() && *p == s[t]) << "the slicer returns an unknown key";
+        plan.index[t] = p - keys.begin();
+      }
+    }
+  }
+  return plans;
+}
+
+template <typename Val>
+void KVWorker<Val>::SliceByPlan(const SlicePlan& plan, const KVPairs<Val>& kvs,
+                                bool push, SlicedKVs* sliced) {
+  size_t num_servers = plan.keys.size();
+  size_t n = kvs.keys.size();
+  sliced->resize(num_servers);
+  size_t k = 0;
+  std::vector<size_t> offset;
+  if (push) {
+    if (kvs.lens.empty()) {
+      k = kvs.vals.size() / n;
+      CHECK_EQ(k * n, kvs.vals.size());
+    } else {
+      CHECK_EQ(n, kvs.lens.size());
+      offset.resize(n + 1);
+      LensToOffsets(kvs.lens.data(), n, offset.data());
+    }
+  }
+  for (size_t i = 0; i < num_servers; ++i) {
+    const ScatterPlan& sp = plan.plans->at(i);
+    auto& s = sliced->at(i);
+    s.first = sp.num_keys > 0;
+    s.second = KVPairs<Val>();
+    if (!s.first) continue;
+    auto& kv = s.second;
+    kv.keys = plan.keys[i];
+    if (!push) continue;
+    if (kvs.lens.empty()) {
+      size_t num_vals = sp.num_keys * k;
+      kv.vals.reset(new Val[num_vals], num_vals, [](Val* p) { delete [] p; });
+      ScatterPlan::Gather(sp, kvs.vals.data(), k, kv.vals.data());
+      continue;
+    }
+    kv.lens.reset(new int[sp.num_keys], sp.num_keys, [](int* p) { delete [] p; });
+    ScatterPlan::Gather(sp, kvs.lens.data(), 1, kv.lens.data());
+    size_t num_vals = 0;
+    for (int l : kv.lens) num_vals += l;
+    kv.vals.reset(new Val[num_vals], num_vals, [](Val* p) { delete [] p; });
+    Val* dst = kv.vals.data();
+    for (size_t t = 0; t < sp.num_keys; ++t) {
+      size_t len = kv.lens[t];
+      memcpy(dst, kvs.vals.data() + offset[sp.Pos(t)], len * sizeof(Val));
+      dst += len;
+    }
+  }
+}
+
+template <typename Val>
+void KVWorker<Val>::SplitChunks(
+    const KVPairs<Val>& kvs, bool push, std::vector<size_t>* ends) {
+  size_t n = kvs.keys.size();
+  if (!chunk_bytes_ || n < 2) return;
+  size_t max_vals = std::max(chunk_bytes_ / sizeof(Val), (size_t)1);
+  if (push && kvs.lens.size()) {
+    size_t len = 0;
+    for (size_t j = 0; j < n; ++j) {
+      if (len && len + kvs.lens[j] > max_vals) {
+        ends->push_back(j);
+        len = 0;
+      }
+      len += kvs.lens[j];
+    }
+    if (ends->size()) ends->push_back(n);
+    return;
+  }
+  size_t k = push ? std::max(kvs.vals.size() / n, (size_t)1) : 1;
+  size_t step = std::max(max_vals / k, (size_t)1);
+  if (step >= n) return;
+  for (size_t end = step; end < n; end += step) ends->push_back(end);
+  ends->push_back(n);
+}
+
+template <typename Val>
+void KVWorker<Val>::SendSliced(
+    int timestamp, bool push, bool pull, int cmd, const SlicedKVs& sliced,
+    int priority, bool chunk) {
+  // a slice sent in chunks gets a response for every chunk, expect them
+  // before any is sent
+  std::vector<std::vector<size_t>> chunk_ends(sliced.size());
+  int more = 0;
+  for (size_t i = 0; chunk && i < sliced.size(); ++i) {
+    if (!sliced[i].first) continue;
+    SplitChunks(sliced[i].second, push, &chunk_ends[i]);
+    if (chunk_ends[i].size()) more += chunk_ends[i].size() - 1;
+  }
+  if (more) obj_->AddExpected(timestamp, more);
 
   // need to add response first, since it will not always trigger the callback
   int skipped = 0;
@@ -581,6 +2037,11 @@ void KVWorker<Val>::Send(int timestamp, bool push, int cmd, const KVPairs<Val>&
   if ((size_t)skipped == sliced.size()) {
     RunCallback(timestamp);
   }
+  mu_.lock();
+  for (size_t i = 0; i < sliced.size() && i < keys_sent_.size(); ++i) {
+    if (sliced[i].first) keys_sent_[i] += sliced[i].second.keys.size();
+  }
+  mu_.unlock();
 
   for (size_t i = 0; i < sliced.size(); ++i) {
     const auto& s = sliced[i];
@@ -590,23 +2051,46 @@ void KVWorker<Val>::Send(int timestamp, bool push, int cmd, const KVPairs<Val>&
     msg.meta.customer_id = obj_->customer_id();
     msg.meta.request     = true;
     msg.meta.push        = push;
+    msg.meta.pull        = pull;
     msg.meta.head        = cmd;
     msg.meta.timestamp   = timestamp;
+    msg.meta.priority    = priority;
+    msg.meta.clock       = clock_;
     msg.meta.recver      = Postoffice::Get()->ServerRankToID(i);
     msg.meta.sender      = Postoffice::Get()->van()->my_node().id;
     const auto& kvs = s.second;
-    if (kvs.keys.size()) {
-      msg.AddData(kvs.keys);
-      msg.AddData(kvs.vals);
+    if (chunk_ends[i].empty()) {
+      if (kvs.keys.size()) {
+        msg.AddData(kvs.keys);
+        msg.AddData(kvs.vals);
+        if (kvs.lens.size()) {
+          AddLens(kvs.lens, &msg);
+        }
+      }
+      Postoffice::Get()->van()->Send(msg);
+      continue;
+    }
+    size_t k = kvs.lens.empty() ? kvs.vals.size() / kvs.keys.size() : 0;
+    size_t begin = 0, val_begin = 0;
+    for (size_t end : chunk_ends[i]) {
+      size_t val_end = val_begin;
+      if (kvs.lens.empty()) {
+        val_end = end * k;
+      } else {
+        for (size_t j = begin; j < end; ++j) val_end += kvs.lens[j];
+      }
+      Message part;
+      part.meta = msg.meta;
+      part.meta.chunk_begin = begin;
+      part.AddData(kvs.keys.segment(begin, end));
+      part.AddData(kvs.vals.segment(val_begin, val_end));
       if (kvs.lens.size()) {
-        msg.AddData(kvs.lens);
+        AddLens(kvs.lens.segment(begin, end), &part);
       }
+      Postoffice::Get()->van()->Send(part);
+      begin = end;
+      val_begin = val_end;
     }
-    Postoffice::Get()->van()->Send(msg);
-  }
-  if (Postoffice::Get()->verbose() >= 2) {
-    double time_end = (double)clock();
-    PS_VLOG(2)<<"Exit KVWorker Send: "<<time_end/CLOCKS_PER_SEC<<" "<<(time_end-time_st)/CLOCKS_PER_SEC<<" "<<kvs.keys.size();
   }
 }
 
@@ -618,94 +2102,160 @@ void KVWorker<Val>::Process(const Message& msg) {
   }
   // store the data for pulling
   int ts = msg.meta.timestamp;
-  if (!msg.meta.push && msg.data.size()) {
+  if (cache_) {
+    cache_->Observe(Postoffice::Get()->IDtoRank(msg.meta.sender), msg.meta.version);
+  }
+  if ((!msg.meta.push || msg.meta.pull) && msg.data.size()) {
     CHECK_GE(msg.data.size(), (size_t)2);
     KVPairs<Val> kvs;
     kvs.keys = msg.data[0];
     kvs.vals = msg.data[1];
     if (msg.data.size() > (size_t)2) {
-      kvs.lens = msg.data[2];
+      kvs.lens = GetLens(msg, 2, kvs.keys.size());
+    }
+    std::shared_ptr<PullSlot> hold;
+    PullSlot& slot = *PullSlotOf(ts, &hold);
+    std::lock_guard<std::mutex> lk(slot.mu);
+    if (slot.ts.load(std::memory_order_acquire) == ts) {
+      int rank = Postoffice::Get()->IDtoRank(msg.meta.sender);
+      if (cache_ && !slot.striped && kvs.lens.empty() && msg.meta.head == 0) {
+        cache_->Insert(rank, msg.meta.version, kvs.keys, kvs.vals);
+      }
+      if (slot.place) {
+        slot.place(rank, msg.meta.chunk_begin, kvs);
+      } else {
+        CHECK_EQ(msg.meta.chunk_begin, 0) << "only fixed length pulls are chunked";
+        slot.parts[rank] = kvs;
+      }
+    } else {
+      PS_VLOG(1) << "drop the pull reply of a finished request " << ts;
     }
-    mu_.lock();
-    recv_kvs_[ts].push_back(kvs);
-    mu_.unlock();
   }
 
   // finished, run callbacks
-  if (obj_->NumResponse(ts) == Postoffice::Get()->num_servers() - 1)  {
+  if (obj_->NumResponse(ts) == obj_->NumExpected(ts) - 1)  {
     RunCallback(ts);
   }
 }
 template <typename Val>
 void KVWorker<Val>::RunCallback(int timestamp) {
+  // take the callback out before running it, since it may issue new requests
+  // and so insert into callbacks_
+  Callback cb;
   mu_.lock();
   auto it = callbacks_.find(timestamp);
   if (it != callbacks_.end()) {
-    mu_.unlock();
-
-    CHECK(it->second);
-    it->second();
-
-    mu_.lock();
+    cb = std::move(it->second);
     callbacks_.erase(it);
+    running_[timestamp] = std::this_thread::get_id();
   }
   mu_.unlock();
+  if (!cb) return;
+  cb();
+  // Cancel may wait for it
+  mu_.lock();
+  running_.erase(timestamp);
+  mu_.unlock();
+  running_cond_.notify_all();
+}
+
+template <typename Val>
+template <typename C>
+int KVWorker<Val>::CachedPull_(const SArray<Key>& keys, C* vals,
+                               const Callback& cb, int priority) {
+  KVPairs<Val> kvs;
+  kvs.priority = priority;
+  size_t k = cache_->val_len();
+  size_t n = keys.size();
+  if (k == 0 || n == 0) {
+    kvs.keys = keys;
+    return Pull_(kvs, false, vals, static_cast<SArray<int>*>(nullptr), 0, cb);
+  }
+  if (vals->empty()) {
+    vals->resize(n * k);
+  } else {
+    CHECK_EQ(vals->size(), n * k) << "unmatched value length";
+  }
+  auto misses = std::make_shared<std::vector<size_t>>();
+  cache_->Lookup(keys, vals->data(), misses.get());
+  if (misses->empty()) {
+    int ts = obj_->NewRequest(kServerGroup);
+    if (cb) cb();
+    obj_->AddResponse(ts, Postoffice::Get()->num_servers());
+    return ts;
+  }
+  // the mod and user-defined slicers may send a key to different servers in
+  // different key lists, so a subset of the keys cannot be pulled
+  bool by_key = slicer_kind_ == kRangeSlicer || slicer_kind_ == kHashSlicer ||
+      slicer_kind_ == kConsistentHashSlicer;
+  if (misses->size() == n || !by_key) {
+    kvs.keys = keys;
+    return Pull_(kvs, false, vals, static_cast<SArray<int>*>(nullptr), 0, cb);
+  }
+
+  // pull the missed keys, and then copy them into their positions
+  kvs.keys.resize(misses->size());
+  for (size_t t = 0; t < misses->size(); ++t) kvs.keys[t] = keys[(*misses)[t]];
+  auto pulled = std::make_shared<SArray<Val>>();
+  return Pull_(kvs, false, pulled.get(), static_cast<SArray<int>*>(nullptr), 0,
+               [vals, k, misses, pulled, cb]() {
+      CHECK_EQ(pulled->size(), misses->size() * k) << "unmatched value length";
+      for (size_t t = 0; t < misses->size(); ++t) {
+        memcpy(vals->data() + (*misses)[t] * k, pulled->data() + t * k,
+               k * sizeof(Val));
+      }
+      if (cb) cb();
+    });
 }
 
 template <typename Val>
 template <typename C, typename D>
 int KVWorker<Val>::Pull_(
-    const SArray<Key>& keys, C* vals, D* lens, int cmd, const Callback& cb) {
+    const KVPairs<Val>& kvs, bool push, C* vals, D* lens, int cmd,
+    const Callback& cb) {
   int ts = obj_->NewRequest(kServerGroup);
-//    PS_VLOG(1)<<"start pulling";
-  AddCallback(ts, [this, ts, keys, vals, lens, cb]() mutable {
-      mu_.lock();
-      auto& kvs = recv_kvs_[ts];
-      mu_.unlock();
-
-//      PS_VLOG(1)<<"start pulling: check";
-      // do check
-      size_t total_key = 0, total_val = 0, total_kvs = 0;
-      size_t keys_cnt = keys.size();
-      int slicer_kind =atoi(Environment::Get()->find("PS_SLICER"));
-      size_t num_servers = Postoffice::Get()->num_servers();
-      if (slicer_kind==0){
-          for (const auto& s : kvs) {
-            Range range = FindRange(keys, s.keys.front(), s.keys.back()+1);
-            CHECK_EQ(range.size(), s.keys.size())
-                << "unmatched keys size from one server";
-            if (lens) CHECK_EQ(s.lens.size(), s.keys.size());
-            total_key += s.keys.size();
-            total_val += s.vals.size();
-          }
-      }else{
-          std::vector<size_t> cnt_server(num_servers, 0);
-          for (size_t i=0; i<keys_cnt; ++i)
-            ++cnt_server[keys[i]%num_servers];
-          for (const auto& s : kvs){
-              CHECK_EQ(s.keys.size(), cnt_server[s.keys[0]%num_servers])
-                <<"unmatched keys size from one server";
-              total_key += s.keys.size();
-              total_val += s.vals.size();
-              ++ total_kvs;
-          }
-      }
-      CHECK_EQ(total_key, keys_cnt) << "lost some servers?";
+  std::shared_ptr<PullSlot> hold;
+  PullSlot* slot = ClaimPullSlot(ts, &hold);
+  SlicedKVs sliced;
+  size_t keys_cnt = kvs.keys.size();
+  // record where the keys of every server are in the request, so that each
+  // reply can be scattered into its positions in a single pass
+  bool striped = Slice(kvs, push, &sliced, &slot->plans);
+  slot->striped = striped;
 
-//      PS_VLOG(1)<<"start pulling: fill vals and lens";
-      // fill vals and lens
-      std::sort(kvs.begin(), kvs.end(), [](
-          const KVPairs<Val>& a, const KVPairs<Val>& b) {
-                  return a.keys.front() < b.keys.front();
-        });
+  // fixed length values are copied into vals once a reply arrives, while the
+  // positions of variable length or striped values are known only with all
+  // replies
+  if (!lens && !striped) {
+    slot->place = [slot, vals, keys_cnt](int i, size_t first,
+                                         const KVPairs<Val>& kvs) {
+      const auto& plan = slot->plans->at(i);
+      size_t n = kvs.keys.size();
+      CHECK_LE(first + n, plan.num_keys) << "unmatched keys size from one server";
+      CHECK(kvs.lens.empty()) << "variable length values need the lens buffer";
+      size_t k = n ? kvs.vals.size() / n : 0;
+      CHECK_EQ(k * n, kvs.vals.size());
+      if (vals->empty()) vals->resize(k * keys_cnt);
+      CHECK_EQ(vals->size(), k * keys_cnt) << "unmatched value length";
+      ScatterPlan::Scatter(plan, first, n, kvs.vals.data(), k, vals->data());
+      slot->num_placed += n;
+    };
+  }
+
+  AddCallback(ts, [this, slot, hold, keys_cnt, vals, lens, cb]() mutable {
       CHECK_NOTNULL(vals);
-      if (vals->empty()) {
-        vals->resize(total_val);
-      } else {
-        CHECK_EQ(vals->size(), total_val);
+      if (slot->place) {
+        // already copied into vals
+        CHECK_EQ(slot->num_placed, keys_cnt) << "lost some servers?";
+        ReleasePullSlot(slot);
+        if (cb) cb();
+        return;
       }
-      Val* p_vals = vals->data();
-      int *p_lens = nullptr;
+
+      // scatter the lens first. a striped value gets a chunk from every
+      // server, so its length is the sum of the chunks
+      std::vector<int> striped_lens;
+      int* p_lens = nullptr;
       if (lens) {
         if (lens->empty()) {
           lens->resize(keys_cnt);
@@ -713,67 +2263,67 @@ int KVWorker<Val>::Pull_(
           CHECK_EQ(lens->size(), keys_cnt);
         }
         p_lens = lens->data();
+      } else {
+        striped_lens.resize(keys_cnt);
+        p_lens = striped_lens.data();
       }
-//      PS_VLOG(1)<<"start pulling: deal with different slicer";
-      if (slicer_kind==0){
-          // deal with default range slicer
-          for (const auto& s : kvs) {
-            memcpy(p_vals, s.vals.data(), s.vals.size() * sizeof(Val));
-            p_vals += s.vals.size();
-            if (p_lens) {
-              memcpy(p_lens, s.lens.data(), s.lens.size() * sizeof(int));
-              p_lens += s.lens.size();
-            }
-          }
-      }else{
-          // deal with mod slicer
-          std::vector<size_t> cnt_s(total_kvs, 0);
-          std::vector<size_t> cnt_sv(total_kvs, 0);
-//          PS_VLOG(1)<<"start pulling: "<<total_kvs<<" "<<keys_cnt;
-          for (size_t i=0; i<keys_cnt; ++i){
-//              PS_VLOG(1)<<"start pulling: "<<i;
-              size_t j=0, k;
-              for (j=0;j<total_kvs;++j){
-                  auto& s = kvs[j];
-//                  PS_VLOG(1)<<"start pulling: "<<i<<" "<<j<<" "<<keys[i]<<" "<<s.keys[cnt_s[j]];
-                  if (cnt_s[j]>=s.keys.size())
-                      continue;
-                  if (keys[i]==s.keys[cnt_s[j]]){
-                      size_t vector_id = cnt_s[j];
-                      if (s.lens.empty())
-                          k = s.vals.size() / s.keys.size();
-                      else
-                          k = s.lens[vector_id];
-//                      PS_VLOG(1)<<"start pulling: keys equal "<<cnt_sv[j]<<" "<<vector_id<<" "<<k;
-                      memcpy(p_vals, s.vals.data()+cnt_sv[j], k * sizeof(Val));
-                      p_vals += k;
-//                      PS_VLOG(1)<<"start pulling: memcpy p_vals";
-                      if (p_lens){
-                          memcpy(p_lens, s.lens.data()+vector_id, sizeof(int));
-                          p_lens += 1;
-                      }
-//                      PS_VLOG(1)<<"start pulling: memcpy p_lens";
-                      cnt_sv[j] += k;
-                      ++cnt_s[j];
-                      break;
-                  }
-              }
-              if (j>=total_kvs){
-//                  PS_VLOG(1)<<"no matched keys when merging";
-                  CHECK_EQ(0,1)<<"no matched keys when merging";
-              }
-          }
+      if (slot->striped) memset(p_lens, 0, keys_cnt * sizeof(int));
+      size_t total_key = 0;
+      for (size_t i = 0; i < slot->plans->size(); ++i) {
+        const auto& plan = slot->plans->at(i);
+        auto& s = slot->parts[i];
+        if (!plan.num_keys) continue;
+        CHECK_EQ(s.keys.size(), plan.num_keys) << "unmatched keys size from one server";
+        if (s.lens.empty() && slot->striped) {
+          s.lens.resize(s.keys.size(), s.vals.size() / s.keys.size());
+        }
+        CHECK_EQ(s.lens.size(), s.keys.size());
+        if (slot->striped) {
+          for (size_t t = 0; t < plan.num_keys; ++t) p_lens[plan.Pos(t)] += s.lens[t];
+        } else {
+          ScatterPlan::Scatter(plan, s.lens.data(), 1, p_lens);
+        }
+        total_key += s.keys.size();
+      }
+      if (!slot->striped) CHECK_EQ(total_key, keys_cnt) << "lost some servers?";
+
+      // then the values, to the positions given by the prefix sum of lens.
+      // chunks are appended in the order of servers
+      std::vector<size_t> offset(keys_cnt + 1);
+      LensToOffsets(p_lens, keys_cnt, offset.data());
+      if (vals->empty()) {
+        vals->resize(offset.back());
+      } else {
+        CHECK_EQ(vals->size(), offset.back());
+      }
+      Val* p_vals = vals->data();
+      for (size_t i = 0; i < slot->plans->size(); ++i) {
+        const auto& plan = slot->plans->at(i);
+        const auto& s = slot->parts[i];
+        if (!plan.num_keys) continue;
+        if (plan.index.empty() && plan.stride == 1) {
+          size_t begin = offset[plan.begin];
+          CHECK_EQ(offset[plan.begin + plan.num_keys] - begin, s.vals.size());
+          memcpy(p_vals + begin, s.vals.data(), s.vals.size() * sizeof(Val));
+          continue;
+        }
+        size_t v = 0;
+        for (size_t t = 0; t < plan.num_keys; ++t) {
+          size_t len = s.lens[t];
+          size_t pos = plan.Pos(t);
+          CHECK_LE(v + len, s.vals.size());
+          memcpy(p_vals + offset[pos], s.vals.data() + v, len * sizeof(Val));
+          if (slot->striped) offset[pos] += len;
+          v += len;
+        }
       }
-//      PS_VLOG(1)<<"start pulling: finish filling";
 
-      mu_.lock();
-      recv_kvs_.erase(ts);
-      mu_.unlock();
+      ReleasePullSlot(slot);
       if (cb) cb();
     });
 
-  KVPairs<Val> kvs; kvs.keys = keys;
-  Send(ts, false, cmd, kvs);
+  PublishPullSlot(slot, ts);
+  SendSliced(ts, push, push, cmd, sliced, kvs.priority, slot->place != nullptr);
   return ts;
 }
 
@@ -0,0 +1,312 @@
+/**
+ *  Copyright (c) 2015 by Contributors
+ * @file   kv_checkpoint.h
+ * @brief  checkpoints of server stores in memory-mappable files
+ */
+#ifndef PS_KV_CHECKPOINT_H_
+#define PS_KV_CHECKPOINT_H_
+#include <fcntl.h>
+#include <stdio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <condition_variable>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "ps/kv_store.h"
+#include "ps/internal/threadsafe_queue.h"
+namespace ps {
+
+/**
+ * \brief the header of a snapshot file. It is followed by two columns, the
+ * keys, and the values of the keys in the same order, both at page aligned
+ * offsets so that a mapped file can be used in place
+ */
+struct KVSnapshotHeader {
+  /** \brief "PSKVSNAP" */
+  char magic[8];
+  uint32_t version;
+  /** \brief sizeof(Val) */
+  uint32_t val_size;
+  uint64_t val_len;
+  uint64_t num_keys;
+  /** \brief the file offsets of the key and the value columns */
+  uint64_t keys_offset;
+  uint64_t vals_offset;
+  /** \brief 1 if only the keys updated since the previous snapshot */
+  uint32_t delta;
+  uint32_t pad[3];
+};
+static_assert(sizeof(KVSnapshotHeader) == 64, "unexpected header size");
+
+/** \brief the alignment of the columns of a snapshot file */
+static const uint64_t kSnapshotAlign = 4096;
+
+/**
+ * \brief write a snapshot of \a store into \a path, all keys, or with \a delta
+ * only the keys updated since the last snapshot of the store.
+ *
+ * Keys and values are copied out slab by slab while the writer of the store
+ * goes on, so every key is consistent, but keys updated meanwhile may be newer
+ * than others. Such keys are also in the next delta. The file is written
+ * aside and renamed, so \a path is either the old file or the complete new one
+ */
+template <typename Val>
+void WriteSnapshot(KVStore<Val>* store, bool delta, const std::string& path) {
+  std::vector<uint32_t> index;
+  store->Snapshot(delta, &index);
+  size_t n = index.size(), k = store->val_len();
+  KVSnapshotHeader h;
+  memset(&h, 0, sizeof(h));
+  memcpy(h.magic, "PSKVSNAP", 8);
+  h.version = 1;
+  h.val_size = sizeof(Val);
+  h.val_len = k;
+  h.num_keys = n;
+  auto align = [](uint64_t x) {
+    return (x + kSnapshotAlign - 1) / kSnapshotAlign * kSnapshotAlign;
+  };
+  h.keys_offset = align(sizeof(h));
+  h.vals_offset = align(h.keys_offset + n * sizeof(Key));
+  h.delta = delta;
+
+  std::string tmp = path + ".tmp";
+  FILE* f = fopen(tmp.c_str(), "wb");
+  CHECK(f) << "failed to open " << tmp;
+  CHECK_EQ(fwrite(&h, sizeof(h), 1, f), 1U);
+  // copy out and write a chunk of keys at a time, into both columns
+  const size_t kChunk = 1 << 16;
+  std::vector<Key> keys(std::min(n, kChunk));
+  std::vector<Val> vals(keys.size() * k);
+  for (size_t i = 0; i < n; i += kChunk) {
+    size_t m = std::min(kChunk, n - i);
+    store->Export(index.data() + i, m, keys.data(), vals.data());
+    CHECK_EQ(fseeko(f, h.keys_offset + i * sizeof(Key), SEEK_SET), 0);
+    CHECK_EQ(fwrite(keys.data(), sizeof(Key), m, f), m);
+    CHECK_EQ(fseeko(f, h.vals_offset + i * k * sizeof(Val), SEEK_SET), 0);
+    CHECK_EQ(fwrite(vals.data(), sizeof(Val), m * k, f), m * k);
+  }
+  CHECK_EQ(fflush(f), 0) << "failed to write " << tmp;
+  // extend the file to the end of the columns even if they are empty
+  CHECK_EQ(ftruncate(fileno(f), h.vals_offset + n * k * sizeof(Val)), 0);
+  CHECK_EQ(fsync(fileno(f)), 0) << "failed to write " << tmp;
+  fclose(f);
+  CHECK_EQ(rename(tmp.c_str(), path.c_str()), 0) << "failed to rename " << tmp;
+}
+
+/**
+ * \brief a snapshot file mapped into memory read only. The keys and values
+ * are used in place, pages are read from the file when first touched
+ */
+template <typename Val>
+class KVSnapshotFile {
+ public:
+  explicit KVSnapshotFile(const std::string& path) {
+    int fd = open(path.c_str(), O_RDONLY);
+    CHECK_GE(fd, 0) << "failed to open " << path;
+    struct stat st;
+    CHECK_EQ(fstat(fd, &st), 0) << "failed to stat " << path;
+    size_ = st.st_size;
+    CHECK_GE(size_, sizeof(KVSnapshotHeader)) << path << " is truncated";
+    data_ = mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    CHECK(data_ != MAP_FAILED) << "failed to map " << path;
+    h_ = static_cast<const KVSnapshotHeader*>(data_);
+    CHECK_EQ(memcmp(h_->magic, "PSKVSNAP", 8), 0) << path << " is not a snapshot";
+    CHECK_EQ(h_->version, 1U) << "unknown version of " << path;
+    CHECK_EQ(h_->val_size, sizeof(Val)) << "unmatched value type of " << path;
+    CHECK_LE(h_->keys_offset + h_->num_keys * sizeof(Key), h_->vals_offset);
+    CHECK_LE(h_->vals_offset + h_->num_keys * h_->val_len * sizeof(Val), size_)
+        << path << " is truncated";
+  }
+
+  ~KVSnapshotFile() { munmap(data_, size_); }
+
+  KVSnapshotFile(const KVSnapshotFile&) = delete;
+  KVSnapshotFile& operator=(const KVSnapshotFile&) = delete;
+
+  size_t num_keys() const { return h_->num_keys; }
+  size_t val_len() const { return h_->val_len; }
+  bool delta() const { return h_->delta; }
+  /** \brief the keys, in no particular order */
+  const Key* keys() const {
+    return reinterpret_cast<const Key*>(static_cast<const char*>(data_) + h_->keys_offset);
+  }
+  /** \brief the values of keys()[j] are [j*val_len, (j+1)*val_len) */
+  const Val* vals() const {
+    return reinterpret_cast<const Val*>(static_cast<const char*>(data_) + h_->vals_offset);
+  }
+
+ private:
+  void* data_;
+  size_t size_;
+  const KVSnapshotHeader* h_;
+};
+
+/**
+ * \brief checkpoints a \ref KVStore in the background, as a chain of a full
+ * snapshot followed by deltas, which \ref Restore loads back.
+ *
+ * The snapshots are files prefix-N.full and prefix-N.delta, and the file
+ * prefix.manifest lists the current chain. A full snapshot starts a new chain
+ * and removes the files of the old one. Sample usage on a server
+ * \code
+ *   auto store = std::make_shared<KVStore<float>>(val_len);
+ *   KVCheckpointer<float> ckpt("/data/server-" + std::to_string(MyRank()));
+ *   ckpt.Restore(store.get());
+ *   KVStoreHandle<float> handle;
+ *   handle.store = store;
+ *   server->set_request_handle(handle);
+ *   // then periodically, such as every minute, and a full one every hour
+ *   ckpt.Checkpoint(store, true);
+ * \endcode
+ * With PS_SERVER_THREADS every shard has its own store, which the handle
+ * creates, so use a checkpointer per shard by a custom handle instead.
+ */
+template <typename Val>
+class KVCheckpointer {
+ public:
+  /** \brief constructor, continues the chain of \a prefix if there is one */
+  explicit KVCheckpointer(const std::string& prefix) : prefix_(prefix) {
+    std::ifstream in(prefix_ + ".manifest");
+    Entry e;
+    std::string type;
+    while (in >> e.seq >> type) {
+      e.delta = type == "delta";
+      chain_.push_back(e);
+    }
+    if (!chain_.empty()) seq_ = chain_.back().seq + 1;
+    thread_ = std::thread(&KVCheckpointer::Run, this);
+  }
+
+  /** \brief finish the pending checkpoints */
+  ~KVCheckpointer() {
+    queue_.Push(Task());
+    thread_.join();
+  }
+
+  KVCheckpointer(const KVCheckpointer&) = delete;
+  KVCheckpointer& operator=(const KVCheckpointer&) = delete;
+
+  /**
+   * \brief checkpoint \a store in the background, returns at once. A \a delta
+   * is taken against the previous checkpoint or \ref Restore of the same
+   * store by this checkpointer, otherwise it becomes a full one
+   */
+  void Checkpoint(const std::shared_ptr<KVStore<Val>>& store, bool delta = false) {
+    std::lock_guard<std::mutex> lk(mu_);
+    if (store.get() != base_) delta = false;
+    base_ = store.get();
+    ++pending_;
+    Task task;
+    task.store = store;
+    task.delta = delta;
+    queue_.Push(task);
+  }
+
+  /** \brief wait until all checkpoints are written */
+  void Wait() {
+    std::unique_lock<std::mutex> lk(mu_);
+    cond_.wait(lk, [this] { return pending_ == 0; });
+  }
+
+  /**
+   * \brief load the last checkpoint into \a store, return false if there is
+   * none. Call it before the store is used, since it is the writer
+   */
+  bool Restore(KVStore<Val>* store) {
+    Wait();
+    if (chain_.empty()) return false;
+    size_t k = store->val_len();
+    for (const Entry& e : chain_) {
+      KVSnapshotFile<Val> file(FileName(e));
+      CHECK_EQ(file.val_len(), k) << "unmatched value length";
+      const size_t kBatch = 1 << 16;
+      for (size_t i = 0; i < file.num_keys(); i += kBatch) {
+        size_t n = std::min(kBatch, file.num_keys() - i);
+        const Val* src = file.vals() + i * k;
+        store->Update(file.keys() + i, n, [src, k](size_t j, Val* v) {
+            memcpy(v, src + j * k, k * sizeof(Val));
+          });
+      }
+    }
+    // the restored keys are not an update since the checkpoint
+    store->Snapshot(false, nullptr);
+    std::lock_guard<std::mutex> lk(mu_);
+    base_ = store;
+    return true;
+  }
+
+ private:
+  struct Task {
+    /** \brief nullptr to stop */
+    std::shared_ptr<KVStore<Val>> store;
+    bool delta = false;
+  };
+
+  struct Entry {
+    uint64_t seq = 0;
+    bool delta = false;
+  };
+
+  std::string FileName(const Entry& e) const {
+    return prefix_ + "-" + std::to_string(e.seq) + (e.delta ? ".delta" : ".full");
+  }
+
+  void Run() {
+    while (true) {
+      Task task;
+      queue_.WaitAndPop(&task);
+      if (!task.store) break;
+      Entry e;
+      e.seq = seq_++;
+      e.delta = task.delta;
+      WriteSnapshot(task.store.get(), e.delta, FileName(e));
+      std::vector<Entry> old;
+      if (!e.delta) old.swap(chain_);
+      chain_.push_back(e);
+      WriteManifest();
+      for (const Entry& o : old) remove(FileName(o).c_str());
+      {
+        std::lock_guard<std::mutex> lk(mu_);
+        --pending_;
+      }
+      cond_.notify_all();
+    }
+  }
+
+  /** \brief write the chain aside and rename, so the manifest is never partial */
+  void WriteManifest() const {
+    std::string path = prefix_ + ".manifest", tmp = path + ".tmp";
+    FILE* f = fopen(tmp.c_str(), "w");
+    CHECK(f) << "failed to open " << tmp;
+    for (const Entry& e : chain_) {
+      fprintf(f, "%llu %s\n", static_cast<unsigned long long>(e.seq),
+              e.delta ? "delta" : "full");
+    }
+    CHECK_EQ(fflush(f), 0) << "failed to write " << tmp;
+    CHECK_EQ(fsync(fileno(f)), 0) << "failed to write " << tmp;
+    fclose(f);
+    CHECK_EQ(rename(tmp.c_str(), path.c_str()), 0) << "failed to rename " << tmp;
+  }
+
+  std::string prefix_;
+  /** \brief the current chain and the next file number, used by the thread */
+  std::vector<Entry> chain_;
+  uint64_t seq_ = 0;
+  /** \brief the store of the last checkpoint or restore */
+  const KVStore<Val>* base_ = nullptr;
+  int pending_ = 0;
+  std::mutex mu_;
+  std::condition_variable cond_;
+  ThreadsafeQueue<Task> queue_;
+  std::thread thread_;
+};
+
+}  // namespace ps
+#endif  // PS_KV_CHECKPOINT_H_
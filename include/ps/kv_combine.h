@@ -0,0 +1,140 @@
+/**
+ *  Copyright (c) 2015 by Contributors
+ * @file   kv_combine.h
+ * @brief  turn raw key-value streams into KVPairs
+ */
+#ifndef PS_KV_COMBINE_H_
+#define PS_KV_COMBINE_H_
+#include <string.h>
+#include <algorithm>
+#include <vector>
+#include "ps/kv_app.h"
+#include "ps/internal/parallel_sort.h"
+namespace ps {
+
+/**
+ * \brief turn a raw key-value list into a \ref KVPairs, namely sort the keys,
+ * remove the duplicates, and sum the values of duplicate keys.
+ *
+ * Sample usage: push the gradients of a minibatch, in which a feature may
+ * appear many times, and then pull the weights back for every appearance
+ * \code
+ *   KVPairs<float> grads;
+ *   std::vector<size_t> index;
+ *   CombineKVPairs(raw_keys, raw_grads, &grads, &index, 4);
+ *   kv.Wait(kv.ZPush(grads.keys, grads.vals));
+ *
+ *   SArray<float> weights, raw_weights;
+ *   kv.Wait(kv.ZPull(grads.keys, &weights));
+ *   ExpandVals(grads.keys, index, weights, &raw_weights, 4);
+ * \endcode
+ *
+ * The keys are sorted by \ref ParallelRadixSort. Then every thread sums the
+ * values of its runs of equal keys, with the inner loop over the value length
+ * vectorized by the compiler. Values of a key are summed in the order they
+ * appear, so the result is deterministic.
+ *
+ * \param keys the keys, in any order and possibly duplicated
+ * \param vals the values, each with length vals.size() / keys.size(). It can
+ * be empty, such as for a pull, then only the keys are sorted and deduped
+ * \param kvs the sorted unique keys, and the summed values
+ * \param index optional, index[j] is set to the position of keys[j] in
+ * kvs->keys
+ * \param num_threads the number of threads
+ */
+template <typename Val>
+void CombineKVPairs(const SArray<Key>& keys, const SArray<Val>& vals,
+                    KVPairs<Val>* kvs, std::vector<size_t>* index = nullptr,
+                    int num_threads = 1) {
+  size_t n = keys.size();
+  *kvs = KVPairs<Val>();
+  if (index) index->resize(n);
+  if (n == 0) return;
+  size_t k = vals.size() / n;
+  CHECK_EQ(k * n, vals.size());
+
+  // sort the keys together with their positions
+  std::vector<Key> sorted(keys.begin(), keys.end());
+  std::vector<size_t> pos(n);
+  for (size_t j = 0; j < n; ++j) pos[j] = j;
+  ParallelRadixSort(sorted.data(), pos.data(), n, num_threads);
+
+  // split into chunks, moving every chunk start to the next new key so that
+  // the duplicates of a key stay in one chunk
+  const size_t kGrainSize = 1 << 16;
+  size_t num_chunks = std::max(
+      std::min((size_t)std::max(num_threads, 1), n / kGrainSize), (size_t)1);
+  std::vector<size_t> begin(num_chunks + 1, n);
+  begin[0] = 0;
+  for (size_t c = 1; c < num_chunks; ++c) {
+    size_t b = std::max(n / num_chunks * c, begin[c-1]);
+    while (b < n && b > 0 && sorted[b] == sorted[b-1]) ++b;
+    begin[c] = b;
+  }
+
+  // count the unique keys of every chunk, and then fill the results
+  std::vector<size_t> first(num_chunks + 1, 0);
+  ParallelFor(num_chunks, [&](size_t c) {
+      size_t u = 0;
+      for (size_t j = begin[c]; j < begin[c+1]; ++j) {
+        u += j == begin[c] || sorted[j] != sorted[j-1];
+      }
+      first[c+1] = u;
+    });
+  for (size_t c = 0; c < num_chunks; ++c) first[c+1] += first[c];
+  size_t m = first[num_chunks];
+  kvs->keys.reset(new Key[m], m, [](Key* p) { delete [] p; });
+  if (k) kvs->vals.reset(new Val[m * k], m * k, [](Val* p) { delete [] p; });
+  ParallelFor(num_chunks, [&](size_t c) {
+      size_t u = first[c];
+      for (size_t j = begin[c]; j < begin[c+1]; ++j) {
+        bool is_new = j == begin[c] || sorted[j] != sorted[j-1];
+        if (is_new && j != begin[c]) ++u;
+        if (index) (*index)[pos[j]] = u;
+        if (is_new) kvs->keys[u] = sorted[j];
+        if (!k) continue;
+        const Val* src = vals.data() + pos[j] * k;
+        Val* dst = kvs->vals.data() + u * k;
+        if (is_new) {
+          memcpy(dst, src, k * sizeof(Val));
+        } else {
+          for (size_t t = 0; t < k; ++t) dst[t] += src[t];
+        }
+      }
+    });
+}
+
+/**
+ * \brief the reverse of \ref CombineKVPairs for pulls, copy the value of every
+ * unique key to all positions the key appears in the raw key list
+ *
+ * \param keys the unique keys, as returned by \ref CombineKVPairs
+ * \param index the index returned by \ref CombineKVPairs
+ * \param vals the values of the unique keys, each with length vals.size() /
+ * keys.size()
+ * \param out set to the values of the raw key list, namely the j-th value is
+ * the index[j]-th value of \a vals
+ * \param num_threads the number of threads
+ */
+template <typename Val>
+void ExpandVals(const SArray<Key>& keys, const std::vector<size_t>& index,
+                const SArray<Val>& vals, SArray<Val>* out, int num_threads = 1) {
+  size_t n = index.size();
+  size_t k = keys.size() ? vals.size() / keys.size() : 0;
+  CHECK_EQ(k * keys.size(), vals.size());
+  out->reset(new Val[n * k], n * k, [](Val* p) { delete [] p; });
+  const size_t kGrainSize = 1 << 16;
+  size_t num_chunks = std::max(
+      std::min((size_t)std::max(num_threads, 1), n / kGrainSize), (size_t)1);
+  size_t chunk = (n + num_chunks - 1) / num_chunks;
+  Val* dst = out->data();
+  ParallelFor(num_chunks, [&](size_t c) {
+      size_t end = std::min((c + 1) * chunk, n);
+      for (size_t j = c * chunk; j < end; ++j) {
+        memcpy(dst + j * k, vals.data() + index[j] * k, k * sizeof(Val));
+      }
+    });
+}
+
+}  // namespace ps
+#endif  // PS_KV_COMBINE_H_
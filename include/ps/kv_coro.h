@@ -0,0 +1,301 @@
+/**
+ *  Copyright (c) 2015 by Contributors
+ */
+#ifndef PS_KV_CORO_H_
+#define PS_KV_CORO_H_
+/**
+ * \brief optional coroutine interface of \ref KVWorker, which needs C++20
+ *
+ * A worker pipeline such as pull -> compute -> push can be written as a
+ * coroutine instead of nested callbacks and \ref KVWorker::Wait:
+ *
+ * \code
+ *   Task Train(KVWorker<float>* kv, SArray<Key> keys) {
+ *     SArray<float> weights, grads;
+ *     for (int i = 0; i < 100; ++i) {
+ *       co_await AsyncPull(kv, keys, &weights);
+ *       grads = ComputeGrad(weights);
+ *       co_await AsyncPush(kv, keys, grads);
+ *     }
+ *   }
+ *
+ *   Scheduler sched;
+ *   for (int i = 0; i < 1000; ++i) sched.Spawn(Train(&kv, keys[i]));
+ *   sched.Run();
+ * \endcode
+ *
+ * Every Push and Pull returns immediately, so a single thread can keep
+ * thousands of requests inflight. A task suspended on a request is resumed
+ * either by the thread running \ref Scheduler::Run, or directly on the
+ * receiving thread of the worker's customer if the scheduler is created with
+ * \a resume_inline. An inline task must not block, e.g. by \ref KVWorker::Wait,
+ * since it would then block the receiving thread.
+ */
+#if defined(__cplusplus) && __cplusplus >= 202002L && defined(__has_include)
+#if __has_include(<coroutine>)
+#include <atomic>
+#include <coroutine>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <mutex>
+#include <utility>
+#include "ps/kv_app.h"
+#define PS_HAS_COROUTINE 1
+namespace ps {
+
+class Scheduler;
+
+/**
+ * \brief a coroutine task
+ *
+ * A task starts lazily. It is either started by \ref Scheduler::Spawn, which
+ * then owns it, or by co_await-ing it within another task, which then resumes
+ * when the task finishes.
+ */
+class Task {
+ public:
+  struct promise_type {
+    /** \brief the scheduler the task is running on */
+    Scheduler* scheduler = nullptr;
+    /** \brief the task awaiting this one */
+    std::coroutine_handle<> continuation;
+    /** \brief whether the task is owned by the scheduler */
+    bool detached = false;
+    std::exception_ptr exception;
+
+    Task get_return_object() {
+      return Task(std::coroutine_handle<promise_type>::from_promise(*this));
+    }
+    std::suspend_always initial_suspend() noexcept { return {}; }
+    struct FinalAwaiter {
+      bool await_ready() noexcept { return false; }
+      std::coroutine_handle<> await_suspend(
+          std::coroutine_handle<promise_type> h) noexcept;
+      void await_resume() noexcept { }
+    };
+    FinalAwaiter final_suspend() noexcept { return {}; }
+    void return_void() { }
+    void unhandled_exception() { exception = std::current_exception(); }
+  };
+  using Handle = std::coroutine_handle<promise_type>;
+
+  Task() { }
+  explicit Task(Handle h) : handle_(h) { }
+  Task(Task&& other) noexcept : handle_(std::exchange(other.handle_, nullptr)) { }
+  Task& operator=(Task&& other) noexcept {
+    if (this != &other) {
+      if (handle_) handle_.destroy();
+      handle_ = std::exchange(other.handle_, nullptr);
+    }
+    return *this;
+  }
+  Task(const Task&) = delete;
+  Task& operator=(const Task&) = delete;
+  ~Task() { if (handle_) handle_.destroy(); }
+
+  /** \brief the awaiter of running a task within another one */
+  struct Awaiter {
+    Handle handle;
+    bool await_ready() noexcept { return !handle || handle.done(); }
+    Handle await_suspend(Handle caller) noexcept {
+      handle.promise().scheduler = caller.promise().scheduler;
+      handle.promise().continuation = caller;
+      return handle;
+    }
+    void await_resume() {
+      if (handle.promise().exception) {
+        std::rethrow_exception(handle.promise().exception);
+      }
+    }
+  };
+  /** \brief run this task within another one, and resume the latter when done */
+  Awaiter operator co_await() && noexcept { return Awaiter{handle_}; }
+
+ private:
+  friend class Scheduler;
+  /** \brief give up the ownership */
+  Handle Release() { return std::exchange(handle_, nullptr); }
+  Handle handle_;
+};
+
+/**
+ * \brief a single-threaded scheduler for tasks
+ */
+class Scheduler {
+ public:
+  /**
+   * \brief constructor
+   * \param resume_inline if true, a task waiting for a push or pull is resumed
+   * on the receiving thread once the request is finished. Otherwise it is
+   * resumed on the thread calling \ref Run
+   */
+  explicit Scheduler(bool resume_inline = false) : resume_inline_(resume_inline) { }
+  Scheduler(const Scheduler&) = delete;
+  Scheduler& operator=(const Scheduler&) = delete;
+
+  /** \brief start a task, which is owned by the scheduler from now on */
+  void Spawn(Task task) {
+    Task::Handle h = task.Release();
+    CHECK(h) << "spawn an empty task";
+    h.promise().scheduler = this;
+    h.promise().detached = true;
+    {
+      std::lock_guard<std::mutex> lk(mu_);
+      ++num_tasks_;
+    }
+    Post(h);
+  }
+
+  /** \brief queue a suspended coroutine to be resumed by \ref Run. threadsafe */
+  void Post(std::coroutine_handle<> h) {
+    std::lock_guard<std::mutex> lk(mu_);
+    ready_.push_back(h);
+    cond_.notify_one();
+  }
+
+  /** \brief resume a coroutine whose request is finished. threadsafe */
+  void Wake(std::coroutine_handle<> h) {
+    if (resume_inline_) {
+      h.resume();
+    } else {
+      Post(h);
+    }
+  }
+
+  /** \brief run the tasks until all spawned tasks are finished */
+  void Run() {
+    while (true) {
+      std::coroutine_handle<> h;
+      {
+        std::unique_lock<std::mutex> lk(mu_);
+        cond_.wait(lk, [this] { return !ready_.empty() || num_tasks_ == 0; });
+        if (ready_.empty()) return;
+        h = ready_.front();
+        ready_.pop_front();
+      }
+      h.resume();
+    }
+  }
+
+ private:
+  friend struct Task::promise_type::FinalAwaiter;
+  /** \brief called when a spawned task is finished */
+  void Finish() {
+    std::lock_guard<std::mutex> lk(mu_);
+    --num_tasks_;
+    cond_.notify_all();
+  }
+
+  bool resume_inline_;
+  std::mutex mu_;
+  std::condition_variable cond_;
+  std::deque<std::coroutine_handle<>> ready_;
+  int num_tasks_ = 0;
+};
+
+inline std::coroutine_handle<> Task::promise_type::FinalAwaiter::await_suspend(
+    std::coroutine_handle<promise_type> h) noexcept {
+  auto& p = h.promise();
+  if (p.continuation) return p.continuation;
+  if (p.detached) {
+    if (p.exception) std::rethrow_exception(p.exception);  // terminates
+    Scheduler* sched = p.scheduler;
+    h.destroy();
+    sched->Finish();
+  }
+  return std::noop_coroutine();
+}
+
+/**
+ * \brief the awaitable of a push or pull. Use \ref AsyncPush or \ref
+ * AsyncPull to create it
+ */
+template <typename Request>
+class KVAwaiter {
+ public:
+  explicit KVAwaiter(Request&& request) : request_(std::move(request)) { }
+  bool await_ready() const noexcept { return false; }
+  /**
+   * \brief issue the request, and return false to go on at once if it is
+   * finished already, such as a pull served by the cache. Resuming the task
+   * within the request instead would nest a frame per request
+   */
+  bool await_suspend(std::coroutine_handle<Task::promise_type> h) {
+    Scheduler* sched = h.promise().scheduler;
+    CHECK(sched) << "the task is not running on a scheduler";
+    // the callback and this function race to mark the state, the later one
+    // knows both are done and the task can go on
+    std::atomic<int>* state = &state_;
+    request_([sched, h, state]() {
+        if (state->exchange(kFinished) == kSuspended) sched->Wake(h);
+      });
+    // once suspended the task may be resumed, and the awaiter in its frame
+    // destroyed, by another thread, so do not touch it afterwards
+    return state_.exchange(kSuspended) != kFinished;
+  }
+  void await_resume() const noexcept { }
+
+ private:
+  enum { kIssued, kSuspended, kFinished };
+  Request request_;
+  std::atomic<int> state_{kIssued};
+};
+
+/**
+ * \brief push in a task, see \ref KVWorker::ZPush.
+ *
+ * \code
+ *   co_await AsyncPush(kv, keys, vals);
+ * \endcode
+ */
+template <typename Val>
+inline auto AsyncPush(KVWorker<Val>* kv,
+                      const SArray<Key>& keys,
+                      const SArray<Val>& vals,
+                      const SArray<int>& lens = {},
+                      int cmd = 0) {
+  auto request = [=](const typename KVWorker<Val>::Callback& cb) {
+    kv->ZPush(keys, vals, lens, cmd, cb);
+  };
+  return KVAwaiter<decltype(request)>(std::move(request));
+}
+
+/**
+ * \brief pull in a task, see \ref KVWorker::ZPull. \a vals (and \a lens) are
+ * filled when the co_await returns
+ */
+template <typename Val>
+inline auto AsyncPull(KVWorker<Val>* kv,
+                      const SArray<Key>& keys,
+                      SArray<Val>* vals,
+                      SArray<int>* lens = nullptr,
+                      int cmd = 0) {
+  auto request = [=](const typename KVWorker<Val>::Callback& cb) {
+    kv->ZPull(keys, vals, lens, cmd, cb);
+  };
+  return KVAwaiter<decltype(request)>(std::move(request));
+}
+
+/**
+ * \brief push and pull in one round trip in a task, see \ref
+ * KVWorker::ZPushPull. \a outs (and \a lens) are filled when the co_await
+ * returns
+ */
+template <typename Val>
+inline auto AsyncPushPull(KVWorker<Val>* kv,
+                          const SArray<Key>& keys,
+                          const SArray<Val>& vals,
+                          SArray<Val>* outs,
+                          SArray<int>* lens = nullptr,
+                          int cmd = 0) {
+  auto request = [=](const typename KVWorker<Val>::Callback& cb) {
+    kv->ZPushPull(keys, vals, outs, lens, cmd, cb);
+  };
+  return KVAwaiter<decltype(request)>(std::move(request));
+}
+
+}  // namespace ps
+#endif  // __has_include(<coroutine>)
+#endif  // C++20
+#endif  // PS_KV_CORO_H_
@@ -0,0 +1,261 @@
+/**
+ *  Copyright (c) 2015 by Contributors
+ * @file   kv_optimizer.h
+ * @brief  optimizers applying pushed gradients on servers
+ */
+#ifndef PS_KV_OPTIMIZER_H_
+#define PS_KV_OPTIMIZER_H_
+#include <string>
+#include <vector>
+#include "ps/kv_app.h"
+#include "ps/kv_store.h"
+#include "ps/range.h"
+namespace ps {
+
+/** \brief the hyper-parameters of an optimizer */
+struct OptimizerConfig {
+  /** \brief the optimizers */
+  enum Type { SGD, MOMENTUM, ADAGRAD, ADAM, ADAMW, FTRL, LAMB };
+  Type type = SGD;
+  /** \brief the learning rate, namely the alpha of FTRL */
+  float lr = 0.01f;
+  /** \brief the momentum of MOMENTUM */
+  float momentum = 0.9f;
+  /** \brief the decay rates of the moments of ADAM, ADAMW and LAMB */
+  float beta1 = 0.9f;
+  float beta2 = 0.999f;
+  /** \brief added to the denominators of ADAGRAD, ADAM, ADAMW and LAMB */
+  float eps = 1e-8f;
+  /**
+   * \brief the weight decay. It is added to the gradient by SGD, MOMENTUM,
+   * ADAGRAD and ADAM, and decoupled from it by ADAMW and LAMB. Not used by FTRL
+   */
+  float weight_decay = 0;
+  /** \brief the l1 and l2 regularization and the beta of FTRL */
+  float l1 = 0;
+  float l2 = 0;
+  float beta = 1;
+};
+
+/**
+ * \brief applies the updates of an optimizer to the values of keys.
+ *
+ * The states of an optimizer are kept next to the parameters, the values of a
+ * key with k parameters are [w, s_1, ..., s_m], where w are the parameters
+ * and every state s_i has length k, followed by a few scalars for some
+ * optimizers, see \ref ValLen. All values start at zero.
+ *
+ * The update kernels are written once on packs of floats, and compiled for
+ * SSE2 and for AVX2 and AVX-512 in separate files. The best instruction set
+ * supported by the CPU is picked at runtime, which can be limited by the
+ * environment variable PS_OPTIMIZER_ISA.
+ */
+class Optimizer {
+ public:
+  /** \brief the function updating the values v of a key by its gradients g */
+  using Kernel = void (*)(const OptimizerConfig& cfg, float* v, const float* g,
+                          size_t k);
+
+  /**
+   * \brief constructor
+   * \param cfg the optimizer
+   * \param isa the instruction set, "scalar", "avx2" or "avx512". Empty means
+   * the best supported one up to PS_OPTIMIZER_ISA
+   */
+  explicit Optimizer(const OptimizerConfig& cfg, const std::string& isa = "");
+
+  /** \brief whether instruction set \a isa is supported by both the CPU and the build */
+  static bool Supported(const std::string& isa);
+
+  /** \brief the number of values of a key with k parameters */
+  size_t ValLen(size_t k) const;
+
+  /** \brief the number of parameters of a key with val_len values */
+  size_t ParamLen(size_t val_len) const;
+
+  /**
+   * \brief update the values of a key
+   * \param v the ValLen(k) values of the key
+   * \param g the k gradients of the key
+   * \param k the number of parameters
+   */
+  void Update(float* v, const float* g, size_t k) const { kernel_(cfg_, v, g, k); }
+
+  /** \brief the instruction set used */
+  const std::string& isa() const { return isa_; }
+
+  /** \brief the optimizer */
+  const OptimizerConfig& config() const { return cfg_; }
+
+ private:
+  OptimizerConfig cfg_;
+  std::string isa_;
+  Kernel kernel_;
+};
+
+/**
+ * \brief a handle applying pushed gradients by optimizers, and responding to
+ * pulls with the parameters.
+ *
+ * Sample usage, Adam for all keys but FTRL for the keys in range
+ * \code
+ *   OptimizerConfig adam, ftrl;
+ *   adam.type = OptimizerConfig::ADAM;
+ *   ftrl.type = OptimizerConfig::FTRL;
+ *   KVOptimizerHandle handle(adam);
+ *   handle.SetOptimizer(range, ftrl);
+ *   server->set_request_handle(handle);
+ * \endcode
+ * An app has its own server, so an optimizer per app is a handle per server.
+ * The parameters and states of every optimizer are in a \ref KVStore. All keys
+ * of an optimizer have the same number of parameters, set by the first push.
+ * Pulls of keys never pushed get zeros.
+ */
+class KVOptimizerHandle {
+ public:
+  /** \brief constructor, \a cfg is the optimizer of keys in no range */
+  explicit KVOptimizerHandle(const OptimizerConfig& cfg) {
+    rules_.emplace_back(Range(0, kMaxKey), cfg);
+  }
+
+  /**
+   * \brief use optimizer \a cfg for the keys in \a range. Ranges must not
+   * overlap, and must be set before the handle is used
+   */
+  void SetOptimizer(const Range& range, const OptimizerConfig& cfg) {
+    rules_.emplace(rules_.end() - 1, range, cfg);
+  }
+
+  void operator()(const KVMeta& req_meta, const KVPairs<float>& req_data,
+                  KVServer<float>* server) {
+    KVPairs<float> res;
+    if (req_meta.push) Push(req_data);
+    if (!req_meta.push || req_meta.pull) Pull(req_data.keys, &res);
+    server->Response(req_meta, res);
+  }
+
+  /** \brief apply the pushed gradients */
+  void Push(const KVPairs<float>& data) {
+    size_t n = data.keys.size();
+    if (!n) return;
+    CHECK(data.lens.empty()) << "values must have a fixed length";
+    size_t k = data.vals.size() / n;
+    CHECK_EQ(k * n, data.vals.size());
+    std::vector<Part> parts(rules_.size());
+    Split(data.keys, data.vals, k, &parts);
+    for (size_t i = 0; i < parts.size(); ++i) {
+      const Part& part = parts[i];
+      if (!part.num) continue;
+      Rule& rule = rules_[i];
+      if (!rule.store) {
+        rule.k = k;
+        rule.store = std::make_shared<KVStore<float>>(rule.opt.ValLen(k));
+      }
+      CHECK_EQ(k, rule.k) << "unmatched value length";
+      const Optimizer& opt = rule.opt;
+      const float* grads = part.grads;
+      rule.store->Update(part.keys, part.num, [&opt, grads, k](size_t j, float* v) {
+          opt.Update(v, grads + j * k, k);
+        });
+    }
+  }
+
+  /** \brief the parameters of keys, a zero per key never pushed */
+  void Pull(const SArray<Key>& keys, KVPairs<float>* res) {
+    size_t n = keys.size();
+    std::vector<Part> parts(rules_.size());
+    Split(keys, SArray<float>(), 0, &parts);
+    size_t len = 0;
+    for (size_t i = 0; i < parts.size(); ++i) {
+      if (!parts[i].num || !rules_[i].store) continue;
+      CHECK(!len || len == rules_[i].k) << "unmatched value length";
+      len = rules_[i].k;
+    }
+    if (!len) len = 1;
+    res->keys = keys;
+    res->vals.resize(n * len, 0);
+    for (size_t i = 0; i < parts.size(); ++i) {
+      const Part& part = parts[i];
+      if (!part.num || !rules_[i].store) continue;
+      if (part.pos.empty()) {
+        rules_[i].store->Read(part.keys, part.num, res->vals.data(), 0, len);
+        continue;
+      }
+      std::vector<float> vals(part.num * len);
+      rules_[i].store->Read(part.keys, part.num, vals.data(), 0, len);
+      for (size_t j = 0; j < part.num; ++j) {
+        memcpy(res->vals.data() + part.pos[j] * len, vals.data() + j * len,
+               len * sizeof(float));
+      }
+    }
+  }
+
+ private:
+  struct Rule {
+    Rule(const Range& range, const OptimizerConfig& cfg) : range(range), opt(cfg) { }
+    Range range;
+    Optimizer opt;
+    /** \brief the number of parameters per key */
+    size_t k = 0;
+    std::shared_ptr<KVStore<float>> store;
+  };
+
+  /** \brief the keys of a request of a rule */
+  struct Part {
+    size_t num = 0;
+    const Key* keys = nullptr;
+    const float* grads = nullptr;
+    /** \brief the positions of the keys in the request, empty if all */
+    std::vector<size_t> pos;
+    std::vector<Key> key_buf;
+    std::vector<float> grad_buf;
+  };
+
+  /** \brief split keys by rules, with k gradients per key if a push */
+  void Split(const SArray<Key>& keys, const SArray<float>& grads, size_t k,
+             std::vector<Part>* parts) const {
+    size_t n = keys.size();
+    size_t last = rules_.size() - 1;
+    size_t r = last;
+    if (last) {
+      for (size_t j = 0; j < n; ++j) (*parts)[RuleOf(keys[j])].pos.push_back(j);
+      for (size_t i = 0; i <= last; ++i) {
+        if ((*parts)[i].pos.size() == n) r = i;
+      }
+    }
+    if (!last || (n && (*parts)[r].pos.size() == n)) {
+      // the common case, all keys have the same rule
+      Part& part = (*parts)[r];
+      part.num = n;
+      part.keys = keys.data();
+      part.grads = grads.data();
+      part.pos.clear();
+      return;
+    }
+    for (auto& part : *parts) {
+      part.num = part.pos.size();
+      part.key_buf.resize(part.num);
+      part.grad_buf.resize(part.num * k);
+      for (size_t j = 0; j < part.num; ++j) {
+        part.key_buf[j] = keys[part.pos[j]];
+        memcpy(part.grad_buf.data() + j * k, grads.data() + part.pos[j] * k,
+               k * sizeof(float));
+      }
+      part.keys = part.key_buf.data();
+      part.grads = part.grad_buf.data();
+    }
+  }
+
+  /** \brief the rule of a key, the last one takes the keys in no range */
+  size_t RuleOf(Key key) const {
+    for (size_t i = 0; i + 1 < rules_.size(); ++i) {
+      if (key >= rules_[i].range.begin() && key < rules_[i].range.end()) return i;
+    }
+    return rules_.size() - 1;
+  }
+
+  std::vector<Rule> rules_;
+};
+
+}  // namespace ps
+#endif  // PS_KV_OPTIMIZER_H_
@@ -0,0 +1,688 @@
+/**
+ *  Copyright (c) 2015 by Contributors
+ * @file   kv_store.h
+ * @brief  a hash table of key-value pairs for servers
+ */
+#ifndef PS_KV_STORE_H_
+#define PS_KV_STORE_H_
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <type_traits>
+#include <vector>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#include "ps/kv_app.h"
+#include "ps/range.h"
+#include "ps/internal/hash_ring.h"
+namespace ps {
+
+/**
+ * \brief a hash table from keys to values of a fixed length, for the request
+ * handles of servers.
+ *
+ * The table is open addressing in the style of Swiss tables: the slots are in
+ * groups of 16, and every slot has a control byte which is either empty or 7
+ * bits of the hash of its key. A lookup compares the control bytes of a whole
+ * group at once by SSE2, and reads the keys only for the matching bytes. A slot
+ * holds a key and the index of its values, while the values are in slabs of
+ * \ref kSlabKeys keys which never move, so growing the table moves only slots.
+ * A batch of keys is handled in two passes, first locating all keys and then
+ * touching all values, and both passes prefetch a few keys ahead, so that the
+ * cache misses of nearby keys overlap.
+ *
+ * There is at most one writer at a time, such as the request handle, but any
+ * number of threads can \ref Read concurrently without locks. Readers retry if
+ * a seqlock tells a writer changed the keys or values they read. Tables
+ * replaced by a larger one are kept until the store is destroyed, so a reader
+ * never touches freed memory, which costs at most the size of the current
+ * table. Keys are never removed.
+ *
+ * Snapshots for checkpoints are copied out the same way by \ref Snapshot and
+ * \ref Export, without pausing the writer. Every value slab keeps a bit per
+ * key updated since the last snapshot, so a snapshot can take only those.
+ */
+template <typename Val>
+class KVStore {
+ public:
+  /** \brief the number of keys of a value slab */
+  static const size_t kSlabKeys = 4096;
+
+  /** \brief constructor, \a val_len is the value length of every key */
+  explicit KVStore(size_t val_len)
+      : k_(val_len), slabs_(new std::atomic<Slab*>[kMaxSlabs]) {
+    CHECK_GT(val_len, 0);
+    for (size_t i = 0; i < kMaxSlabs; ++i) slabs_[i].store(nullptr);
+    Table* t = new Table(kGroupSize * 4);
+    tables_.emplace_back(t);
+    table_.store(t);
+  }
+
+  ~KVStore() {
+    for (size_t i = 0; i < kMaxSlabs; ++i) delete slabs_[i].load();
+  }
+
+  KVStore(const KVStore&) = delete;
+  KVStore& operator=(const KVStore&) = delete;
+
+  /** \brief the value length */
+  size_t val_len() const { return k_; }
+
+  /** \brief the number of keys. threadsafe */
+  size_t size() const { return size_.load(std::memory_order_relaxed); }
+
+  /**
+   * \brief apply fn(j, v) to the values v of keys[j] for every j, where a
+   * missing key is inserted with zero values first. Writer only
+   */
+  template <typename Fn>
+  void Update(const Key* keys, size_t n, const Fn& fn) {
+    // announce the snapshot epoch of this batch, see Snapshot
+    uint32_t e = epoch_.load();
+    while (true) {
+      active_.store(e);
+      uint32_t now = epoch_.load();
+      if (now == e) break;
+      e = now;
+    }
+    size_t d = (e & 1) * kDirtyWords;
+    std::vector<uint32_t> index(n);
+    Insert(keys, n, index.data());
+    for (size_t j = 0; j < n; ++j) {
+      if (j + kPrefetch < n) Prefetch(ValPtr(index[j + kPrefetch]));
+      Slab* slab = slabs_[index[j] / kSlabKeys].load(std::memory_order_relaxed);
+      uint32_t seq = slab->seq.load(std::memory_order_relaxed);
+      slab->seq.store(seq + 1, std::memory_order_relaxed);
+      std::atomic_thread_fence(std::memory_order_release);
+      size_t i = index[j] % kSlabKeys;
+      fn(j, slab->vals.get() + i * k_);
+      slab->seq.store(seq + 2, std::memory_order_release);
+      std::atomic<uint64_t>& w = slab->dirty[d + i / 64];
+      w.store(w.load(std::memory_order_relaxed) | (1ULL << (i % 64)),
+              std::memory_order_relaxed);
+    }
+    active_.store(kIdle, std::memory_order_release);
+  }
+
+  /** \brief add vals[j*k, (j+1)*k) into the values of keys[j]. Writer only */
+  void Add(const Key* keys, size_t n, const Val* vals) {
+    size_t k = k_;
+    Update(keys, n, [vals, k](size_t j, Val* v) {
+        const Val* src = vals + j * k;
+        for (size_t t = 0; t < k; ++t) v[t] += src[t];
+      });
+  }
+
+  /**
+   * \brief copy the values of keys[j] into vals[j*k, (j+1)*k), zeros if the
+   * key is missing. threadsafe, also against a concurrent writer
+   *
+   * with \a len > 0 only the values [begin, begin+len) of every key are
+   * copied, into vals[j*len, (j+1)*len)
+   */
+  void Read(const Key* keys, size_t n, Val* vals, size_t begin = 0,
+            size_t len = 0) const {
+    CHECK_LE(begin, k_);
+    if (!len) len = k_ - begin;
+    CHECK_LE(len, k_ - begin);
+    std::vector<uint32_t> index(n);
+    // locate all keys at once, or one by one if keys are inserted meanwhile
+    uint32_t seq = table_seq_.load(std::memory_order_acquire);
+    bool done = false;
+    if (!(seq & 1)) {
+      FindAll(table_.load(std::memory_order_acquire), keys, n, index.data());
+      std::atomic_thread_fence(std::memory_order_acquire);
+      done = table_seq_.load(std::memory_order_relaxed) == seq;
+    }
+    for (size_t j = 0; !done && j < n; ++j) index[j] = Locate(keys[j]);
+
+    for (size_t j = 0; j < n; ++j) {
+      if (j + kPrefetch < n && index[j + kPrefetch] != kMissing) {
+        Prefetch(ValPtr(index[j + kPrefetch]));
+      }
+      Val* dst = vals + j * len;
+      if (index[j] == kMissing) {
+        memset(dst, 0, len * sizeof(Val));
+        continue;
+      }
+      const Slab* slab = slabs_[index[j] / kSlabKeys].load(std::memory_order_acquire);
+      Copy(slab, (index[j] % kSlabKeys) * k_ + begin, len, dst);
+    }
+  }
+
+  /**
+   * \brief start a snapshot, set \a index to the value indices of all keys, or
+   * with \a delta only of the keys updated since the last snapshot, and track
+   * updates anew. \a index can be nullptr to only reset the tracking.
+   * threadsafe, also against a concurrent writer, which it waits for to
+   * finish its current batch at most
+   */
+  void Snapshot(bool delta, std::vector<uint32_t>* index) {
+    std::lock_guard<std::mutex> lk(snapshot_mu_);
+    // switch the writer to the other dirty bits, once its current batch is
+    // done the bits of epoch e are only ours
+    uint32_t e = epoch_.fetch_add(1);
+    while (active_.load() == e) std::this_thread::yield();
+    size_t d = (e & 1) * kDirtyWords;
+    size_t n = size_.load(std::memory_order_acquire);
+    if (index) index->clear();
+    for (size_t base = 0; base < n; base += 64) {
+      Slab* slab = slabs_[base / kSlabKeys].load(std::memory_order_acquire);
+      uint64_t mask = base + 64 <= n ? ~0ULL : (1ULL << (n - base)) - 1;
+      uint64_t bits = slab->dirty[d + base % kSlabKeys / 64].exchange(
+          0, std::memory_order_relaxed);
+      if (!index) continue;
+      if (!delta) bits = mask;
+      for (; bits; bits &= bits - 1) {
+        index->push_back(static_cast<uint32_t>(base + LowestBit(bits)));
+      }
+    }
+  }
+
+  /**
+   * \brief copy out the keys of value indices given by \ref Snapshot, and
+   * their values into vals[j*k, (j+1)*k). threadsafe, also against a
+   * concurrent writer
+   */
+  void Export(const uint32_t* index, size_t n, Key* keys, Val* vals) const {
+    for (size_t j = 0; j < n; ++j) {
+      const Slab* slab = slabs_[index[j] / kSlabKeys].load(std::memory_order_acquire);
+      keys[j] = slab->keys[index[j] % kSlabKeys];
+      Copy(slab, (index[j] % kSlabKeys) * k_, k_, vals + j * k_);
+    }
+  }
+
+  /**
+   * \brief return the values of a key, nullptr if missing. Writer only, and
+   * changes through it are not seen atomically by \ref Read, nor tracked
+   * by \ref Snapshot
+   */
+  Val* Find(Key key) {
+    uint32_t i = table_.load(std::memory_order_relaxed)->Find(key, Hash(key));
+    return i == kMissing ? nullptr : ValPtr(i);
+  }
+
+ private:
+  /** \brief the slots of a group, one SSE2 register of control bytes */
+  static const size_t kGroupSize = 16;
+  /** \brief the control byte of an empty slot, others are in [0, 127] */
+  static const int8_t kEmpty = -128;
+  /** \brief how many keys ahead the batched methods prefetch */
+  static const size_t kPrefetch = 8;
+  /** \brief the maximal number of value slabs, so 2^28 keys */
+  static const size_t kMaxSlabs = 1 << 16;
+  /** \brief the value index of a missing key */
+  static const uint32_t kMissing = 0xffffffff;
+  /** \brief the words of the dirty bits of a slab */
+  static const size_t kDirtyWords = kSlabKeys / 64;
+  /** \brief \ref active_ while not updating */
+  static const uint32_t kIdle = 0xffffffff;
+
+  static uint64_t Hash(Key key) { return SplitMix64(key); }
+
+  static void Prefetch(const void* p) {
+#if defined(__GNUC__)
+    __builtin_prefetch(p);
+#endif
+  }
+
+  /** \brief the bit mask of the bytes of a group equal to c */
+  static uint32_t Match(const int8_t* group, int8_t c) {
+#if defined(__SSE2__)
+    __m128i g = _mm_loadu_si128(reinterpret_cast<const __m128i*>(group));
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(g, _mm_set1_epi8(c)));
+#else
+    uint32_t mask = 0;
+    for (size_t i = 0; i < kGroupSize; ++i) {
+      mask |= static_cast<uint32_t>(group[i] == c) << i;
+    }
+    return mask;
+#endif
+  }
+
+  static size_t LowestBit(uint64_t mask) {
+#if defined(__GNUC__)
+    return __builtin_ctzll(mask);
+#else
+    size_t i = 0;
+    while (!(mask & 1)) { mask >>= 1; ++i; }
+    return i;
+#endif
+  }
+
+  /** \brief a key and the index of its values */
+  struct Slot {
+    Key key;
+    uint32_t index;
+  };
+
+  struct Table {
+    explicit Table(size_t cap)
+        : capacity(cap), ctrl(new int8_t[cap]), slots(new Slot[cap]) {
+      memset(ctrl.get(), kEmpty, cap);
+    }
+
+    /**
+     * \brief return the slot of key with found = true, or the empty slot to
+     * insert it with found = false. It probes group by group with triangular
+     * steps, which visit all groups since their number is a power of 2
+     */
+    size_t Probe(Key key, uint64_t hash, bool* found) const {
+      size_t mask = capacity / kGroupSize - 1;
+      size_t g = Start(hash) / kGroupSize;
+      int8_t h2 = static_cast<int8_t>(hash & 0x7f);
+      for (size_t step = 1; ; ++step) {
+        const int8_t* group = ctrl.get() + g * kGroupSize;
+        for (uint32_t m = Match(group, h2); m; m &= m - 1) {
+          size_t slot = g * kGroupSize + LowestBit(m);
+          if (slots[slot].key == key) {
+            *found = true;
+            return slot;
+          }
+        }
+        uint32_t empty = Match(group, kEmpty);
+        if (empty) {
+          *found = false;
+          return g * kGroupSize + LowestBit(empty);
+        }
+        g = (g + step) & mask;
+      }
+    }
+
+    /** \brief the value index of key, or kMissing */
+    uint32_t Find(Key key, uint64_t hash) const {
+      bool found;
+      size_t slot = Probe(key, hash, &found);
+      if (!found) return kMissing;
+      return slots[slot].index;
+    }
+
+    /** \brief the first slot of the first group probed for a hash */
+    size_t Start(uint64_t hash) const {
+      return ((hash >> 7) & (capacity / kGroupSize - 1)) * kGroupSize;
+    }
+
+    size_t capacity;
+    std::unique_ptr<int8_t[]> ctrl;
+    std::unique_ptr<Slot[]> slots;
+  };
+
+  struct Slab {
+    explicit Slab(size_t k)
+        : seq(0), vals(new Val[kSlabKeys * k]()), keys(new Key[kSlabKeys]),
+          dirty(new std::atomic<uint64_t>[2 * kDirtyWords]) {
+      for (size_t i = 0; i < 2 * kDirtyWords; ++i) dirty[i].store(0);
+    }
+    /** \brief the seqlock of the values, odd while being written */
+    std::atomic<uint32_t> seq;
+    std::unique_ptr<Val[]> vals;
+    /** \brief the key of every value index, for snapshots */
+    std::unique_ptr<Key[]> keys;
+    /**
+     * \brief a bit per key updated since the last \ref Snapshot, in two
+     * halves which the writer uses by turns of snapshots
+     */
+    std::unique_ptr<std::atomic<uint64_t>[]> dirty;
+  };
+
+  /** \brief copy len values of a slab from offset, retrying while written */
+  static void Copy(const Slab* slab, size_t offset, size_t len, Val* dst) {
+    const Val* src = slab->vals.get() + offset;
+    while (true) {
+      uint32_t v = slab->seq.load(std::memory_order_acquire);
+      if (v & 1) continue;
+      memcpy(dst, src, len * sizeof(Val));
+      std::atomic_thread_fence(std::memory_order_acquire);
+      if (slab->seq.load(std::memory_order_relaxed) == v) break;
+    }
+  }
+
+  Val* ValPtr(uint32_t i) const {
+    return slabs_[i / kSlabKeys].load(std::memory_order_acquire)->vals.get() +
+        (i % kSlabKeys) * k_;
+  }
+
+  /** \brief set index[j] to the value index of keys[j], or kMissing */
+  static void FindAll(const Table* t, const Key* keys, size_t n, uint32_t* index) {
+    for (size_t j = 0; j < n; ++j) {
+      if (j + kPrefetch < n) {
+        size_t s = t->Start(Hash(keys[j + kPrefetch]));
+        Prefetch(t->ctrl.get() + s);
+        Prefetch(t->slots.get() + s);
+      }
+      index[j] = t->Find(keys[j], Hash(keys[j]));
+    }
+  }
+
+  /** \brief set index[j] to the value index of keys[j], inserting missing keys */
+  void Insert(const Key* keys, size_t n, uint32_t* index) {
+    Table* t = table_.load(std::memory_order_relaxed);
+    FindAll(t, keys, n, index);
+    bool writing = false;
+    for (size_t j = 0; j < n; ++j) {
+      if (index[j] != kMissing) continue;
+      uint64_t hash = Hash(keys[j]);
+      bool found;
+      size_t slot = t->Probe(keys[j], hash, &found);
+      if (found) {
+        // a duplicate of a key inserted just now
+        index[j] = t->slots[slot].index;
+        continue;
+      }
+      if (!writing) {
+        // tell the readers that the keys are changing
+        table_seq_.store(table_seq_.load(std::memory_order_relaxed) + 1,
+                         std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        writing = true;
+      }
+      size_t i = size_.load(std::memory_order_relaxed);
+      if ((i + 1) * 8 > t->capacity * 7) {
+        t = Grow(t);
+        slot = t->Probe(keys[j], hash, &found);
+      }
+      if (i % kSlabKeys == 0) {
+        CHECK(i / kSlabKeys < kMaxSlabs) << "too many keys";
+        slabs_[i / kSlabKeys].store(new Slab(k_), std::memory_order_release);
+      }
+      t->slots[slot].key = keys[j];
+      t->slots[slot].index = static_cast<uint32_t>(i);
+      t->ctrl[slot] = static_cast<int8_t>(hash & 0x7f);
+      slabs_[i / kSlabKeys].load(std::memory_order_relaxed)->keys[i % kSlabKeys] = keys[j];
+      // publish the key to \ref Snapshot
+      size_.store(i + 1, std::memory_order_release);
+      index[j] = static_cast<uint32_t>(i);
+    }
+    if (writing) {
+      table_seq_.store(table_seq_.load(std::memory_order_relaxed) + 1,
+                       std::memory_order_release);
+    }
+  }
+
+  /** \brief move all keys into a table twice as large, and publish it */
+  Table* Grow(const Table* t) {
+    Table* nt = new Table(t->capacity * 2);
+    for (size_t s = 0; s < t->capacity; ++s) {
+      if (t->ctrl[s] == kEmpty) continue;
+      bool found;
+      size_t slot = nt->Probe(t->slots[s].key, Hash(t->slots[s].key), &found);
+      nt->slots[slot] = t->slots[s];
+      nt->ctrl[slot] = t->ctrl[s];
+    }
+    tables_.emplace_back(nt);
+    table_.store(nt, std::memory_order_release);
+    return nt;
+  }
+
+  /** \brief the value index of a key, retrying while keys are inserted */
+  uint32_t Locate(Key key) const {
+    uint64_t hash = Hash(key);
+    while (true) {
+      uint32_t seq = table_seq_.load(std::memory_order_acquire);
+      if (seq & 1) {
+        std::this_thread::yield();
+        continue;
+      }
+      uint32_t i = table_.load(std::memory_order_acquire)->Find(key, hash);
+      std::atomic_thread_fence(std::memory_order_acquire);
+      if (table_seq_.load(std::memory_order_relaxed) == seq) return i;
+    }
+  }
+
+  size_t k_;
+  std::atomic<size_t> size_{0};
+  /** \brief the seqlock of the keys, odd while keys are being inserted */
+  std::atomic<uint32_t> table_seq_{0};
+  /** \brief the current table */
+  std::atomic<Table*> table_;
+  /** \brief all tables ever used, the last is the current one */
+  std::vector<std::unique_ptr<Table>> tables_;
+  std::unique_ptr<std::atomic<Slab*>[]> slabs_;
+  /** \brief the number of snapshots, whose parity tells the dirty bits used */
+  std::atomic<uint32_t> epoch_{0};
+  /** \brief the epoch of the batch being updated, or kIdle */
+  std::atomic<uint32_t> active_{kIdle};
+  std::mutex snapshot_mu_;
+};
+
+/**
+ * \brief a store of values of a fixed length for a contiguous key range, which
+ * are kept in one flat array indexed by key - begin, so no hashing at all.
+ *
+ * It fits dense models, which use almost every key of the range. A sorted
+ * request is handled run by run, a run being keys increasing by one, so
+ * pushes and pulls become plain loops over contiguous values which the
+ * compiler vectorizes. Keys outside the range go to a \ref KVStore.
+ *
+ * The array is 64-byte aligned and zeroed lazily by the OS, so the pages of
+ * keys never touched cost no memory. Unlike \ref KVStore it is not threadsafe,
+ * reads must not run concurrently with a writer.
+ */
+template <typename Val>
+class KVDenseStore {
+ public:
+  /**
+   * \brief constructor
+   * \param range the keys kept in the flat array
+   * \param val_len the value length of every key
+   */
+  KVDenseStore(const Range& range, size_t val_len)
+      : begin_(range.begin()), size_(range.size()), k_(val_len) {
+    CHECK_GT(val_len, 0);
+    CHECK_LT(size_, (uint64_t)-1 / (val_len * sizeof(Val))) << "too large range";
+    raw_ = calloc(size_ * k_ * sizeof(Val) + kAlign, 1);
+    CHECK(raw_) << "failed to allocate " << size_ << " keys";
+    uintptr_t p = reinterpret_cast<uintptr_t>(raw_);
+    vals_ = reinterpret_cast<Val*>((p + kAlign - 1) / kAlign * kAlign);
+  }
+
+  ~KVDenseStore() { free(raw_); }
+
+  KVDenseStore(const KVDenseStore&) = delete;
+  KVDenseStore& operator=(const KVDenseStore&) = delete;
+
+  /** \brief the value length */
+  size_t val_len() const { return k_; }
+
+  /** \brief the values of the keys in the range, key i is at [(i - begin) * k, ...) */
+  Val* data() { return vals_; }
+
+  /**
+   * \brief apply fn(j, v) to the values v of keys[j] for every j, the same
+   * as \ref KVStore::Update
+   */
+  template <typename Fn>
+  void Update(const Key* keys, size_t n, const Fn& fn) {
+    std::vector<size_t> outside;
+    for (size_t j = 0; j < n; ++j) {
+      if (keys[j] - begin_ < size_) {
+        fn(j, vals_ + (keys[j] - begin_) * k_);
+      } else {
+        outside.push_back(j);
+      }
+    }
+    if (outside.empty()) return;
+    std::vector<Key> okeys(outside.size());
+    for (size_t i = 0; i < outside.size(); ++i) okeys[i] = keys[outside[i]];
+    Outside()->Update(okeys.data(), okeys.size(), [&fn, &outside](size_t i, Val* v) {
+        fn(outside[i], v);
+      });
+  }
+
+  /** \brief add vals[j*k, (j+1)*k) into the values of keys[j] */
+  void Add(const Key* keys, size_t n, const Val* vals) {
+    size_t k = k_;
+    ForEachRun(keys, n, vals, [k](size_t len, Val* a, const Val* v) {
+        for (size_t t = 0; t < len * k; ++t) a[t] += v[t];
+      }, [this](const Key* keys, size_t n, const Val* vals) {
+        Outside()->Add(keys, n, vals);
+      });
+  }
+
+  /** \brief copy the values of keys[j] into vals[j*k, (j+1)*k) */
+  void Read(const Key* keys, size_t n, Val* vals) {
+    size_t k = k_;
+    ForEachRun(keys, n, vals, [k](size_t len, const Val* a, Val* v) {
+        memcpy(v, a, len * k * sizeof(Val));
+      }, [this](const Key* keys, size_t n, Val* vals) {
+        if (outside_) {
+          outside_->Read(keys, n, vals);
+        } else {
+          memset(vals, 0, n * k_ * sizeof(Val));
+        }
+      });
+  }
+
+ private:
+  static const size_t kAlign = 64;
+
+  KVStore<Val>* Outside() {
+    if (!outside_) outside_.reset(new KVStore<Val>(k_));
+    return outside_.get();
+  }
+
+  /**
+   * \brief call run(len, a, v) for every run of len keys in the range, where
+   * a points to their values in the array and v to theirs in vals, and then
+   * other(keys, n, v) once with the keys outside and their values in \a vals
+   * gathered. Values changed by \a other are scattered back
+   */
+  template <typename V, typename Run, typename Other>
+  void ForEachRun(const Key* keys, size_t n, V* vals, const Run& run,
+                  const Other& other) {
+    std::vector<size_t> outside;
+    for (size_t j = 0; j < n; ) {
+      uint64_t i = keys[j] - begin_;
+      if (i >= size_) {
+        outside.push_back(j++);
+        continue;
+      }
+      size_t len = 1;
+      while (j + len < n && keys[j + len] == keys[j] + len && i + len < size_) ++len;
+      run(len, vals_ + i * k_, vals + j * k_);
+      j += len;
+    }
+    if (outside.empty()) return;
+    size_t m = outside.size();
+    std::vector<Key> okeys(m);
+    std::vector<typename std::remove_const<V>::type> ovals(m * k_);
+    for (size_t i = 0; i < m; ++i) {
+      okeys[i] = keys[outside[i]];
+      memcpy(ovals.data() + i * k_, vals + outside[i] * k_, k_ * sizeof(Val));
+    }
+    other(okeys.data(), m, ovals.data());
+    if (std::is_const<V>::value) return;
+    for (size_t i = 0; i < m; ++i) {
+      memcpy(const_cast<Val*>(vals) + outside[i] * k_, ovals.data() + i * k_,
+             k_ * sizeof(Val));
+    }
+  }
+
+  Key begin_;
+  uint64_t size_;
+  size_t k_;
+  /** \brief the allocated memory, and the aligned array in it */
+  void* raw_;
+  Val* vals_;
+  /** \brief the keys outside the range */
+  std::unique_ptr<KVStore<Val>> outside_;
+};
+
+/**
+ * \brief a handle adding pushed kv into a \ref KVStore, a faster replacement
+ * of \ref KVServerDefaultHandle which also allows more than one value per key.
+ *
+ * All keys have the same value length, set by the first push. Pulls of keys
+ * never pushed get zeros. The store is created by the first request, so every
+ * shard of a server with PS_SERVER_THREADS gets its own copy. Other threads
+ * can read the store by \ref KVStore::Read while requests are handled.
+ */
+template <typename Val>
+struct KVStoreHandle {
+  void operator()(
+      const KVMeta& req_meta, const KVPairs<Val>& req_data, KVServer<Val>* server) {
+    KVPairs<Val> res;
+    if (req_meta.push) Push(req_data);
+    if (!req_meta.push || req_meta.pull) Pull(req_data.keys, &res);
+    server->Response(req_meta, res);
+  }
+  /** \brief add the pushed values */
+  void Push(const KVPairs<Val>& data) {
+    size_t n = data.keys.size();
+    if (!n) return;
+    CHECK(data.lens.empty()) << "values must have a fixed length";
+    size_t k = data.vals.size() / n;
+    CHECK_EQ(k * n, data.vals.size());
+    if (!store) store = std::make_shared<KVStore<Val>>(k);
+    CHECK_EQ(k, store->val_len()) << "unmatched value length";
+    store->Add(data.keys.data(), n, data.vals.data());
+  }
+  /** \brief the response of a pull of keys */
+  void Pull(const SArray<Key>& keys, KVPairs<Val>* res) {
+    size_t n = keys.size();
+    res->keys = keys;
+    if (store) {
+      res->vals.resize(n * store->val_len());
+      store->Read(keys.data(), n, res->vals.data());
+    } else {
+      res->vals.resize(n, 0);
+    }
+  }
+  std::shared_ptr<KVStore<Val>> store;
+};
+
+/**
+ * \brief a handle adding pushed kv into a \ref KVDenseStore, for dense
+ * models. Such as the range of a server
+ * \code
+ *   Range range = Postoffice::Get()->GetServerKeyRanges()[MyRank()];
+ *   server->set_request_handle(KVDenseHandle<float>(
+ *       Range(range.begin(), range.begin() + num_keys_per_server)));
+ * \endcode
+ * Otherwise the same as \ref KVStoreHandle. With PS_SERVER_THREADS every
+ * shard allocates the whole range, but it touches only the pages of its own
+ * keys.
+ */
+template <typename Val>
+struct KVDenseHandle {
+  explicit KVDenseHandle(const Range& range) : range(range) { }
+  void operator()(
+      const KVMeta& req_meta, const KVPairs<Val>& req_data, KVServer<Val>* server) {
+    KVPairs<Val> res;
+    if (req_meta.push) Push(req_data);
+    if (!req_meta.push || req_meta.pull) Pull(req_data.keys, &res);
+    server->Response(req_meta, res);
+  }
+  /** \brief add the pushed values */
+  void Push(const KVPairs<Val>& data) {
+    size_t n = data.keys.size();
+    if (!n) return;
+    CHECK(data.lens.empty()) << "values must have a fixed length";
+    size_t k = data.vals.size() / n;
+    CHECK_EQ(k * n, data.vals.size());
+    if (!store) store = std::make_shared<KVDenseStore<Val>>(range, k);
+    CHECK_EQ(k, store->val_len()) << "unmatched value length";
+    store->Add(data.keys.data(), n, data.vals.data());
+  }
+  /** \brief the response of a pull of keys */
+  void Pull(const SArray<Key>& keys, KVPairs<Val>* res) {
+    size_t n = keys.size();
+    res->keys = keys;
+    if (store) {
+      res->vals.resize(n * store->val_len());
+      store->Read(keys.data(), n, res->vals.data());
+    } else {
+      res->vals.resize(n, 0);
+    }
+  }
+  Range range;
+  std::shared_ptr<KVDenseStore<Val>> store;
+};
+
+}  // namespace ps
+#endif  // PS_KV_STORE_H_
@@ -0,0 +1,352 @@
+/**
+ *  Copyright (c) 2015 by Contributors
+ * @file   kv_sync.h
+ * @brief  synchronous (BSP) and bounded staleness (SSP) consistency on servers
+ */
+#ifndef PS_KV_SYNC_H_
+#define PS_KV_SYNC_H_
+#include <string.h>
+#include <algorithm>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <tuple>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include "ps/kv_app.h"
+#include "ps/kv_store.h"
+#include "ps/internal/postoffice.h"
+namespace ps {
+
+/**
+ * \brief a handle for synchronous (BSP) training. The pushes of all workers in
+ * a round are summed in a merge buffer, applied to the wrapped handle once,
+ * and only then responded.
+ *
+ * Sample usage, summing into a \ref KVStoreHandle, or applying an optimizer to
+ * the summed gradients
+ * \code
+ *   server->set_request_handle(KVSyncHandle<float>());
+ *   server->set_request_handle(KVSyncHandle<float, KVOptimizerHandle>(
+ *       KVOptimizerHandle(adam)));
+ * \endcode
+ * The wrapped \a Handle provides Push(data) and Pull(keys, &res), as \ref
+ * KVStoreHandle, \ref KVDenseHandle and \ref KVOptimizerHandle do.
+ *
+ * Pushes are matched by their keys: in every round every worker pushes the
+ * same key lists, and there is a merge buffer per key list, namely per key
+ * range of a request to this server, or of a chunk of it. The rounds of a
+ * worker are counted by its pushes (sender and customer id), so a worker
+ * waiting for its push waits for the pushes of all others. A pull is parked
+ * until the last rounds its worker pushed to the overlapping key lists are
+ * applied, and it is released, not polled, by those applies.
+ *
+ * A worker may push one round ahead of the slowest one, which goes to the
+ * second buffer of a key list. Hence at most two rounds of values are
+ * buffered per key list. Not threadsafe, with PS_SERVER_THREADS every shard
+ * has its own copy, which sees the same key lists from all workers.
+ */
+template <typename Val, typename Handle = KVStoreHandle<Val>>
+class KVSyncHandle {
+ public:
+  /**
+   * \brief constructor
+   * \param handle the handle the summed pushes are applied to
+   * \param num_workers the number of pushes of a round, 0 means the number of
+   * workers. It is smaller with \ref KVWorker::set_local_aggregate
+   */
+  explicit KVSyncHandle(const Handle& handle = Handle(), int num_workers = 0)
+      : handle_(handle), num_workers_(num_workers) { }
+
+  void operator()(const KVMeta& req_meta, const KVPairs<Val>& req_data,
+                  KVServer<Val>* server) {
+    if (num_workers_ <= 0) num_workers_ = Postoffice::Get()->num_workers();
+    if (req_data.keys.empty()) {
+      server->Response(req_meta);
+      return;
+    }
+    if (req_meta.push) {
+      Push(req_meta, req_data, server);
+    } else {
+      Pull(req_meta, req_data.keys, server);
+    }
+  }
+
+  /** \brief the wrapped handle */
+  Handle& handle() { return handle_; }
+
+ private:
+  /** \brief the pushes of a round to a key list */
+  struct Round {
+    int count = 0;
+    SArray<Val> merged;
+    /** \brief the pushes and the parked pulls, responded when applied */
+    std::vector<KVMeta> pushes;
+    std::vector<int> pulls;
+  };
+  /** \brief a pull waiting for the rounds of some key lists */
+  struct Parked {
+    KVMeta meta;
+    SArray<Key> keys;
+    int remaining = 0;
+  };
+  /** \brief the merge buffer of a key list */
+  struct Buffer {
+    SArray<Key> keys;
+    /** \brief round t is in rounds[t % 2] */
+    Round rounds[2];
+    /** \brief the number of rounds applied */
+    int applied = 0;
+    /** \brief the number of rounds pushed by every (sender, customer id) */
+    std::map<std::pair<int, int>, int> pushed;
+  };
+  /** \brief (first key, last key, number of keys) of a key list */
+  using Signature = std::tuple<Key, Key, size_t>;
+  static Signature SignatureOf(const SArray<Key>& keys) {
+    return std::make_tuple(keys.front(), keys.back(), keys.size());
+  }
+
+  void Push(const KVMeta& meta, const KVPairs<Val>& data, KVServer<Val>* server) {
+    CHECK(data.lens.empty()) << "values must have a fixed length";
+    Buffer& buf = buffers_[SignatureOf(data.keys)];
+    size_t n = data.keys.size();
+    if (buf.keys.empty()) {
+      buf.keys.CopyFrom(data.keys);
+    } else {
+      CHECK_EQ(memcmp(buf.keys.data(), data.keys.data(), n * sizeof(Key)), 0)
+          << "workers must push the same keys in a round";
+    }
+    int& t = buf.pushed[std::make_pair(meta.sender, meta.customer_id)];
+    CHECK(t < buf.applied + 2) << "node " << meta.sender
+                               << " pushes more than one round ahead";
+    Round& round = buf.rounds[t % 2];
+    ++t;
+    if (round.count == 0) {
+      if (round.merged.size() == data.vals.size()) {
+        memcpy(round.merged.data(), data.vals.data(), data.vals.size() * sizeof(Val));
+      } else {
+        round.merged.CopyFrom(data.vals);
+      }
+    } else {
+      CHECK_EQ(round.merged.size(), data.vals.size()) << "unmatched value length";
+      Val* dst = round.merged.data();
+      const Val* src = data.vals.data();
+      for (size_t i = 0; i < data.vals.size(); ++i) dst[i] += src[i];
+    }
+    ++round.count;
+    round.pushes.push_back(meta);
+    // a round ahead can only complete after the current one
+    while (buf.rounds[buf.applied % 2].count == num_workers_) Apply(&buf, server);
+  }
+
+  void Pull(const KVMeta& meta, const SArray<Key>& keys, KVServer<Val>* server) {
+    // wait for the last round the worker pushed to every overlapping key list
+    Parked parked;
+    auto worker = std::make_pair(meta.sender, meta.customer_id);
+    auto end = buffers_.upper_bound(Signature(keys.back(), kMaxKey, static_cast<size_t>(-1)));
+    for (auto it = buffers_.begin(); it != end; ++it) {
+      Buffer& buf = it->second;
+      if (std::get<1>(it->first) < keys.front()) continue;
+      auto p = buf.pushed.find(worker);
+      if (p == buf.pushed.end() || p->second <= buf.applied) continue;
+      buf.rounds[(p->second - 1) % 2].pulls.push_back(next_parked_);
+      ++parked.remaining;
+    }
+    if (parked.remaining) {
+      parked.meta = meta;
+      parked.keys = keys;
+      parked_[next_parked_++] = parked;
+      return;
+    }
+    KVPairs<Val> res;
+    handle_.Pull(keys, &res);
+    server->Response(meta, res);
+  }
+
+  /** \brief apply the current round of \a buf and respond its requests */
+  void Apply(Buffer* buf, KVServer<Val>* server) {
+    Round& round = buf->rounds[buf->applied % 2];
+    KVPairs<Val> merged;
+    merged.keys = buf->keys;
+    merged.vals = round.merged;
+    handle_.Push(merged);
+    ++buf->applied;
+    KVPairs<Val> values;
+    for (const auto& meta : round.pushes) {
+      if (meta.pull && values.keys.empty()) handle_.Pull(buf->keys, &values);
+      server->Response(meta, meta.pull ? values : KVPairs<Val>());
+    }
+    for (int id : round.pulls) {
+      auto it = parked_.find(id);
+      if (--it->second.remaining) continue;
+      KVPairs<Val> res;
+      handle_.Pull(it->second.keys, &res);
+      server->Response(it->second.meta, res);
+      parked_.erase(it);
+    }
+    round.count = 0;
+    round.pushes.clear();
+    round.pulls.clear();
+  }
+
+  Handle handle_;
+  int num_workers_;
+  std::map<Signature, Buffer> buffers_;
+  std::unordered_map<int, Parked> parked_;
+  int next_parked_ = 0;
+};
+
+/**
+ * \brief a handle for bounded staleness (SSP) consistency. Pushes are applied
+ * to the wrapped handle at once, but the pull of a worker whose clock exceeds
+ * the clock of the slowest worker by more than \a staleness is parked until
+ * the slowest one catches up.
+ *
+ * Workers set their clocks by \ref KVWorker::set_clock, such as the
+ * iteration, and every request carries it. A server learns the clock of a
+ * worker from its requests, so every worker has to send a request, such as
+ * its push, to every server at every clock, otherwise the pulls of others wait
+ * for it. Workers not heard of yet are at clock 0. A parked pull is released,
+ * not polled, by the request advancing the slowest clock. A \ref
+ * KVWorker::PushPull is applied at once, with its response parked as a pull.
+ * Staleness 0 makes every worker wait for the slowest one, as BSP does, but
+ * without merging pushes.
+ *
+ * The clocks, the parked pulls and the wrapped handle are shared by the
+ * copies of a handle, so one kept by the caller reports the dependencies by
+ * \ref min_clock, \ref clocks and \ref num_parked. With PS_SERVER_THREADS the
+ * shards then handle requests one at a time.
+ * \code
+ *   KVSSPHandle<float> handle(3);
+ *   server->set_request_handle(handle);
+ * \endcode
+ */
+template <typename Val, typename Handle = KVStoreHandle<Val>>
+class KVSSPHandle {
+ public:
+  /** \brief the node id and customer id of a worker */
+  using Worker = std::pair<int, int>;
+
+  /**
+   * \brief constructor
+   * \param staleness the number of clocks a worker may be ahead of the slowest
+   * \param handle the handle requests are applied to
+   * \param num_workers the number of workers, 0 means all workers
+   */
+  explicit KVSSPHandle(int staleness, const Handle& handle = Handle(),
+                       int num_workers = 0)
+      : state_(std::make_shared<State>(handle)) {
+    CHECK_GE(staleness, 0);
+    state_->staleness = staleness;
+    state_->unseen = num_workers;
+  }
+
+  void operator()(const KVMeta& req_meta, const KVPairs<Val>& req_data,
+                  KVServer<Val>* server) {
+    State* s = state_.get();
+    std::lock_guard<std::mutex> lk(s->mu);
+    if (!s->started) {
+      if (s->unseen <= 0) s->unseen = Postoffice::Get()->num_workers();
+      s->started = true;
+    }
+    int min_clock = MinClock();
+    Tick(std::make_pair(req_meta.sender, req_meta.customer_id), req_meta.clock);
+    if (req_meta.push) s->handle.Push(req_data);
+    if (req_meta.push && !req_meta.pull) {
+      server->Response(req_meta);
+    } else {
+      int wait = req_meta.clock - s->staleness;
+      if (wait > MinClock()) {
+        PS_VLOG(2) << "park the pull of node " << req_meta.sender << " at clock "
+                   << req_meta.clock << ", the slowest is at " << MinClock();
+        Parked& p = s->parked.emplace(wait, Parked())->second;
+        p.meta = req_meta;
+        p.keys = req_data.keys;
+      } else {
+        KVPairs<Val> res;
+        s->handle.Pull(req_data.keys, &res);
+        server->Response(req_meta, res);
+      }
+    }
+    if (MinClock() > min_clock) Release(server);
+  }
+
+  /** \brief the clock of the slowest worker */
+  int min_clock() const {
+    std::lock_guard<std::mutex> lk(state_->mu);
+    return MinClock();
+  }
+
+  /** \brief the clocks of the workers heard of */
+  std::map<Worker, int> clocks() const {
+    std::lock_guard<std::mutex> lk(state_->mu);
+    return state_->clocks;
+  }
+
+  /** \brief the number of pulls waiting for the slowest worker */
+  size_t num_parked() const {
+    std::lock_guard<std::mutex> lk(state_->mu);
+    return state_->parked.size();
+  }
+
+ private:
+  /** \brief a pull waiting for the slowest clock to reach its key */
+  struct Parked {
+    KVMeta meta;
+    SArray<Key> keys;
+  };
+  struct State {
+    explicit State(const Handle& handle) : handle(handle) { }
+    std::mutex mu;
+    Handle handle;
+    int staleness = 0;
+    bool started = false;
+    /** \brief the number of workers not heard of, at clock 0 */
+    int unseen = 0;
+    std::map<Worker, int> clocks;
+    /** \brief the clocks of the workers heard of */
+    std::multiset<int> sorted;
+    std::multimap<int, Parked> parked;
+  };
+
+  int MinClock() const {
+    const State* s = state_.get();
+    int min_clock = s->sorted.empty() ? 0 : *s->sorted.begin();
+    return s->unseen > 0 ? std::min(min_clock, 0) : min_clock;
+  }
+
+  /** \brief a request of \a worker at \a clock, clocks never go back */
+  void Tick(const Worker& worker, int clock) {
+    State* s = state_.get();
+    auto it = s->clocks.find(worker);
+    if (it == s->clocks.end()) {
+      if (s->unseen > 0) --s->unseen;
+      s->clocks[worker] = clock;
+      s->sorted.insert(clock);
+    } else if (clock > it->second) {
+      s->sorted.erase(s->sorted.find(it->second));
+      s->sorted.insert(clock);
+      it->second = clock;
+    }
+  }
+
+  /** \brief respond the parked pulls the slowest clock has reached */
+  void Release(KVServer<Val>* server) {
+    State* s = state_.get();
+    int min_clock = MinClock();
+    while (!s->parked.empty() && s->parked.begin()->first <= min_clock) {
+      const Parked& p = s->parked.begin()->second;
+      KVPairs<Val> res;
+      s->handle.Pull(p.keys, &res);
+      server->Response(p.meta, res);
+      s->parked.erase(s->parked.begin());
+    }
+  }
+
+  std::shared_ptr<State> state_;
+};
+
+}  // namespace ps
+#endif  // PS_KV_SYNC_H_
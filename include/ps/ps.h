@@ -11,6 +11,12 @@
 #include "ps/simple_app.h"
 /** \brief communcating with a list of key-value paris. */
 #include "ps/kv_app.h"
+/** \brief turning raw key-value lists into key-value pairs */
+#include "ps/kv_combine.h"
+#include "ps/kv_store.h"
+#include "ps/kv_optimizer.h"
+#include "ps/kv_sync.h"
+#include "ps/kv_checkpoint.h"
 namespace ps {
 /** \brief Returns the number of worker nodes */
 inline int NumWorkers() { return Postoffice::Get()->num_workers(); }
@@ -4,6 +4,7 @@
 #ifndef PS_SARRAY_H_
 #define PS_SARRAY_H_
 #include <string.h>
+#include <algorithm>
 #include <string>
 #include <vector>
 #include <memory>
@@ -233,6 +234,9 @@ class SArray {
   void append(const SArray<V>& arr) {
     if (arr.empty()) return;
     auto orig_size = size_;
+    if (size_ + arr.size() > capacity_) {
+      reserve(std::max(size_*2+5, size_ + arr.size()));
+    }
     resize(size_ + arr.size());
     memcpy(data()+orig_size, arr.data(), arr.size()*sizeof(V));
   }
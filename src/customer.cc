@@ -2,7 +2,10 @@
  *  Copyright (c) 2015 by Contributors
  */
 #include "ps/internal/customer.h"
+#include <algorithm>
+#include <chrono>
 #include "ps/internal/postoffice.h"
+#include "ps/internal/thread_affinity.h"
 namespace ps {
 
 const int Node::kEmpty = std::numeric_limits<int>::max();
@@ -32,21 +35,48 @@ int Customer::NewRequest(int recver) {
 void Customer::WaitRequest(int timestamp) {
   std::unique_lock<std::mutex> lk(tracker_mu_);
   tracker_cond_.wait(lk, [this, timestamp]{
-      return tracker_[timestamp].first == tracker_[timestamp].second;
+      return tracker_[timestamp].first <= tracker_[timestamp].second;
     });
 }
 
+bool Customer::WaitRequest(int timestamp, int timeout_ms) {
+  std::unique_lock<std::mutex> lk(tracker_mu_);
+  return tracker_cond_.wait_for(
+      lk, std::chrono::milliseconds(timeout_ms), [this, timestamp]{
+        return tracker_[timestamp].first <= tracker_[timestamp].second;
+      });
+}
+
+void Customer::CancelRequest(int timestamp) {
+  std::lock_guard<std::mutex> lk(tracker_mu_);
+  auto& t = tracker_[timestamp];
+  t.second = std::max(t.first, t.second);
+  tracker_cond_.notify_all();
+}
+
 int Customer::NumResponse(int timestamp) {
   std::lock_guard<std::mutex> lk(tracker_mu_);
   return tracker_[timestamp].second;
 }
 
+int Customer::NumExpected(int timestamp) {
+  std::lock_guard<std::mutex> lk(tracker_mu_);
+  return tracker_[timestamp].first;
+}
+
+void Customer::AddExpected(int timestamp, int num) {
+  std::lock_guard<std::mutex> lk(tracker_mu_);
+  tracker_[timestamp].first += num;
+}
+
 void Customer::AddResponse(int timestamp, int num) {
   std::lock_guard<std::mutex> lk(tracker_mu_);
   tracker_[timestamp].second += num;
+  tracker_cond_.notify_all();
 }
 
 void Customer::Receiving() {
+  PinCurrentThread("PS_CUSTOMER_THREAD_CPUS", "customer");
   while (true) {
     Message recv;
     recv_queue_.WaitAndPop(&recv);
@@ -0,0 +1,87 @@
+/**
+ *  Copyright (c) 2015 by Contributors
+ */
+#include <string.h>
+#include "ps/kv_optimizer.h"
+#include "ps/internal/env.h"
+#include "./optimizer_kernels.h"
+namespace ps {
+
+// defined in optimizer_avx*.cc, nullptr if not compiled with the instruction set
+Optimizer::Kernel Avx2Kernel(OptimizerConfig::Type type);
+Optimizer::Kernel Avx512Kernel(OptimizerConfig::Type type);
+
+namespace {
+/** \brief the instruction sets, from the best one */
+const char* kIsa[] = {"avx512", "avx2", "scalar"};
+
+bool CPUSupports(const std::string& isa) {
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+  if (isa == "avx512") return __builtin_cpu_supports("avx512f");
+  if (isa == "avx2") return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+#endif
+  return isa == "scalar";
+}
+
+Optimizer::Kernel KernelOf(const std::string& isa, OptimizerConfig::Type type) {
+  if (!CPUSupports(isa)) return nullptr;
+  if (isa == "avx512") return Avx512Kernel(type);
+  if (isa == "avx2") return Avx2Kernel(type);
+  return GetKernel<ScalarPack>(type);
+}
+}  // namespace
+
+Optimizer::Optimizer(const OptimizerConfig& cfg, const std::string& isa) : cfg_(cfg) {
+  if (!isa.empty()) {
+    kernel_ = KernelOf(isa, cfg.type);
+    CHECK(kernel_) << "instruction set " << isa << " is not supported";
+    isa_ = isa;
+    return;
+  }
+  // the best one not above PS_OPTIMIZER_ISA
+  const char* max_isa = Environment::Get()->find("PS_OPTIMIZER_ISA");
+  bool allowed = max_isa == nullptr;
+  for (const char* s : kIsa) {
+    if (!allowed && strcmp(s, max_isa)) continue;
+    allowed = true;
+    kernel_ = KernelOf(s, cfg.type);
+    if (kernel_) {
+      isa_ = s;
+      break;
+    }
+  }
+  CHECK(allowed) << "unknown PS_OPTIMIZER_ISA " << max_isa;
+  CHECK(kernel_);
+}
+
+bool Optimizer::Supported(const std::string& isa) {
+  return KernelOf(isa, OptimizerConfig::SGD) != nullptr;
+}
+
+size_t Optimizer::ValLen(size_t k) const {
+  switch (cfg_.type) {
+    case OptimizerConfig::SGD: return k;
+    case OptimizerConfig::MOMENTUM:
+    case OptimizerConfig::ADAGRAD: return 2 * k;
+    case OptimizerConfig::FTRL: return 3 * k;
+    case OptimizerConfig::ADAM:
+    case OptimizerConfig::ADAMW:
+    case OptimizerConfig::LAMB: return 3 * k + 2;
+  }
+  return k;
+}
+
+size_t Optimizer::ParamLen(size_t val_len) const {
+  switch (cfg_.type) {
+    case OptimizerConfig::SGD: return val_len;
+    case OptimizerConfig::MOMENTUM:
+    case OptimizerConfig::ADAGRAD: return val_len / 2;
+    case OptimizerConfig::FTRL: return val_len / 3;
+    case OptimizerConfig::ADAM:
+    case OptimizerConfig::ADAMW:
+    case OptimizerConfig::LAMB: return (val_len - 2) / 3;
+  }
+  return val_len;
+}
+
+}  // namespace ps
@@ -0,0 +1,48 @@
+/**
+ *  Copyright (c) 2015 by Contributors
+ *
+ * The optimizer kernels on AVX2, built with -mavx2 -mfma. Only called if the
+ * CPU supports them, see optimizer.cc
+ */
+#if defined(__AVX2__) && defined(__FMA__)
+#include <immintrin.h>
+#endif
+#include "./optimizer_kernels.h"
+namespace ps {
+
+#if defined(__AVX2__) && defined(__FMA__)
+namespace {
+/** \brief a pack of 8 floats */
+struct Avx2Pack {
+  typedef __m256 V;
+  static const size_t N = 8;
+  static V Load(const float* p) { return _mm256_loadu_ps(p); }
+  static void Store(float* p, V a) { _mm256_storeu_ps(p, a); }
+  static V Set(float a) { return _mm256_set1_ps(a); }
+  static V Add(V a, V b) { return _mm256_add_ps(a, b); }
+  static V Sub(V a, V b) { return _mm256_sub_ps(a, b); }
+  static V Mul(V a, V b) { return _mm256_mul_ps(a, b); }
+  static V Div(V a, V b) { return _mm256_div_ps(a, b); }
+  static V Fma(V a, V b, V c) { return _mm256_fmadd_ps(a, b, c); }
+  static V Sqrt(V a) { return _mm256_sqrt_ps(a); }
+  static V Shrink(V z, V l1) {
+    V sign = _mm256_set1_ps(-0.0f);
+    V m = _mm256_max_ps(_mm256_sub_ps(_mm256_andnot_ps(sign, z), l1), _mm256_setzero_ps());
+    return _mm256_or_ps(m, _mm256_and_ps(sign, z));
+  }
+  static float Sum(V a) {
+    __m128 s = _mm_add_ps(_mm256_castps256_ps128(a), _mm256_extractf128_ps(a, 1));
+    s = _mm_hadd_ps(s, s);
+    return _mm_cvtss_f32(_mm_hadd_ps(s, s));
+  }
+};
+}  // namespace
+
+Optimizer::Kernel Avx2Kernel(OptimizerConfig::Type type) {
+  return GetKernel<Avx2Pack>(type);
+}
+#else
+Optimizer::Kernel Avx2Kernel(OptimizerConfig::Type type) { return nullptr; }
+#endif  // __AVX2__
+
+}  // namespace ps
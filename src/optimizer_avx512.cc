@@ -0,0 +1,52 @@
+/**
+ *  Copyright (c) 2015 by Contributors
+ *
+ * The optimizer kernels on AVX-512, built with -mavx512f. Only called if the
+ * CPU supports it, see optimizer.cc
+ */
+#ifdef __AVX512F__
+#if defined(__GNUC__) && !defined(__clang__)
+// the intrinsics of some gcc versions falsely warn of their undefined masks
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+#endif
+#include <immintrin.h>
+#endif
+#include "./optimizer_kernels.h"
+namespace ps {
+
+#ifdef __AVX512F__
+namespace {
+/** \brief a pack of 16 floats */
+struct Avx512Pack {
+  typedef __m512 V;
+  static const size_t N = 16;
+  static V Load(const float* p) { return _mm512_loadu_ps(p); }
+  static void Store(float* p, V a) { _mm512_storeu_ps(p, a); }
+  static V Set(float a) { return _mm512_set1_ps(a); }
+  static V Add(V a, V b) { return _mm512_add_ps(a, b); }
+  static V Sub(V a, V b) { return _mm512_sub_ps(a, b); }
+  static V Mul(V a, V b) { return _mm512_mul_ps(a, b); }
+  static V Div(V a, V b) { return _mm512_div_ps(a, b); }
+  static V Fma(V a, V b, V c) { return _mm512_fmadd_ps(a, b, c); }
+  static V Sqrt(V a) { return _mm512_sqrt_ps(a); }
+  static V Shrink(V z, V l1) {
+    // the logic ops on floats need AVX512DQ, so take them as ints
+    __m512i sign = _mm512_set1_epi32(0x80000000);
+    __m512i zi = _mm512_castps_si512(z);
+    V a = _mm512_castsi512_ps(_mm512_andnot_si512(sign, zi));
+    V m = _mm512_max_ps(_mm512_sub_ps(a, l1), _mm512_setzero_ps());
+    return _mm512_castsi512_ps(_mm512_or_si512(_mm512_castps_si512(m),
+                                               _mm512_and_si512(sign, zi)));
+  }
+  static float Sum(V a) { return _mm512_reduce_add_ps(a); }
+};
+}  // namespace
+
+Optimizer::Kernel Avx512Kernel(OptimizerConfig::Type type) {
+  return GetKernel<Avx512Pack>(type);
+}
+#else
+Optimizer::Kernel Avx512Kernel(OptimizerConfig::Type type) { return nullptr; }
+#endif  // __AVX512F__
+
+}  // namespace ps
@@ -0,0 +1,252 @@
+/**
+ *  Copyright (c) 2015 by Contributors
+ */
+#ifndef PS_OPTIMIZER_KERNELS_H_
+#define PS_OPTIMIZER_KERNELS_H_
+#include <math.h>
+#include <stddef.h>
+#include "ps/kv_optimizer.h"
+namespace ps {
+// in an anonymous namespace, so the copies compiled with different instruction
+// sets by optimizer*.cc never get mixed up by the linker
+namespace {
+
+/**
+ * \brief the operations on a pack of N floats which the kernels are written
+ * in, here for N = 1. The packs of SIMD registers are in optimizer_avx*.cc
+ */
+struct ScalarPack {
+  typedef float V;
+  static const size_t N = 1;
+  static V Load(const float* p) { return *p; }
+  static void Store(float* p, V a) { *p = a; }
+  static V Set(float a) { return a; }
+  static V Add(V a, V b) { return a + b; }
+  static V Sub(V a, V b) { return a - b; }
+  static V Mul(V a, V b) { return a * b; }
+  static V Div(V a, V b) { return a / b; }
+  /** \brief a * b + c */
+  static V Fma(V a, V b, V c) { return a * b + c; }
+  static V Sqrt(V a) { return sqrtf(a); }
+  /** \brief sign(z) * max(|z| - l1, 0) */
+  static V Shrink(V z, V l1) {
+    float m = fabsf(z) - l1;
+    return m > 0 ? copysignf(m, z) : 0;
+  }
+  static float Sum(V a) { return a; }
+};
+
+/**
+ * \brief call f.Step<P>(i) on the first k floats, N at a time, and the tail
+ * by \ref ScalarPack
+ */
+template <typename P, typename F>
+inline void ForEach(size_t k, F* f) {
+  size_t i = 0;
+  for (; i + P::N <= k; i += P::N) f->template Step<P>(i);
+  for (; i < k; ++i) f->template Step<ScalarPack>(i);
+}
+
+/** \brief values [w] */
+struct SGDStep {
+  float* w;
+  const float* g;
+  float lr, wd;
+  template <typename P> void Step(size_t i) {
+    typename P::V x = P::Load(w + i);
+    typename P::V d = P::Fma(P::Set(wd), x, P::Load(g + i));
+    P::Store(w + i, P::Fma(P::Set(-lr), d, x));
+  }
+};
+
+template <typename P>
+void SGD(const OptimizerConfig& c, float* v, const float* g, size_t k) {
+  SGDStep s = {v, g, c.lr, c.weight_decay};
+  ForEach<P>(k, &s);
+}
+
+/** \brief values [w, m] */
+struct MomentumStep {
+  float *w, *m;
+  const float* g;
+  float lr, mu, wd;
+  template <typename P> void Step(size_t i) {
+    typename P::V x = P::Load(w + i);
+    typename P::V d = P::Fma(P::Set(wd), x, P::Load(g + i));
+    typename P::V mi = P::Fma(P::Set(mu), P::Load(m + i), d);
+    P::Store(m + i, mi);
+    P::Store(w + i, P::Fma(P::Set(-lr), mi, x));
+  }
+};
+
+template <typename P>
+void Momentum(const OptimizerConfig& c, float* v, const float* g, size_t k) {
+  MomentumStep s = {v, v + k, g, c.lr, c.momentum, c.weight_decay};
+  ForEach<P>(k, &s);
+}
+
+/** \brief values [w, h], h is the sum of squared gradients */
+struct AdagradStep {
+  float *w, *h;
+  const float* g;
+  float lr, eps, wd;
+  template <typename P> void Step(size_t i) {
+    typename P::V x = P::Load(w + i);
+    typename P::V d = P::Fma(P::Set(wd), x, P::Load(g + i));
+    typename P::V hi = P::Fma(d, d, P::Load(h + i));
+    P::Store(h + i, hi);
+    typename P::V u = P::Div(d, P::Add(P::Sqrt(hi), P::Set(eps)));
+    P::Store(w + i, P::Fma(P::Set(-lr), u, x));
+  }
+};
+
+template <typename P>
+void Adagrad(const OptimizerConfig& c, float* v, const float* g, size_t k) {
+  AdagradStep s = {v, v + k, g, c.lr, c.eps, c.weight_decay};
+  ForEach<P>(k, &s);
+}
+
+/**
+ * \brief values [w, m, v, c1, c2], the moments and their bias corrections. It
+ * updates the moments, and then w by the bias corrected moments. With \a
+ * decoupled weight decay (ADAMW) w decays directly, otherwise the decay is
+ * added to the gradient
+ */
+struct AdamStep {
+  float *w, *m, *v;
+  const float* g;
+  float lr, b1, b2, eps, wd;
+  /** \brief lr / c1, and 1 / sqrt(c2) */
+  float step, inv_c2;
+  bool decoupled;
+  template <typename P> void Step(size_t i) {
+    typename P::V x = P::Load(w + i);
+    typename P::V d = P::Load(g + i);
+    if (!decoupled) d = P::Fma(P::Set(wd), x, d);
+    typename P::V mi = P::Fma(P::Set(b1), P::Load(m + i), P::Mul(P::Set(1 - b1), d));
+    typename P::V vi = P::Fma(P::Set(b2), P::Load(v + i),
+                              P::Mul(P::Set(1 - b2), P::Mul(d, d)));
+    P::Store(m + i, mi);
+    P::Store(v + i, vi);
+    typename P::V u = P::Div(mi, P::Fma(P::Sqrt(vi), P::Set(inv_c2), P::Set(eps)));
+    if (decoupled) x = P::Fma(P::Set(-lr * wd), x, x);
+    P::Store(w + i, P::Fma(P::Set(-step), u, x));
+  }
+};
+
+/**
+ * \brief count a step, v[3k] and v[3k+1] are 1 - b1^t and 1 - b2^t after t
+ * steps, which start at 0 and take no pow to update
+ */
+inline void CountStep(const OptimizerConfig& c, float* v, size_t k,
+                      float* c1, float* c2) {
+  *c1 = v[3 * k] = v[3 * k] * c.beta1 + (1 - c.beta1);
+  *c2 = v[3 * k + 1] = v[3 * k + 1] * c.beta2 + (1 - c.beta2);
+}
+
+template <typename P, bool kDecoupled>
+void Adam(const OptimizerConfig& c, float* v, const float* g, size_t k) {
+  float c1, c2;
+  CountStep(c, v, k, &c1, &c2);
+  AdamStep s = {v, v + k, v + 2 * k, g, c.lr, c.beta1, c.beta2, c.eps,
+                c.weight_decay, c.lr / c1, 1 / sqrtf(c2), kDecoupled};
+  ForEach<P>(k, &s);
+}
+
+/**
+ * \brief values [w, m, v, c1, c2] as ADAM. LAMB takes the values of a key as a
+ * layer, it first updates the moments and sums the squares of w and of the
+ * update r, and then scales the step by the trust ratio |w| / |r|
+ */
+struct LambStep {
+  float *w, *m, *v;
+  const float* g;
+  float b1, b2, eps, wd, inv_c1, inv_c2;
+  /** \brief the first pass, or the second one applying lr * ratio */
+  bool apply;
+  float scale;
+  float w2, r2;
+  template <typename P> void Step(size_t i) {
+    typename P::V x = P::Load(w + i);
+    typename P::V mi, vi;
+    if (!apply) {
+      typename P::V d = P::Load(g + i);
+      mi = P::Fma(P::Set(b1), P::Load(m + i), P::Mul(P::Set(1 - b1), d));
+      vi = P::Fma(P::Set(b2), P::Load(v + i), P::Mul(P::Set(1 - b2), P::Mul(d, d)));
+      P::Store(m + i, mi);
+      P::Store(v + i, vi);
+    } else {
+      mi = P::Load(m + i);
+      vi = P::Load(v + i);
+    }
+    typename P::V r = P::Div(P::Mul(mi, P::Set(inv_c1)),
+                             P::Fma(P::Sqrt(vi), P::Set(inv_c2), P::Set(eps)));
+    r = P::Fma(P::Set(wd), x, r);
+    if (apply) {
+      P::Store(w + i, P::Fma(P::Set(-scale), r, x));
+    } else {
+      w2 += P::Sum(P::Mul(x, x));
+      r2 += P::Sum(P::Mul(r, r));
+    }
+  }
+};
+
+template <typename P>
+void Lamb(const OptimizerConfig& c, float* v, const float* g, size_t k) {
+  float c1, c2;
+  CountStep(c, v, k, &c1, &c2);
+  LambStep s = {v, v + k, v + 2 * k, g, c.beta1, c.beta2, c.eps, c.weight_decay,
+                1 / c1, 1 / sqrtf(c2), false, 0, 0, 0};
+  ForEach<P>(k, &s);
+  float ratio = s.w2 > 0 && s.r2 > 0 ? sqrtf(s.w2 / s.r2) : 1;
+  s.apply = true;
+  s.scale = c.lr * ratio;
+  ForEach<P>(k, &s);
+}
+
+/**
+ * \brief values [w, z, n] of FTRL-proximal, where w is derived from the
+ * accumulators z and n
+ */
+struct FtrlStep {
+  float *w, *z, *n;
+  const float* g;
+  float inv_alpha, beta, l1, l2;
+  template <typename P> void Step(size_t i) {
+    typename P::V d = P::Load(g + i);
+    typename P::V ni = P::Load(n + i);
+    typename P::V nn = P::Fma(d, d, ni);
+    typename P::V sn = P::Sqrt(nn);
+    typename P::V sigma = P::Mul(P::Sub(sn, P::Sqrt(ni)), P::Set(inv_alpha));
+    typename P::V zi = P::Add(P::Load(z + i), P::Sub(d, P::Mul(sigma, P::Load(w + i))));
+    P::Store(z + i, zi);
+    P::Store(n + i, nn);
+    typename P::V denom = P::Fma(P::Add(P::Set(beta), sn), P::Set(inv_alpha), P::Set(l2));
+    P::Store(w + i, P::Div(P::Shrink(zi, P::Set(l1)), P::Sub(P::Set(0), denom)));
+  }
+};
+
+template <typename P>
+void Ftrl(const OptimizerConfig& c, float* v, const float* g, size_t k) {
+  FtrlStep s = {v, v + k, v + 2 * k, g, 1 / c.lr, c.beta, c.l1, c.l2};
+  ForEach<P>(k, &s);
+}
+
+/** \brief the kernel of an optimizer written in pack P */
+template <typename P>
+Optimizer::Kernel GetKernel(OptimizerConfig::Type type) {
+  switch (type) {
+    case OptimizerConfig::SGD: return SGD<P>;
+    case OptimizerConfig::MOMENTUM: return Momentum<P>;
+    case OptimizerConfig::ADAGRAD: return Adagrad<P>;
+    case OptimizerConfig::ADAM: return Adam<P, false>;
+    case OptimizerConfig::ADAMW: return Adam<P, true>;
+    case OptimizerConfig::FTRL: return Ftrl<P>;
+    case OptimizerConfig::LAMB: return Lamb<P>;
+  }
+  return nullptr;
+}
+
+}  // namespace
+}  // namespace ps
+#endif  // PS_OPTIMIZER_KERNELS_H_
@@ -87,7 +87,11 @@ void Postoffice::Finalize(const int customer_id, const bool do_barrier) {
     num_servers_ = 0;
     van_->Stop();
     init_stage_ = 0;
+    StopPendingWatch();
     customers_.clear();
+    pending_msgs_.clear();
+    pending_since_.clear();
+    removed_customers_.clear();
     node_ids_.clear();
     barrier_done_.clear();
     server_key_ranges_.clear();
@@ -105,6 +109,17 @@ void Postoffice::AddCustomer(Customer* customer) {
   CHECK_EQ(customers_[app_id].count(customer_id), (size_t) 0) << "customer_id " \
     << customer_id << " already exists\n";
   customers_[app_id].insert(std::make_pair(customer_id, customer));
+  customers_cond_.notify_all();
+  removed_customers_[app_id].erase(customer_id);
+  auto it = pending_msgs_.find(app_id);
+  if (it != pending_msgs_.end()) {
+    auto jt = it->second.find(customer_id);
+    if (jt != it->second.end()) {
+      for (const auto& msg : jt->second) customer->Accept(msg);
+      it->second.erase(jt);
+      pending_since_[app_id].erase(customer_id);
+    }
+  }
   std::unique_lock<std::mutex> ulk(barrier_mu_);
   barrier_done_[app_id].insert(std::make_pair(customer_id, false));
 }
@@ -118,24 +133,76 @@ void Postoffice::RemoveCustomer(Customer* customer) {
   if (customers_[app_id].empty()) {
     customers_.erase(app_id);
   }
+  removed_customers_[app_id].insert(customer_id);
 }
 
 
 Customer* Postoffice::GetCustomer(int app_id, int customer_id, int timeout) const {
   Customer* obj = nullptr;
-  for (int i = 0; i < timeout * 1000 + 1; ++i) {
-    {
-      std::lock_guard<std::mutex> lk(mu_);
-      const auto it = customers_.find(app_id);
-      if (it != customers_.end()) {
-        std::unordered_map<int, Customer*> customers_in_app = it->second;
-        obj = customers_in_app[customer_id];
-        break;
+  auto find = [this, app_id, customer_id, &obj]() {
+    const auto it = customers_.find(app_id);
+    if (it == customers_.end()) return false;
+    const auto jt = it->second.find(customer_id);
+    if (jt == it->second.end()) return false;
+    obj = jt->second;
+    return true;
+  };
+  std::unique_lock<std::mutex> lk(mu_);
+  customers_cond_.wait_for(lk, std::chrono::seconds(timeout), find);
+  return obj;
+}
+
+void Postoffice::Deliver(int app_id, int customer_id, const Message& msg) {
+  std::lock_guard<std::mutex> lk(mu_);
+  const auto it = customers_.find(app_id);
+  if (it != customers_.end()) {
+    const auto jt = it->second.find(customer_id);
+    if (jt != it->second.end()) {
+      jt->second->Accept(msg);
+      return;
+    }
+  }
+  const auto rt = removed_customers_.find(app_id);
+  if (rt != removed_customers_.end() && rt->second.count(customer_id)) {
+    LOG(WARNING) << "drop a message for the removed app " << app_id
+                 << " customer " << customer_id << ", timestamp "
+                 << msg.meta.timestamp;
+    return;
+  }
+  PS_VLOG(2) << "hold the message until app " << app_id << " customer "
+             << customer_id << " is ready";
+  auto& held = pending_msgs_[app_id][customer_id];
+  if (held.empty()) pending_since_[app_id][customer_id] = time(NULL);
+  held.push_back(msg);
+  if (!pending_watch_.joinable()) {
+    pending_watch_ = std::thread(&Postoffice::WatchPending, this);
+  }
+}
+
+void Postoffice::WatchPending() {
+  const int timeout = 5;
+  std::unique_lock<std::mutex> lk(mu_);
+  while (!stop_pending_watch_) {
+    time_t now = time(NULL);
+    for (const auto& app : pending_since_) {
+      for (const auto& c : app.second) {
+        CHECK_LE(now - c.second, timeout) << "timeout (" << timeout
+            << " sec) to wait App " << app.first << " customer " << c.first
+            << " ready";
       }
     }
-    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    pending_cond_.wait_for(lk, std::chrono::seconds(1));
   }
-  return obj;
+}
+
+void Postoffice::StopPendingWatch() {
+  {
+    std::lock_guard<std::mutex> lk(mu_);
+    stop_pending_watch_ = true;
+  }
+  pending_cond_.notify_all();
+  if (pending_watch_.joinable()) pending_watch_.join();
+  stop_pending_watch_ = false;
 }
 
 void Postoffice::Barrier(int customer_id, int node_group) {
@@ -159,7 +226,7 @@ void Postoffice::Barrier(int customer_id, int node_group) {
   req.meta.customer_id = customer_id;
   req.meta.control.barrier_group = node_group;
   req.meta.timestamp = van_->GetTimestamp();
-  CHECK_GT(van_->Send(req), 0);
+  CHECK_NE(van_->Send(req), -1);
   barrier_cond_.wait(ulk, [this, customer_id] {
       return barrier_done_[0][customer_id];
     });
@@ -7,6 +7,7 @@
 #include <vector>
 #include <unordered_set>
 #include <unordered_map>
+#include "ps/internal/thread_affinity.h"
 namespace ps {
 
 /**
@@ -98,10 +99,15 @@ class Resender {
     uint8_t sender = msg.meta.sender == Node::kEmpty ?
                      van_->my_node().id : msg.meta.sender;
     uint8_t recver = msg.meta.recver;
-    return (static_cast<uint64_t>(id) << 48) |
+    uint64_t key = (static_cast<uint64_t>(id) << 48) |
         (static_cast<uint64_t>(sender) << 40) |
         (static_cast<uint64_t>(recver) << 32) |
         (msg.meta.timestamp << 1) | msg.meta.request;
+    // the chunks of a request share its timestamp
+    if (msg.meta.chunk_begin) {
+      key ^= static_cast<uint64_t>(msg.meta.chunk_begin) * 0x9E3779B97F4A7C15ULL;
+    }
+    return key;
   }
   Time Now() {
     return std::chrono::duration_cast<Time>(
@@ -109,6 +115,7 @@ class Resender {
   }
 
   void Monitoring() {
+    PinCurrentThread("PS_RESEND_THREAD_CPUS", "resender");
     while (!exit_) {
       std::this_thread::sleep_for(Time(timeout_));
       std::vector<Message> resend;
@@ -12,6 +12,7 @@
 #include "./meta.pb.h"
 #include "./zmq_van.h"
 #include "./resender.h"
+#include "ps/internal/thread_affinity.h"
 #include <time.h>
 namespace ps {
 
@@ -74,17 +75,18 @@ void Van::ProcessAddNodeCommandAtScheduler(
     nodes->control.cmd = Control::ADD_NODE;
     Message back;
     back.meta = *nodes;
+    back.meta.timestamp = timestamp_++;
+    std::vector<int> recvers;
     for (int r : Postoffice::Get()->GetNodeIDs(kWorkerGroup + kServerGroup)) {
-      int recver_id = r;
       if (shared_node_mapping_.find(r) == shared_node_mapping_.end()) {
-        back.meta.recver = recver_id;
-        back.meta.timestamp = timestamp_++;
-        Send(back);
+        recvers.push_back(r);
       }
     }
+    // the node table is the same for everyone, pack it once
+    Broadcast(back, recvers);
     PS_VLOG(1) << "the scheduler is connected to "
                << num_workers_ << " workers and " << num_servers_ << " servers";
-    ready_ = true;
+    SetReady();
   } else if (!recovery_nodes->control.node.empty()) {
     auto dead_nodes = Postoffice::Get()->GetDeadNodes(heartbeat_timeout_);
     std::unordered_set<int> dead_set(dead_nodes.begin(), dead_nodes.end());
@@ -197,7 +199,7 @@ void Van::ProcessBarrierCommand(Message* msg) {
         if (shared_node_mapping_.find(r) == shared_node_mapping_.end()) {
           res.meta.recver = recver_id;
           res.meta.timestamp = timestamp_++;
-          CHECK_GT(Send(res), 0);
+          CHECK_NE(Send(res), -1);
         }
       }
     }
@@ -213,10 +215,10 @@ void Van::ProcessDataMsg(Message* msg) {
   CHECK_NE(msg->meta.app_id, Meta::kEmpty);
   int app_id = msg->meta.app_id;
   int customer_id = Postoffice::Get()->is_worker() ? msg->meta.customer_id : app_id;
-  auto* obj = Postoffice::Get()->GetCustomer(app_id, customer_id, 5);
-  CHECK(obj) << "timeout (5 sec) to wait App " << app_id << " customer " << customer_id \
-    << " ready at " << my_node_.role;
-  obj->Accept(*msg);
+  if (send_credit_ && !msg->meta.request) ReleaseCredit(*msg);
+  // do not block here, the customer may be created only after a control
+  // message that is still queued behind this one
+  Postoffice::Get()->Deliver(app_id, customer_id, *msg);
 }
 
 void Van::ProcessAddNodeCommand(Message* msg, Meta* nodes, Meta* recovery_nodes) {
@@ -239,7 +241,7 @@ void Van::ProcessAddNodeCommand(Message* msg, Meta* nodes, Meta* recovery_nodes)
       if (!node.is_recovery && node.role == Node::WORKER) ++num_workers_;
     }
     PS_VLOG(1) << my_node_.ShortDebugString() << " is connected to others";
-    ready_ = true;
+    SetReady();
   }
 }
 
@@ -304,6 +306,13 @@ void Van::Start(int customer_id) {
     // start receiver
     receiver_thread_ = std::unique_ptr<std::thread>(
             new std::thread(&Van::Receiving, this));
+    // start sender
+    send_credit_ = GetEnv("PS_SEND_CREDIT", 0);
+    if (send_credit_) {
+      send_queue_.resize(1);
+      sender_thread_ = std::unique_ptr<std::thread>(
+              new std::thread(&Van::Sending, this));
+    }
     init_stage++;
   }
   start_mu_.unlock();
@@ -321,8 +330,9 @@ void Van::Start(int customer_id) {
   }
 
   // wait until ready
-  while (!ready_.load()) {
-    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+  {
+    std::unique_lock<std::mutex> lk(ready_mu_);
+    ready_cond_.wait(lk, [this] { return ready_.load(); });
   }
 
   start_mu_.lock();
@@ -347,7 +357,19 @@ void Van::Start(int customer_id) {
 }
 
 void Van::Stop() {
-  // stop threads
+  // stop threads, the queued messages are sent first
+  if (sender_thread_) {
+    {
+      std::lock_guard<std::mutex> lk(send_mu_);
+      stop_sending_ = true;
+    }
+    send_cond_.notify_all();
+    sender_thread_->join();
+    sender_thread_.reset();
+    stop_sending_ = false;
+    inflight_.clear();
+    inflight_bytes_ = 0;
+  }
   Message exit;
   exit.meta.control.cmd = Control::TERMINATE;
   exit.meta.recver = my_node_.id;
@@ -368,7 +390,113 @@ void Van::Stop() {
   barrier_count_.clear();
 }
 
+void Van::SetReady() {
+  {
+    std::lock_guard<std::mutex> lk(ready_mu_);
+    ready_ = true;
+  }
+  ready_cond_.notify_all();
+}
+
+void Van::Broadcast(const Message& msg, const std::vector<int>& recvers) {
+  if (recvers.empty()) return;
+  int meta_size; char* meta_buf;
+  PackMeta(msg.meta, &meta_buf, &meta_size);
+  Message copy = msg;
+  for (int r : recvers) {
+    copy.meta.recver = r;
+    // the van frees the buffer after sending
+    char* buf = new char[meta_size + 1];
+    memcpy(buf, meta_buf, meta_size);
+    int send_bytes = SendPackedMsg(copy, buf, meta_size);
+    CHECK_NE(send_bytes, -1);
+    send_bytes_ += send_bytes;
+    if (resender_) resender_->AddOutgoing(copy);
+  }
+  delete [] meta_buf;
+}
+
 int Van::Send(const Message& msg) {
+  if (send_credit_ && msg.meta.control.empty()) {
+    QueuedMessage q;
+    q.msg = msg;
+    q.bytes = 0;
+    for (const auto& d : msg.data) q.bytes += d.size();
+    {
+      std::lock_guard<std::mutex> lk(send_mu_);
+      q.seq = send_seq_++;
+      send_queue_.back().push(q);
+    }
+    send_cond_.notify_one();
+    return q.bytes;
+  }
+  if (send_credit_) {
+    // a control message must not overtake the data queued before it, e.g. a
+    // barrier the pushes before it
+    std::unique_lock<std::mutex> lk(send_mu_);
+    if (num_sending_ || !control_queue_.empty() || !send_queue_.back().empty()) {
+      control_queue_.push_back(msg);
+      send_queue_.emplace_back();
+      lk.unlock();
+      send_cond_.notify_one();
+      return 0;
+    }
+  }
+  return SendNow(msg);
+}
+
+void Van::Sending() {
+  while (true) {
+    std::unique_lock<std::mutex> lk(send_mu_);
+    // a request waits for credit unless nothing is in flight, so a request
+    // larger than the credit is still sent
+    send_cond_.wait(lk, [this] {
+        const auto& front = send_queue_.front();
+        if (front.empty()) return stop_sending_ || !control_queue_.empty();
+        const auto& q = front.top();
+        return stop_sending_ || !HoldsCredit(q.msg) || inflight_bytes_ == 0 ||
+            inflight_bytes_ + q.bytes <= send_credit_;
+      });
+    auto& front = send_queue_.front();
+    if (front.empty()) {
+      if (control_queue_.empty()) break;
+      // all data before the control message is sent
+      Message msg = control_queue_.front();
+      control_queue_.pop_front();
+      send_queue_.pop_front();
+      ++num_sending_;
+      lk.unlock();
+      SendNow(msg);
+    } else {
+      QueuedMessage q = front.top();
+      front.pop();
+      if (HoldsCredit(q.msg)) {
+        auto key = CreditKeyOf(q.msg.meta.recver, q.msg.meta);
+        // a resent request is already in flight
+        if (inflight_.emplace(key, q.bytes).second) inflight_bytes_ += q.bytes;
+      }
+      ++num_sending_;
+      lk.unlock();
+      SendNow(q.msg);
+    }
+    lk.lock();
+    --num_sending_;
+  }
+}
+
+void Van::ReleaseCredit(const Message& msg) {
+  auto key = CreditKeyOf(msg.meta.sender, msg.meta);
+  {
+    std::lock_guard<std::mutex> lk(send_mu_);
+    auto it = inflight_.find(key);
+    if (it == inflight_.end()) return;
+    inflight_bytes_ -= it->second;
+    inflight_.erase(it);
+  }
+  send_cond_.notify_one();
+}
+
+int Van::SendNow(const Message& msg) {
   double time_st = (double)clock();
   if (Postoffice::Get()->verbose() >= 2) {
     PS_VLOG(2)<<"Enter Van Send: "<<time_st/CLOCKS_PER_SEC<<" "<<msg.meta.sender<<" "<<msg.meta.recver;
@@ -388,6 +516,7 @@ int Van::Send(const Message& msg) {
 }
 
 void Van::Receiving() {
+  PinCurrentThread("PS_RECV_THREAD_CPUS", "van receiving");
   Meta nodes;
   Meta recovery_nodes;  // store recovery nodes
   recovery_nodes.control.cmd = Control::ADD_NODE;
@@ -441,6 +570,11 @@ void Van::PackMeta(const Meta& meta, char** meta_buf, int* buf_size) {
   if (meta.timestamp != Meta::kEmpty) pb.set_timestamp(meta.timestamp);
   if (meta.body.size()) pb.set_body(meta.body);
   pb.set_push(meta.push);
+  if (meta.pull) pb.set_pull(meta.pull);
+  if (meta.version) pb.set_version(meta.version);
+  if (meta.priority) pb.set_priority(meta.priority);
+  if (meta.chunk_begin) pb.set_chunk_begin(meta.chunk_begin);
+  if (meta.clock) pb.set_clock(meta.clock);
   pb.set_request(meta.request);
   pb.set_simple_app(meta.simple_app);
   pb.set_customer_id(meta.customer_id);
@@ -483,6 +617,11 @@ void Van::UnpackMeta(const char* meta_buf, int buf_size, Meta* meta) {
   meta->timestamp = pb.has_timestamp() ? pb.timestamp() : Meta::kEmpty;
   meta->request = pb.request();
   meta->push = pb.push();
+  meta->pull = pb.pull();
+  meta->version = pb.version();
+  meta->priority = pb.priority();
+  meta->chunk_begin = pb.chunk_begin();
+  meta->clock = pb.clock();
   meta->simple_app = pb.simple_app();
   meta->body = pb.body();
   meta->customer_id = pb.customer_id();
@@ -512,6 +651,7 @@ void Van::UnpackMeta(const char* meta_buf, int buf_size, Meta* meta) {
 }
 
 void Van::Heartbeat() {
+  PinCurrentThread("PS_HEARTBEAT_THREAD_CPUS", "heartbeat");
   const char* val = Environment::Get()->find("PS_HEARTBEAT_INTERVAL");
   const int interval = val ? atoi(val) : kDefaultHeartbeatInterval;
   while (interval > 0 && ready_.load()) {
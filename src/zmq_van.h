@@ -8,6 +8,7 @@
 #include <thread>
 #include <string>
 #include "ps/internal/van.h"
+#include "ps/internal/thread_affinity.h"
 #include <time.h>
 #if _MSC_VER
 #define rand_r(x) rand()
@@ -41,9 +42,29 @@ class ZMQVan : public Van {
       context_ = zmq_ctx_new();
       CHECK(context_ != NULL) << "create 0mq context failed";
       zmq_ctx_set(context_, ZMQ_MAX_SOCKETS, 65536);
+      // the scheduler handshakes with every node at startup, more io threads
+      // let these connections be set up in parallel
+      int io_threads = GetEnv("PS_ZMQ_IO_THREADS", 1);
+      if (io_threads > 1) zmq_ctx_set(context_, ZMQ_IO_THREADS, io_threads);
+      // the io threads allocate the receive buffers, keep them next to the
+      // cores consuming the messages
+      std::vector<int> cpus = GetThreadCPUs("PS_ZMQ_IO_THREAD_CPUS");
+#ifdef ZMQ_THREAD_AFFINITY_CPU_ADD
+      for (int c : cpus) {
+        CHECK_EQ(zmq_ctx_set(context_, ZMQ_THREAD_AFFINITY_CPU_ADD, c), 0)
+            << "failed to pin zmq io threads to cpu " << c;
+      }
+      if (cpus.size()) {
+        PS_VLOG(1) << "zmq io threads are pinned to " << cpus.size() << " cpus";
+      }
+#else
+      if (cpus.size()) {
+        LOG(WARNING) << "zmq < 4.3 cannot pin its io threads, ignore "
+                     << "PS_ZMQ_IO_THREAD_CPUS";
+      }
+#endif
     }
     start_mu_.unlock();
-    // zmq_ctx_set(context_, ZMQ_IO_THREADS, 4);
     Van::Start(customer_id);
   }
 
@@ -124,6 +145,12 @@ class ZMQVan : public Van {
   }
 
   int SendMsg(const Message& msg) override {
+    int meta_size; char* meta_buf;
+    PackMeta(msg.meta, &meta_buf, &meta_size);
+    return SendPackedMsg(msg, meta_buf, meta_size);
+  }
+
+  int SendPackedMsg(const Message& msg, char* meta_buf, int meta_size) override {
     double time_st = (double)clock();
     if (Postoffice::Get()->verbose() >= 2) {
       PS_VLOG(2)<<"Enter SendMsg: "<<time_st/CLOCKS_PER_SEC<<" "<<msg.meta.sender<<" "<<msg.meta.recver;
@@ -135,13 +162,12 @@ class ZMQVan : public Van {
     auto it = senders_.find(id);
     if (it == senders_.end()) {
       LOG(WARNING) << "there is no socket to node " << id;
+      delete [] meta_buf;
       return -1;
     }
     void *socket = it->second;
 
     // send meta
-    int meta_size; char* meta_buf;
-    PackMeta(msg.meta, &meta_buf, &meta_size);
     int tag = ZMQ_SNDMORE;
     int n = msg.data.size();
     if (n == 0) tag = 0;
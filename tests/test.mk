@@ -8,3 +8,8 @@ tests/% : tests/%.cc build/libps.a
 	$(CXX) -std=c++0x $(CFLAGS) -o $@ $(filter %.cc %.a, $^) $(LDFLAGS)
 
 -include tests/*.d
+
+# the coroutine interface needs C++20
+tests/test_kv_coro : tests/test_kv_coro.cc build/libps.a
+	$(CXX) $(CFLAGS) -std=c++20 -MM -MT tests/test_kv_coro $< >tests/test_kv_coro.d
+	$(CXX) $(CFLAGS) -std=c++20 -o $@ $(filter %.cc %.a, $^) $(LDFLAGS)
@@ -50,6 +50,16 @@ void RunWorker() {
 //    LL << "before check: "<< res<< " " << repeat;
   CHECK_LT(res / repeat, 1e-5);
   LL << "error: " << res / repeat;
+
+  // push and pull in one round trip
+  std::vector<float> outs;
+  kv.Wait(kv.PushPull(keys, vals, &outs));
+  res = 0;
+  for (int i = 0; i < num; ++i) {
+    res += fabs(outs[i] - vals[i] * (repeat + 1));
+  }
+  CHECK_LT(res / (repeat + 1), 1e-5);
+  LL << "push-pull error: " << res / (repeat + 1);
 }
 
 int main(int argc, char *argv[]) {
@@ -0,0 +1,84 @@
+#include <chrono>
+#include <thread>
+#include "ps/ps.h"
+using namespace ps;
+
+void StartServer() {
+  if (!IsServer()) {
+    return;
+  }
+  auto server = new KVServer<float>(0);
+  server->set_request_handle(KVServerDefaultHandle<float>());
+  RegisterExitCallback([server](){ delete server; });
+}
+
+void RunWorker() {
+  if (!IsWorker()) return;
+  KVWorker<float> kv(0, 0);
+  kv.set_cache(1000, 0, 10);
+
+  // keys shared by all workers, and keys of this worker only
+  int num = 100;
+  int rank = MyRank();
+  std::vector<Key> shared(num), own(num);
+  for (int i = 0; i < num; ++i) {
+    shared[i] = kMaxKey / num * i;
+    own[i] = kMaxKey / num * i + rank + 1;
+  }
+  std::vector<float> ones(num, 1), vals;
+
+  // a pull right after another is a hit, and a push of the server makes the
+  // values stale
+  kv.Wait(kv.Push(own, ones));
+  kv.Wait(kv.Pull(own, &vals));
+  for (float v : vals) CHECK_EQ(v, 1);
+  kv.Wait(kv.Pull(own, &vals));
+  for (float v : vals) CHECK_EQ(v, 1);
+  KVCacheStats st = kv.GetCacheStats();
+  CHECK_EQ(st.hits, static_cast<uint64_t>(num));
+  kv.Wait(kv.Push(own, ones));
+  kv.Wait(kv.Pull(own, &vals));
+  for (float v : vals) CHECK_EQ(v, 2);
+  CHECK_GT(kv.GetCacheStats().stale, 0U);
+
+  // the first worker pushes the shared keys, the others only pull them, and
+  // must eventually see all pushes although every pull may be served locally
+  int repeat = 50;
+  if (rank == 0) {
+    for (int i = 0; i < repeat; ++i) {
+      kv.Wait(kv.Push(shared, ones));
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    return;
+  }
+  int pulls = 0;
+  while (true) {
+    kv.Wait(kv.Pull(shared, &vals));
+    ++pulls;
+    bool done = true;
+    for (float v : vals) {
+      CHECK_LE(v, repeat);
+      done = done && v == repeat;
+    }
+    if (done) break;
+    CHECK_LT(pulls, 10000) << "the pushes of the other worker are not seen";
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+  // nothing but a refresh pulls the cached keys again
+  st = kv.GetCacheStats();
+  if (pulls > 1) CHECK_GT(st.refreshes, 0U);
+  LL << "seen all pushes after " << pulls << " pulls, " << st.hits << " hits, "
+     << st.refreshes << " refreshes";
+}
+
+int main(int argc, char *argv[]) {
+  // start system
+  Start(0);
+  // setup server nodes
+  StartServer();
+  // run worker nodes
+  RunWorker();
+  // stop system
+  Finalize(0, true);
+  return 0;
+}
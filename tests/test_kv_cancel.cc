@@ -0,0 +1,101 @@
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include "ps/ps.h"
+using namespace ps;
+
+// cmd 1 responds late, a pull with cmd 2 responds two values per key with lens
+struct SlowHandle {
+  void operator()(const KVMeta& req_meta, const KVPairs<float>& req_data,
+                  KVServer<float>* server) {
+    if (req_meta.cmd == 1) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(200));
+    }
+    if (req_meta.cmd == 2 && !req_meta.push) {
+      size_t n = req_data.keys.size();
+      KVPairs<float> res;
+      res.keys = req_data.keys;
+      res.lens.resize(n, 2);
+      res.vals.resize(n * 2);
+      for (size_t i = 0; i < n * 2; ++i) res.vals[i] = i;
+      server->Response(req_meta, res);
+      return;
+    }
+    handle(req_meta, req_data, server);
+  }
+  KVServerDefaultHandle<float> handle;
+};
+
+void StartServer() {
+  if (!IsServer()) {
+    return;
+  }
+  auto server = new KVServer<float>(0);
+  server->set_request_handle(SlowHandle());
+  RegisterExitCallback([server](){ delete server; });
+}
+
+void RunWorker() {
+  if (!IsWorker()) return;
+  KVWorker<float> kv(0, 0);
+
+  int num = 1000;
+  int rank = MyRank();
+  std::vector<Key> keys(num);
+  std::vector<float> ones(num, 1);
+  for (int i = 0; i < num; ++i) keys[i] = kMaxKey / num * i + rank;
+  kv.Wait(kv.Push(keys, ones));
+
+  // a timed wait gives up on a slow request, which is still waited for later
+  std::vector<float> vals;
+  int ts = kv.Pull(keys, &vals, nullptr, 1);
+  CHECK(!kv.Wait(ts, 20)) << "the slow pull finished in time";
+  CHECK(kv.Wait(ts, 10000));
+  CHECK(kv.Wait(ts, 0));
+  CHECK_EQ(vals.size(), keys.size());
+  for (float v : vals) CHECK_EQ(v, 1);
+
+  // a cancelled request is finished, its callback is dropped and its buffer
+  // is never written again
+  std::atomic<bool> called{false};
+  auto buf = new std::vector<float>();
+  ts = kv.Pull(keys, buf, nullptr, 1, [&called]() { called = true; });
+  CHECK(!kv.Wait(ts, 20));
+  kv.Cancel(ts);
+  CHECK(kv.Wait(ts, 0));
+  delete buf;
+  std::this_thread::sleep_for(std::chrono::milliseconds(400));
+  CHECK(!called) << "the callback of a cancelled pull is called";
+
+  // cancel while the replies are merged into the buffers by the callback,
+  // which must have returned when Cancel does
+  std::atomic<bool> started{false}, finished{false};
+  auto lens = new std::vector<int>();
+  buf = new std::vector<float>();
+  ts = kv.Pull(keys, buf, lens, 2, [&started, &finished, buf, lens, num]() {
+      started = true;
+      std::this_thread::sleep_for(std::chrono::milliseconds(100));
+      CHECK_EQ(lens->size(), static_cast<size_t>(num));
+      CHECK_EQ(buf->size(), static_cast<size_t>(num * 2));
+      finished = true;
+    });
+  while (!started) std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  kv.Cancel(ts);
+  CHECK(finished) << "Cancel returned while the callback is running";
+  delete buf;
+  delete lens;
+  kv.Wait(ts);
+  LL << "timed wait and cancel done";
+}
+
+int main(int argc, char *argv[]) {
+  // start system
+  Start(0);
+  // setup server nodes
+  StartServer();
+  // run worker nodes
+  RunWorker();
+  // stop system
+  Finalize(0, true);
+  return 0;
+}
@@ -0,0 +1,85 @@
+#include "ps/ps.h"
+using namespace ps;
+
+// the default handle, counting the chunks after the first of every request
+struct ChunkCountingHandle {
+  void operator()(const KVMeta& req_meta, const KVPairs<float>& req_data,
+                  KVServer<float>* server) {
+    if (req_meta.chunk_begin > 0) ++*num_chunks;
+    handle(req_meta, req_data, server);
+  }
+  KVServerDefaultHandle<float> handle;
+  std::shared_ptr<int> num_chunks = std::make_shared<int>(0);
+};
+
+void StartServer() {
+  if (!IsServer()) {
+    return;
+  }
+  auto server = new KVServer<float>(0);
+  ChunkCountingHandle handle;
+  auto num_chunks = handle.num_chunks;
+  server->set_request_handle(handle);
+  RegisterExitCallback([server, num_chunks](){
+      delete server;
+      CHECK_GT(*num_chunks, 0) << "no request was chunked";
+      LL << "served " << *num_chunks << " chunks after the first ones";
+    });
+}
+
+void RunWorker() {
+  if (!IsWorker()) return;
+  KVWorker<float> kv(0, 0);
+  // 16 values, or pulled keys, per chunk
+  kv.set_chunk_bytes(16 * sizeof(float));
+
+  int num = 1000;
+  int rank = MyRank();
+  std::vector<Key> keys(num);
+  std::vector<float> vals(num);
+  srand(rank + 7);
+  for (int i = 0; i < num; ++i) {
+    keys[i] = kMaxKey / num * i + rank;
+    vals[i] = (rand() % 1000);
+  }
+
+  // a chunked request is still one for Wait and the callback
+  int repeat = 5, num_done = 0;
+  std::vector<int> ts;
+  for (int i = 0; i < repeat; ++i) {
+    ts.push_back(kv.Push(keys, vals, {}, 0, [&num_done]() { ++num_done; }));
+  }
+  for (int t : ts) kv.Wait(t);
+  CHECK_EQ(num_done, repeat);
+
+  std::vector<float> rets;
+  kv.Wait(kv.Pull(keys, &rets, nullptr, 0, [&num_done]() { ++num_done; }));
+  CHECK_EQ(num_done, repeat + 1);
+  CHECK_EQ(rets.size(), vals.size());
+  for (int i = 0; i < num; ++i) CHECK_EQ(rets[i], vals[i] * repeat);
+
+  // push and pull in one round trip
+  std::vector<float> outs;
+  kv.Wait(kv.PushPull(keys, vals, &outs));
+  CHECK_EQ(outs.size(), vals.size());
+  for (int i = 0; i < num; ++i) CHECK_EQ(outs[i], vals[i] * (repeat + 1));
+
+  // a few keys fit into a single chunk
+  std::vector<Key> few(keys.begin(), keys.begin() + 3);
+  std::vector<float> few_rets;
+  kv.Wait(kv.Pull(few, &few_rets));
+  for (int i = 0; i < 3; ++i) CHECK_EQ(few_rets[i], vals[i] * (repeat + 1));
+  LL << "pushed and pulled " << num << " keys in chunks";
+}
+
+int main(int argc, char *argv[]) {
+  // start system
+  Start(0);
+  // setup server nodes
+  StartServer();
+  // run worker nodes
+  RunWorker();
+  // stop system
+  Finalize(0, true);
+  return 0;
+}
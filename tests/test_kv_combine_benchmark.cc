@@ -0,0 +1,90 @@
+#include <chrono>
+#include <map>
+#include "ps/ps.h"
+using namespace ps;
+
+// usage: test_kv_combine_benchmark [num_keys] [num_unique] [val_len] [threads]
+// it does not start the system, so run it directly rather than by local.sh
+template <typename Fn>
+double Time(const Fn& fn, int repeat) {
+  auto tic = std::chrono::steady_clock::now();
+  for (int i = 0; i < repeat; ++i) fn();
+  auto toc = std::chrono::steady_clock::now();
+  return std::chrono::duration<double>(toc - tic).count() / repeat;
+}
+
+// combine by std::sort, as a baseline
+void SortCombine(const SArray<Key>& keys, const SArray<float>& vals,
+                 size_t k, KVPairs<float>* kvs) {
+  std::vector<std::pair<Key, size_t>> pairs(keys.size());
+  for (size_t j = 0; j < keys.size(); ++j) pairs[j] = std::make_pair(keys[j], j);
+  std::sort(pairs.begin(), pairs.end());
+  kvs->keys.clear();
+  kvs->vals.clear();
+  for (size_t j = 0; j < pairs.size(); ++j) {
+    const float* src = vals.data() + pairs[j].second * k;
+    if (j == 0 || pairs[j].first != pairs[j-1].first) {
+      kvs->keys.push_back(pairs[j].first);
+      for (size_t t = 0; t < k; ++t) kvs->vals.push_back(src[t]);
+    } else {
+      float* dst = kvs->vals.data() + kvs->vals.size() - k;
+      for (size_t t = 0; t < k; ++t) dst[t] += src[t];
+    }
+  }
+}
+
+int main(int argc, char *argv[]) {
+  size_t num_keys = argc > 1 ? atol(argv[1]) : 10000000;
+  size_t num_unique = argc > 2 ? atol(argv[2]) : 1000000;
+  size_t val_len = argc > 3 ? atol(argv[3]) : 1;
+  int num_threads = argc > 4 ? atoi(argv[4]) : 4;
+  int repeat = 5;
+
+  SArray<Key> keys(num_keys);
+  SArray<float> vals(num_keys * val_len);
+  srand(0);
+  for (size_t i = 0; i < num_keys; ++i) {
+    keys[i] = (static_cast<Key>(rand()) * 7919 % num_unique) * 1000003;
+  }
+  for (size_t i = 0; i < vals.size(); ++i) vals[i] = rand() % 100;
+
+  // check against std::map
+  KVPairs<float> kvs;
+  std::vector<size_t> index;
+  CombineKVPairs(keys, vals, &kvs, &index, num_threads);
+  std::map<Key, std::vector<float>> expected;
+  for (size_t i = 0; i < num_keys; ++i) {
+    auto& v = expected[keys[i]];
+    v.resize(val_len, 0);
+    for (size_t t = 0; t < val_len; ++t) v[t] += vals[i * val_len + t];
+  }
+  CHECK_EQ(kvs.keys.size(), expected.size());
+  size_t u = 0;
+  for (const auto& e : expected) {
+    CHECK_EQ(kvs.keys[u], e.first);
+    for (size_t t = 0; t < val_len; ++t) {
+      CHECK_EQ(kvs.vals[u * val_len + t], e.second[t]);
+    }
+    ++u;
+  }
+  for (size_t i = 0; i < num_keys; ++i) CHECK_EQ(kvs.keys[index[i]], keys[i]);
+  SArray<float> expanded;
+  ExpandVals(kvs.keys, index, kvs.vals, &expanded, num_threads);
+  CHECK_EQ(expanded.size(), num_keys * val_len);
+  for (size_t i = 0; i < num_keys; ++i) {
+    CHECK_EQ(expanded[i * val_len], kvs.vals[index[i] * val_len]);
+  }
+
+  LL << num_keys << " keys, " << kvs.keys.size() << " unique, value length "
+     << val_len << ", time per combine in sec:";
+  LL << "std::sort:          "
+     << Time([&]() { SortCombine(keys, vals, val_len, &kvs); }, repeat);
+  LL << "radix, 1 thread:    "
+     << Time([&]() { CombineKVPairs(keys, vals, &kvs, &index, 1); }, repeat);
+  LL << "radix, " << num_threads << " threads:   "
+     << Time([&]() { CombineKVPairs(keys, vals, &kvs, &index, num_threads); }, repeat);
+  LL << "expand, " << num_threads << " threads:  "
+     << Time([&]() { ExpandVals(kvs.keys, index, kvs.vals, &expanded, num_threads); },
+             repeat);
+  return 0;
+}
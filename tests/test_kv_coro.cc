@@ -0,0 +1,90 @@
+#include "ps/ps.h"
+#include "ps/kv_coro.h"
+using namespace ps;
+
+// built with C++20, see test.mk. Without coroutine support it does nothing
+#ifdef PS_HAS_COROUTINE
+// push ones and pull them back, every task on its own keys
+Task Train(KVWorker<float>* kv, SArray<Key> keys, int iters, int* done) {
+  SArray<float> ones(keys.size(), 1), vals;
+  for (int i = 0; i < iters; ++i) {
+    co_await AsyncPush(kv, keys, ones);
+    co_await AsyncPull(kv, keys, &vals);
+    CHECK_EQ(vals.size(), keys.size());
+    for (float v : vals) CHECK_EQ(v, i + 1);
+  }
+  ++*done;
+}
+
+// pulls all served by the cache, so every request finishes within the call
+Task PullCached(KVWorker<float>* kv, SArray<Key> keys, int iters, int* done) {
+  SArray<float> vals;
+  for (int i = 0; i < iters; ++i) {
+    co_await AsyncPull(kv, keys, &vals);
+  }
+  ++*done;
+}
+
+void StartServer() {
+  if (!IsServer()) return;
+  auto server = new KVServer<float>(0);
+  server->set_request_handle(KVServerDefaultHandle<float>());
+  RegisterExitCallback([server](){ delete server; });
+}
+
+void RunWorker() {
+  if (!IsWorker()) return;
+  KVWorker<float> kv(0, 0);
+  int rank = MyRank();
+  int num_tasks = 100, iters = 20;
+  auto keys_of = [rank](int task) {
+    SArray<Key> keys(4);
+    for (int j = 0; j < 4; ++j) {
+      keys[j] = kMaxKey / 4 * j + (rank * 10000 + task) * 2;
+    }
+    return keys;
+  };
+
+  // many tasks with requests inflight, resumed by the thread running the
+  // scheduler, and then by the receiving thread
+  for (int inline_resume = 0; inline_resume < 2; ++inline_resume) {
+    Scheduler sched(inline_resume);
+    int done = 0;
+    for (int t = 0; t < num_tasks; ++t) {
+      sched.Spawn(Train(&kv, keys_of(t + inline_resume * num_tasks), iters, &done));
+    }
+    sched.Run();
+    CHECK_EQ(done, num_tasks);
+  }
+
+  // requests finishing synchronously must not nest a frame each, so the
+  // cache never asks the servers again
+  KVWorker<float> cached(0, 1);
+  cached.set_cache(100, 1 << 30, 1 << 30);
+  SArray<Key> keys = keys_of(0);
+  SArray<float> vals;
+  cached.Wait(cached.ZPull(keys, &vals));
+  for (int inline_resume = 0; inline_resume < 2; ++inline_resume) {
+    Scheduler sched(inline_resume);
+    int done = 0;
+    sched.Spawn(PullCached(&cached, keys, 1000000, &done));
+    sched.Run();
+    CHECK_EQ(done, 1);
+  }
+  CHECK_GE(cached.GetCacheStats().hits, 2000000U * keys.size());
+  LL << "coroutines done";
+}
+
+int main(int argc, char *argv[]) {
+  Start(0);
+  StartServer();
+  RunWorker();
+  Finalize(0, true);
+  return 0;
+}
+#else
+int main(int argc, char *argv[]) {
+  LL << "skipped, coroutines need C++20";
+  return 0;
+}
+#endif  // PS_HAS_COROUTINE
@@ -0,0 +1,67 @@
+#include <algorithm>
+#include <chrono>
+#include <thread>
+#include "ps/ps.h"
+using namespace ps;
+
+const int kStaleness = 1;
+const int kIters = 6;
+
+void StartServer() {
+  if (!IsServer()) {
+    return;
+  }
+  auto server = new KVServer<float>(0);
+  // keep a copy to see the clocks
+  KVSSPHandle<float> handle(kStaleness);
+  server->set_request_handle(handle);
+  size_t num_workers = NumWorkers();
+  RegisterExitCallback([server, handle, num_workers](){
+      delete server;
+      // every pull parked is released, and the slowest worker got to the end
+      CHECK_EQ(handle.num_parked(), 0U);
+      CHECK_EQ(handle.clocks().size(), num_workers);
+      CHECK_EQ(handle.min_clock(), kIters - 1);
+    });
+}
+
+void RunWorker() {
+  if (!IsWorker()) return;
+  KVWorker<float> kv(0, 0);
+
+  int num = 100;
+  int rank = MyRank(), num_workers = NumWorkers();
+  std::vector<Key> keys(num);
+  for (int i = 0; i < num; ++i) keys[i] = kMaxKey / num * i;
+  std::vector<float> ones(num, 1);
+
+  for (int c = 0; c < kIters; ++c) {
+    kv.set_clock(c);
+    // the straggler, the pulls of the others are parked on it
+    if (rank == 0) std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    kv.Wait(kv.Push(keys, ones));
+    std::vector<float> outs;
+    kv.Wait(kv.Pull(keys, &outs));
+    // every other worker pushed at clocks 0 to c-staleness at least, and is at
+    // most staleness+1 clocks ahead
+    float lo = (c + 1) + (num_workers - 1) * std::max(0, c - kStaleness);
+    float hi = (c + 1) + (num_workers - 1) * std::min(kIters, c + kStaleness + 2);
+    for (float v : outs) {
+      CHECK(v >= lo && v <= hi) << "clock " << c << ": " << v << " not in ["
+                                << lo << ", " << hi << "]";
+    }
+  }
+  LL << "ran " << kIters << " clocks with staleness " << kStaleness;
+}
+
+int main(int argc, char *argv[]) {
+  // start system
+  Start(0);
+  // setup server nodes
+  StartServer();
+  // run worker nodes
+  RunWorker();
+  // stop system
+  Finalize(0, true);
+  return 0;
+}
@@ -0,0 +1,191 @@
+#include <chrono>
+#include <thread>
+#include <unordered_map>
+#include "ps/ps.h"
+using namespace ps;
+
+// usage: test_kv_store_benchmark [num_keys] [batch_size] [val_len]
+// it does not start the system, so run it directly rather than by local.sh
+template <typename Fn>
+double Time(const Fn& fn, int repeat) {
+  auto tic = std::chrono::steady_clock::now();
+  for (int i = 0; i < repeat; ++i) fn();
+  auto toc = std::chrono::steady_clock::now();
+  return std::chrono::duration<double>(toc - tic).count() / repeat;
+}
+
+// the store of KVServerDefaultHandle, with a value index per key so that it
+// also takes values longer than 1
+struct MapStore {
+  explicit MapStore(size_t k) : k(k) { }
+  void Add(const Key* keys, size_t n, const float* src) {
+    for (size_t j = 0; j < n; ++j) {
+      auto it = index.find(keys[j]);
+      if (it == index.end()) {
+        it = index.insert(std::make_pair(keys[j], vals.size())).first;
+        vals.resize(vals.size() + k, 0);
+      }
+      float* v = vals.data() + it->second;
+      for (size_t t = 0; t < k; ++t) v[t] += src[j * k + t];
+    }
+  }
+  void Read(const Key* keys, size_t n, float* dst) const {
+    for (size_t j = 0; j < n; ++j) {
+      auto it = index.find(keys[j]);
+      if (it == index.end()) {
+        memset(dst + j * k, 0, k * sizeof(float));
+      } else {
+        memcpy(dst + j * k, vals.data() + it->second, k * sizeof(float));
+      }
+    }
+  }
+  size_t k;
+  std::unordered_map<Key, size_t> index;
+  std::vector<float> vals;
+};
+
+int main(int argc, char *argv[]) {
+  size_t num_keys = argc > 1 ? atol(argv[1]) : 1000000;
+  size_t batch_size = argc > 2 ? atol(argv[2]) : 10000;
+  size_t val_len = argc > 3 ? atol(argv[3]) : 1;
+  size_t num_batches = 10 * num_keys / batch_size + 1;
+
+  // requests of sorted random keys, as a server receives them
+  srand(0);
+  std::vector<std::vector<Key>> batches(num_batches);
+  for (auto& b : batches) {
+    b.resize(batch_size);
+    for (auto& key : b) key = (static_cast<Key>(rand()) * 7919 % num_keys) * 1000003;
+    std::sort(b.begin(), b.end());
+    b.erase(std::unique(b.begin(), b.end()), b.end());
+  }
+  std::vector<float> vals(batch_size * val_len);
+  for (size_t i = 0; i < vals.size(); ++i) vals[i] = rand() % 100;
+  std::vector<float> out(batch_size * val_len), expected(batch_size * val_len);
+
+  // check against the map
+  MapStore map(val_len);
+  KVStore<float> store(val_len);
+  for (const auto& b : batches) {
+    map.Add(b.data(), b.size(), vals.data());
+    store.Add(b.data(), b.size(), vals.data());
+  }
+  CHECK_EQ(map.index.size(), store.size());
+  for (const auto& b : batches) {
+    map.Read(b.data(), b.size(), expected.data());
+    store.Read(b.data(), b.size(), out.data());
+    CHECK_EQ(memcmp(out.data(), expected.data(), b.size() * val_len * sizeof(float)), 0);
+  }
+
+  // read while a writer adds 1 to all values of a key, a torn read would see
+  // unequal values
+  {
+    KVStore<float> s(val_len);
+    std::vector<float> ones(batch_size * val_len, 1);
+    std::atomic<bool> done{false};
+    std::thread writer([&]() {
+        for (int r = 0; r < 3; ++r) {
+          for (const auto& b : batches) s.Add(b.data(), b.size(), ones.data());
+        }
+        done = true;
+      });
+    while (!done) {
+      for (size_t i = 0; i < batches.size() && !done; i += 7) {
+        const auto& b = batches[i];
+        s.Read(b.data(), b.size(), out.data());
+        for (size_t j = 0; j < b.size(); ++j) {
+          for (size_t t = 1; t < val_len; ++t) {
+            CHECK_EQ(out[j * val_len + t], out[j * val_len]);
+          }
+        }
+      }
+    }
+    writer.join();
+  }
+
+  size_t num_requests = 0;
+  for (const auto& b : batches) num_requests += b.size();
+  LL << num_keys << " keys, " << num_requests << " keys requested in batches of "
+     << batch_size << ", value length " << val_len << ", time in sec:";
+  LL << "unordered_map, push: " << Time([&]() {
+      MapStore m(val_len);
+      for (const auto& b : batches) m.Add(b.data(), b.size(), vals.data());
+    }, 1);
+  LL << "KVStore, push:       " << Time([&]() {
+      KVStore<float> s(val_len);
+      for (const auto& b : batches) s.Add(b.data(), b.size(), vals.data());
+    }, 1);
+  LL << "unordered_map, pull: " << Time([&]() {
+      for (const auto& b : batches) map.Read(b.data(), b.size(), out.data());
+    }, 1);
+  LL << "KVStore, pull:       " << Time([&]() {
+      for (const auto& b : batches) store.Read(b.data(), b.size(), out.data());
+    }, 1);
+
+  // checkpoint a store, update a tenth of the batches and checkpoint the
+  // delta, then restore both into an empty store
+  {
+    std::string prefix = "kv_store_benchmark";
+    remove((prefix + ".manifest").c_str());
+    auto s = std::make_shared<KVStore<float>>(val_len);
+    for (const auto& b : batches) s->Add(b.data(), b.size(), vals.data());
+    KVCheckpointer<float> ckpt(prefix);
+    LL << "checkpoint, full:    " << Time([&]() {
+        ckpt.Checkpoint(s);
+        ckpt.Wait();
+      }, 1);
+    for (size_t i = 0; i < batches.size(); i += 10) {
+      s->Add(batches[i].data(), batches[i].size(), vals.data());
+    }
+    LL << "checkpoint, delta:   " << Time([&]() {
+        ckpt.Checkpoint(s, true);
+        ckpt.Wait();
+      }, 1);
+    KVStore<float> restored(val_len);
+    LL << "restore:             " << Time([&]() { CHECK(ckpt.Restore(&restored)); }, 1);
+    CHECK_EQ(restored.size(), s->size());
+    for (const auto& b : batches) {
+      s->Read(b.data(), b.size(), expected.data());
+      restored.Read(b.data(), b.size(), out.data());
+      CHECK_EQ(memcmp(out.data(), expected.data(), b.size() * val_len * sizeof(float)), 0);
+    }
+    for (const char* f : {"-0.full", "-1.delta", ".manifest"}) remove((prefix + f).c_str());
+  }
+
+  // a dense model, whose requests are blocks of consecutive keys plus a few
+  // keys outside the dense range
+  Range range(1000, 1000 + num_keys);
+  for (auto& b : batches) {
+    Key start = range.begin() + rand() % (num_keys - batch_size + 1);
+    for (size_t j = 0; j < b.size(); ++j) b[j] = start + j;
+    b.push_back(range.end() + rand() % 100);
+    b.erase(std::unique(b.begin(), b.end()), b.end());
+  }
+  out.resize((batch_size + 1) * val_len);
+  expected.resize(out.size());
+  vals.resize(out.size());
+  KVStore<float> hashed(val_len);
+  KVDenseStore<float> dense(range, val_len);
+  for (const auto& b : batches) {
+    hashed.Add(b.data(), b.size(), vals.data());
+    dense.Add(b.data(), b.size(), vals.data());
+  }
+  for (const auto& b : batches) {
+    hashed.Read(b.data(), b.size(), expected.data());
+    dense.Read(b.data(), b.size(), out.data());
+    CHECK_EQ(memcmp(out.data(), expected.data(), b.size() * val_len * sizeof(float)), 0);
+  }
+  LL << "dense keys, KVStore, push:      " << Time([&]() {
+      for (const auto& b : batches) hashed.Add(b.data(), b.size(), vals.data());
+    }, 1);
+  LL << "dense keys, KVDenseStore, push: " << Time([&]() {
+      for (const auto& b : batches) dense.Add(b.data(), b.size(), vals.data());
+    }, 1);
+  LL << "dense keys, KVStore, pull:      " << Time([&]() {
+      for (const auto& b : batches) hashed.Read(b.data(), b.size(), out.data());
+    }, 1);
+  LL << "dense keys, KVDenseStore, pull: " << Time([&]() {
+      for (const auto& b : batches) dense.Read(b.data(), b.size(), out.data());
+    }, 1);
+  return 0;
+}
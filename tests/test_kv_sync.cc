@@ -0,0 +1,77 @@
+#include <chrono>
+#include <thread>
+#include "ps/ps.h"
+#include "math.h"
+using namespace ps;
+
+void StartServer() {
+  if (!IsServer()) {
+    return;
+  }
+  auto server = new KVServer<float>(0);
+  server->set_request_handle(KVSyncHandle<float>());
+  RegisterExitCallback([server](){ delete server; });
+}
+
+void RunWorker() {
+  if (!IsWorker()) return;
+  KVWorker<float> kv(0, 0);
+
+  // all workers push the same keys, 3 values each
+  int num = 1000, k = 3;
+  int rank = MyRank(), num_workers = NumWorkers();
+  std::vector<Key> keys(num);
+  for (int i = 0; i < num; ++i) keys[i] = kMaxKey / num * i;
+  std::vector<float> vals(num * k);
+  for (int i = 0; i < num * k; ++i) vals[i] = rank + 1 + i % 7;
+  // the sum of the pushes of all workers in the given number of rounds
+  auto check = [&](int rounds, const std::vector<float>& outs) {
+    CHECK_EQ(outs.size(), vals.size());
+    for (int i = 0; i < num * k; ++i) {
+      float sum = 0;
+      for (int r = 0; r < num_workers; ++r) sum += r + 1 + i % 7;
+      CHECK_LT(fabs(outs[i] - sum * rounds), 1e-3)
+          << "value " << i << " after " << rounds << " rounds";
+    }
+  };
+
+  // a push is responded once the round of all workers is applied, so the
+  // pull after it sees the whole round, even with a straggler
+  int rounds = 0;
+  for (int r = 0; r < 5; ++r) {
+    if (rank == 0) std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    kv.Wait(kv.Push(keys, vals));
+    ++rounds;
+    std::vector<float> outs;
+    kv.Wait(kv.Pull(keys, &outs));
+    check(rounds, outs);
+  }
+
+  // push a round ahead without waiting, the pull is parked until both of the
+  // rounds pushed are applied
+  int a = kv.Push(keys, vals);
+  int b = kv.Push(keys, vals);
+  rounds += 2;
+  std::vector<float> outs;
+  kv.Wait(kv.Pull(keys, &outs));
+  check(rounds, outs);
+  kv.Wait(a);
+  kv.Wait(b);
+
+  // push and pull in one round trip
+  kv.Wait(kv.PushPull(keys, vals, &outs));
+  check(++rounds, outs);
+  LL << "synchronized " << rounds << " rounds";
+}
+
+int main(int argc, char *argv[]) {
+  // start system
+  Start(0);
+  // setup server nodes
+  StartServer();
+  // run worker nodes
+  RunWorker();
+  // stop system
+  Finalize(0, true);
+  return 0;
+}
@@ -0,0 +1,82 @@
+#include "ps/ps.h"
+#include "math.h"
+using namespace ps;
+
+void StartServer() {
+  if (!IsServer()) {
+    return;
+  }
+  auto server = new KVServer<float>(0);
+  server->set_request_handle(KVServerDefaultHandle<float>());
+  RegisterExitCallback([server](){ delete server; });
+}
+
+void RunWorker() {
+  if (!IsWorker()) return;
+  // two workers in this process, whose pushes are summed locally
+  KVWorker<float> kv0(0, 0), kv1(0, 1);
+  kv0.set_local_aggregate(2);
+  kv1.set_local_aggregate(2);
+
+  int num = 1000;
+  std::vector<Key> keys(num);
+  std::vector<float> vals0(num), vals1(num);
+  int rank = MyRank();
+  srand(rank + 7);
+  for (int i = 0; i < num; ++i) {
+    keys[i] = kMaxKey / num * i + rank;
+    vals0[i] = (rand() % 1000);
+    vals1[i] = (rand() % 1000);
+  }
+
+  // kv0 joins first, so kv1 pushes the sums
+  int repeat = 20;
+  int done0 = 0, done1 = 0;
+  std::vector<int> ts0, ts1;
+  for (int i = 0; i < repeat; ++i) {
+    ts0.push_back(kv0.Push(keys, vals0, {}, 0, [&done0]() { ++done0; }));
+    ts1.push_back(kv1.Push(keys, vals1, {}, 0, [&done1]() { ++done1; }));
+  }
+  for (int t : ts0) kv0.Wait(t);
+  for (int t : ts1) kv1.Wait(t);
+  CHECK_EQ(done0, repeat);
+  CHECK_EQ(done1, repeat);
+
+  uint64_t sent0 = 0, sent1 = 0;
+  for (uint64_t n : kv0.GetKeysSent()) sent0 += n;
+  for (uint64_t n : kv1.GetKeysSent()) sent1 += n;
+  CHECK_EQ(sent0, 0U) << "kv0 pushed although aggregated";
+  CHECK_EQ(sent1, static_cast<uint64_t>(num * repeat));
+
+  // the servers see the sums
+  std::vector<float> rets;
+  kv0.Wait(kv0.Pull(keys, &rets));
+  float res = 0;
+  for (int i = 0; i < num; ++i) {
+    res += fabs(rets[i] - (vals0[i] + vals1[i]) * repeat);
+  }
+  CHECK_LT(res / repeat, 1e-5);
+  LL << "error: " << res / repeat;
+
+  // a worker leaving the group pushes on its own again
+  kv0.set_local_aggregate(0);
+  kv0.Wait(kv0.Push(keys, vals0));
+  kv0.Wait(kv0.Pull(keys, &rets));
+  res = 0;
+  for (int i = 0; i < num; ++i) {
+    res += fabs(rets[i] - (vals0[i] + vals1[i]) * repeat - vals0[i]);
+  }
+  CHECK_LT(res / repeat, 1e-5);
+}
+
+int main(int argc, char *argv[]) {
+  // start system
+  Start(0);
+  // setup server nodes
+  StartServer();
+  // run worker nodes
+  RunWorker();
+  // stop system
+  Finalize(0, true);
+  return 0;
+}
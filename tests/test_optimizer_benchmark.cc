@@ -0,0 +1,61 @@
+#include <chrono>
+#include <math.h>
+#include <stdio.h>
+#include "ps/ps.h"
+using namespace ps;
+
+// usage: test_optimizer_benchmark [num_keys] [val_len]
+// it does not start the system, so run it directly rather than by local.sh
+int main(int argc, char *argv[]) {
+  size_t num_keys = argc > 1 ? atol(argv[1]) : 100000;
+  size_t k = argc > 2 ? atol(argv[2]) : 64;
+  int repeat = 10;
+  const char* names[] = {"SGD", "MOMENTUM", "ADAGRAD", "ADAM", "ADAMW", "FTRL", "LAMB"};
+  const char* isas[] = {"scalar", "avx2", "avx512"};
+
+  srand(0);
+  std::vector<float> grads(num_keys * k);
+  for (auto& g : grads) g = static_cast<float>(rand()) / RAND_MAX - .5f;
+
+  LL << num_keys << " keys, " << k << " parameters per key, " << repeat
+     << " updates per key, parameter updates per sec:";
+  for (int t = OptimizerConfig::SGD; t <= OptimizerConfig::LAMB; ++t) {
+    OptimizerConfig cfg;
+    cfg.type = static_cast<OptimizerConfig::Type>(t);
+    cfg.weight_decay = 1e-4f;
+    cfg.l1 = 1e-3f;
+    cfg.l2 = 1e-3f;
+    std::vector<float> expected;
+    std::string line = names[t];
+    for (const char* isa : isas) {
+      if (!Optimizer::Supported(isa)) continue;
+      Optimizer opt(cfg, isa);
+      size_t len = opt.ValLen(k);
+      CHECK_EQ(opt.ParamLen(len), k);
+      std::vector<float> vals(num_keys * len, 0);
+      auto tic = std::chrono::steady_clock::now();
+      for (int r = 0; r < repeat; ++r) {
+        for (size_t i = 0; i < num_keys; ++i) {
+          opt.Update(vals.data() + i * len, grads.data() + i * k, k);
+        }
+      }
+      auto toc = std::chrono::steady_clock::now();
+      double sec = std::chrono::duration<double>(toc - tic).count();
+      char buf[64];
+      snprintf(buf, sizeof(buf), ", %s: %.0fM", isa, num_keys * k * repeat / sec / 1e6);
+      line += buf;
+
+      // the same results as the scalar kernels up to rounding
+      if (expected.empty()) {
+        expected = vals;
+        continue;
+      }
+      for (size_t i = 0; i < vals.size(); ++i) {
+        CHECK_LE(fabs(vals[i] - expected[i]), 1e-4 * (1 + fabs(expected[i])))
+            << names[t] << " " << isa << " at " << i;
+      }
+    }
+    LL << line;
+  }
+  return 0;
+}
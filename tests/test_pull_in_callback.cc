@@ -0,0 +1,45 @@
+#include <chrono>
+#include "ps/ps.h"
+using namespace ps;
+
+// pulls issued by callbacks must not wait for the pull buffers, which only
+// the receiving thread running the callbacks releases
+void StartServer() {
+  if (!IsServer()) return;
+  auto server = new KVServer<float>(0);
+  server->set_request_handle(KVServerDefaultHandle<float>());
+  RegisterExitCallback([server](){ delete server; });
+}
+
+void RunWorker() {
+  if (!IsWorker()) return;
+  KVWorker<float> kv(0, 0);
+  int rank = MyRank();
+  std::vector<Key> keys = {(Key)rank, kMaxKey / 2 + rank};
+  std::vector<float> vals = {1, 2};
+  kv.Wait(kv.Push(keys, vals));
+
+  // the callback of pull a pulls c, while pull b holds the only buffer
+  std::vector<float> a, b, c;
+  std::atomic<bool> done{false};
+  int ts = kv.Pull(keys, &a, nullptr, 0, [&]() {
+      std::this_thread::sleep_for(std::chrono::milliseconds(200));
+      kv.Pull(keys, &c, nullptr, 0, [&]() { done = true; });
+    });
+  std::this_thread::sleep_for(std::chrono::milliseconds(50));
+  kv.Wait(kv.Pull(keys, &b));
+  kv.Wait(ts);
+  while (!done) std::this_thread::yield();
+  CHECK_EQ(c.size(), keys.size());
+  for (size_t i = 0; i < keys.size(); ++i) CHECK_EQ(c[i], b[i]);
+  LL << "pulled in a callback";
+}
+
+int main(int argc, char *argv[]) {
+  setenv("PS_MAX_PULL_INFLIGHT", "1", 1);
+  Start(0);
+  StartServer();
+  RunWorker();
+  Finalize(0, true);
+  return 0;
+}
@@ -0,0 +1,62 @@
+#include "ps/ps.h"
+using namespace ps;
+
+void StartServer() {
+  if (!IsServer()) {
+    return;
+  }
+  auto server = new KVServer<float>(0);
+  server->set_request_handle(KVServerDefaultHandle<float>());
+  RegisterExitCallback([server](){ delete server; });
+}
+
+void RunWorker() {
+  if (!IsWorker()) return;
+  // two customers, whose requests have the same timestamps
+  KVWorker<float> kv(0, 0), kv1(0, 1);
+
+  int num = 100, repeat = 100;
+  int rank = MyRank(), num_workers = NumWorkers();
+  auto keys_of = [num](int r) {
+    SArray<Key> keys(num);
+    for (int i = 0; i < num; ++i) keys[i] = kMaxKey / num * i + r;
+    return keys;
+  };
+
+  // far more pushes than the credit allows in flight, with mixed priorities
+  SArray<Key> keys = keys_of(rank);
+  SArray<float> ones(num, 1), twos(num, 2);
+  std::vector<int> ts, ts1;
+  for (int i = 0; i < repeat; ++i) {
+    ts.push_back(kv.ZPush(keys, ones, {}, 0, nullptr, i % 3));
+    ts1.push_back(kv1.ZPush(keys, twos, {}, 0, nullptr, i % 3));
+  }
+
+  // the barrier is sent after the queued pushes, so every worker then sees
+  // the pushes of all others
+  Postoffice::Get()->Barrier(0, kWorkerGroup);
+  for (int r = 0; r < num_workers; ++r) {
+    SArray<float> vals;
+    kv.Wait(kv.ZPull(keys_of(r), &vals, nullptr, 0, nullptr, r % 3));
+    CHECK_EQ(vals.size(), static_cast<size_t>(num));
+    for (float v : vals) CHECK_EQ(v, repeat * 3) << "pushes of worker " << r;
+  }
+  for (int t : ts) kv.Wait(t);
+  for (int t : ts1) kv1.Wait(t);
+  LL << "pushed " << repeat << " times with a credit of "
+     << Environment::Get()->find("PS_SEND_CREDIT") << " bytes";
+}
+
+int main(int argc, char *argv[]) {
+  // about one request in flight at a time
+  setenv("PS_SEND_CREDIT", "1024", 1);
+  // start system
+  Start(0);
+  // setup server nodes
+  StartServer();
+  // run worker nodes
+  RunWorker();
+  // stop system
+  Finalize(0, true);
+  return 0;
+}
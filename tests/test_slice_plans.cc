@@ -0,0 +1,66 @@
+#include "ps/ps.h"
+using namespace ps;
+
+void StartServer() {
+  if (!IsServer()) {
+    return;
+  }
+  auto server = new KVServer<float>(0);
+  server->set_request_handle(KVServerDefaultHandle<float>());
+  RegisterExitCallback([server](){ delete server; });
+}
+
+void RunWorker() {
+  if (!IsWorker()) return;
+  KVWorker<float> kv(0, 0);
+
+  // one key list more than memoized, all written into the same buffer, so
+  // that a plan is reused only for the same key contents
+  int num_lists = 5, num = 100, repeat = 20;
+  int rank = MyRank();
+  // the lists share some keys
+  auto key_of = [rank, num](int l, int i) -> Key {
+    return kMaxKey / num * i + rank * 1000 + (i % (l + 1) ? l : 0);
+  };
+  auto fill = [key_of, num](int l, SArray<Key>* keys) {
+    for (int i = 0; i < num; ++i) (*keys)[i] = key_of(l, i);
+  };
+  SArray<Key> keys(num);
+  SArray<float> ones(num, 1);
+  for (int r = 0; r < repeat; ++r) {
+    for (int l = 0; l < num_lists; ++l) {
+      fill(l, &keys);
+      kv.Wait(kv.ZPush(keys, ones));
+    }
+  }
+
+  // every key is pushed once by each list containing it
+  for (int l = 0; l < num_lists; ++l) {
+    fill(l, &keys);
+    SArray<float> vals;
+    kv.Wait(kv.ZPull(keys, &vals));
+    CHECK_EQ(vals.size(), keys.size());
+    for (int i = 0; i < num; ++i) {
+      int n = 0;
+      for (int m = 0; m < num_lists; ++m) {
+        n += keys[i] == key_of(m, i);
+      }
+      CHECK_EQ(vals[i], n * repeat) << "key " << keys[i] << " of list " << l;
+    }
+  }
+  LL << "sliced " << num_lists * repeat << " key lists";
+}
+
+int main(int argc, char *argv[]) {
+  // memoize fewer key lists than pushed
+  setenv("PS_SLICE_PLANS", "4", 1);
+  // start system
+  Start(0);
+  // setup server nodes
+  StartServer();
+  // run worker nodes
+  RunWorker();
+  // stop system
+  Finalize(0, true);
+  return 0;
+}
@@ -0,0 +1,112 @@
+#include <chrono>
+#include "ps/ps.h"
+using namespace ps;
+
+// usage: test_slicer_benchmark [num_keys] [num_servers] [val_len] [threads]
+// it does not start the system, so run it directly rather than by local.sh
+template <typename Fn>
+double Time(const Fn& fn, int repeat) {
+  auto tic = std::chrono::steady_clock::now();
+  for (int i = 0; i < repeat; ++i) fn();
+  auto toc = std::chrono::steady_clock::now();
+  return std::chrono::duration<double>(toc - tic).count() / repeat;
+}
+
+int main(int argc, char *argv[]) {
+  size_t num_keys = argc > 1 ? atol(argv[1]) : 10000000;
+  size_t num_servers = argc > 2 ? atol(argv[2]) : 8;
+  size_t val_len = argc > 3 ? atol(argv[3]) : 1;
+  int num_threads = argc > 4 ? atoi(argv[4]) : 4;
+  int repeat = 5;
+
+  KVPairs<float> kvs;
+  kvs.keys.resize(num_keys);
+  kvs.vals.resize(num_keys * val_len);
+  for (size_t i = 0; i < num_keys; ++i) kvs.keys[i] = i * 7;
+  for (size_t i = 0; i < kvs.vals.size(); ++i) kvs.vals[i] = i;
+  KVPairs<float> var = kvs;
+  var.lens.resize(num_keys, val_len);
+
+  // the key ranges as Postoffice::GetServerKeyRanges
+  std::vector<Range> ranges;
+  for (size_t i = 0; i < num_servers; ++i) {
+    ranges.push_back(Range(kMaxKey / num_servers * i,
+                           kMaxKey / num_servers * (i + 1)));
+  }
+
+  SlicedKVPairs<float> sliced, expected;
+  SliceByMod(var, num_servers, &expected, 1);
+  SliceByMod(kvs, num_servers, &sliced, num_threads);
+  for (size_t i = 0; i < num_servers; ++i) {
+    const auto& a = sliced[i].second;
+    const auto& b = expected[i].second;
+    CHECK_EQ(sliced[i].first, expected[i].first);
+    CHECK_EQ(a.keys.size(), b.keys.size());
+    CHECK_EQ(a.vals.size(), b.vals.size());
+    CHECK_EQ(memcmp(a.keys.data(), b.keys.data(), a.keys.size() * sizeof(Key)), 0);
+    CHECK_EQ(memcmp(a.vals.data(), b.vals.data(), a.vals.size() * sizeof(float)), 0);
+    // key j goes to server j % num_servers
+    for (size_t t = 0; t < a.keys.size(); ++t) {
+      CHECK_EQ(a.keys[t], kvs.keys[t * num_servers + i]);
+    }
+  }
+
+  // the hash slicers send every key to its owner, keeping the order of keys
+  HashRing ring(num_servers, 128);
+  auto check_owner = [&](const std::function<size_t(Key)>& owner) {
+    size_t total = 0;
+    for (size_t i = 0; i < num_servers; ++i) {
+      const auto& a = sliced[i].second;
+      CHECK_EQ(sliced[i].first, !a.keys.empty());
+      CHECK_EQ(a.vals.size(), a.keys.size() * val_len);
+      for (size_t t = 0; t < a.keys.size(); ++t) {
+        CHECK_EQ(owner(a.keys[t]), i);
+        if (t) CHECK_LT(a.keys[t-1], a.keys[t]);
+        // the values of key i * 7 start at i * val_len
+        CHECK_EQ(a.vals[t * val_len], static_cast<float>(a.keys[t] / 7 * val_len));
+      }
+      total += a.keys.size();
+    }
+    CHECK_EQ(total, num_keys);
+  };
+  SliceByHash(kvs, num_servers, &sliced);
+  check_owner([num_servers](Key key) { return SplitMix64(key) % num_servers; });
+  SliceByHashRing(kvs, num_servers, ring, &sliced);
+  check_owner([&ring](Key key) { return static_cast<size_t>(ring.Owner(key)); });
+
+  LL << num_keys << " keys, " << num_servers << " servers, value length "
+     << val_len << ", time per slice in sec:";
+  LL << "range:            "
+     << Time([&]() { SliceByRange(kvs, ranges, &sliced); }, repeat);
+  LL << "mod, 1 thread:    "
+     << Time([&]() { SliceByMod(kvs, num_servers, &sliced, 1); }, repeat);
+  LL << "mod, " << num_threads << " threads:   "
+     << Time([&]() { SliceByMod(kvs, num_servers, &sliced, num_threads); }, repeat);
+  LL << "mod with lens, 1 thread:  "
+     << Time([&]() { SliceByMod(var, num_servers, &sliced, 1); }, repeat);
+  LL << "mod with lens, " << num_threads << " threads: "
+     << Time([&]() { SliceByMod(var, num_servers, &sliced, num_threads); }, repeat);
+  LL << "hash:             "
+     << Time([&]() { SliceByHash(kvs, num_servers, &sliced); }, repeat);
+  LL << "consistent hash:  "
+     << Time([&]() { SliceByHashRing(kvs, num_servers, ring, &sliced); }, repeat);
+
+  // the load balance on clustered keys, i.e. ids in a few dense blocks
+  for (size_t i = 0; i < num_keys; ++i) {
+    kvs.keys[i] = (i % 4) * (kMaxKey / 64) + i / 4;
+  }
+  std::sort(kvs.keys.begin(), kvs.keys.end());
+  auto balance = [&]() {
+    size_t max = 0;
+    for (const auto& s : sliced) max = std::max(max, s.second.keys.size());
+    return (double)max * num_servers / num_keys;
+  };
+  LL << "max/mean keys per server on clustered keys:";
+  SliceByRange(kvs, ranges, &sliced);
+  LL << "range:            " << balance();
+  SliceByHash(kvs, num_servers, &sliced);
+  LL << "hash:             " << balance();
+  SliceByHashRing(kvs, num_servers, ring, &sliced);
+  LL << "consistent hash:  " << balance();
+  return 0;
+}
@@ -0,0 +1,16 @@
+#include <chrono>
+#include "ps/ps.h"
+using namespace ps;
+
+int main(int argc, char *argv[]) {
+  auto tic = std::chrono::steady_clock::now();
+  Start(0);
+  auto toc = std::chrono::steady_clock::now();
+  if (IsScheduler()) {
+    double sec = std::chrono::duration<double>(toc - tic).count();
+    LL << NumWorkers() << " workers and " << NumServers()
+       << " servers are started in " << sec << " sec";
+  }
+  Finalize(0, true);
+  return 0;
+}